@@ -0,0 +1,84 @@
+//------------------------------------------------------------------------------------------------
+//  flacbench.cc
+//  SF2FLAC loading throughput for tinyprimesynth
+//-------------------------------------------------------------------------------------------------
+//
+// Copyright (c) 2025 dashodanger
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//------------------------------------------------------------------------------------------------
+
+#define TINYPRIMESYNTH_FLAC_SUPPORT
+#define TINYPRIMESYNTH_IMPLEMENTATION
+#include "../tinyprimesynth.hpp"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// usage: flacbench [soundfont] [iterations] [threads]
+int main(int argc, char **argv) {
+	const char *path = argc > 1 ? argv[1] : "csound.sf2flac";
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+	unsigned int threads = argc > 3 ? (unsigned int)atoi(argv[3]) : 1;
+	if (iterations < 1) {
+		iterations = 1;
+	}
+
+	// read the file up front so that disk access is not part of the measurement
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		printf("flacbench: could not open %s\n", path);
+		return 1;
+	}
+	std::vector<uint8_t> data;
+	uint8_t chunk[65536];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		data.insert(data.end(), chunk, chunk + got);
+	}
+	fclose(file);
+
+	double total_ms = 0.0;
+	double best_ms = 0.0;
+	for (int i = 0; i < iterations; i++) {
+		tinyprimesynth::Synthesizer synth(44100.0f);
+		synth.set_load_threads(threads);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool loaded = synth.load_soundfont(data.data(), data.size());
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		if (!loaded) {
+			printf("flacbench: could not load %s\n", path);
+			return 1;
+		}
+		double ms = std::chrono::duration<double, std::milli>(end - start).count();
+		total_ms += ms;
+		if (i == 0 || ms < best_ms) {
+			best_ms = ms;
+		}
+	}
+
+	double mb = data.size() / (1024.0 * 1024.0);
+	printf("%s: %.2f MiB, %d loads on %u thread(s)\n", path, mb, iterations, threads);
+	printf("average %.2f ms (%.1f MiB/s), best %.2f ms (%.1f MiB/s)\n", total_ms / iterations,
+			mb * 1000.0 * iterations / total_ms, best_ms, mb * 1000.0 / best_ms);
+	return 0;
+}
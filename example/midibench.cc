@@ -0,0 +1,174 @@
+//------------------------------------------------------------------------------------------------
+//  midibench.cc
+//  Song loading and playback throughput for tinyprimesynth
+//-------------------------------------------------------------------------------------------------
+//
+// Copyright (c) 2025 dashodanger
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//------------------------------------------------------------------------------------------------
+
+#define TINYPRIMESYNTH_FLAC_SUPPORT
+#define TINYPRIMESYNTH_IMPLEMENTATION
+#include "../tinyprimesynth.hpp"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static void write_u32(std::vector<uint8_t> &p_out, uint32_t p_value) {
+	p_out.push_back((uint8_t)(p_value >> 24));
+	p_out.push_back((uint8_t)(p_value >> 16));
+	p_out.push_back((uint8_t)(p_value >> 8));
+	p_out.push_back((uint8_t)p_value);
+}
+
+static void write_var_len(std::vector<uint8_t> &p_out, uint32_t p_value) {
+	uint8_t bytes[5];
+	int count = 0;
+	do {
+		bytes[count++] = p_value & 0x7F;
+		p_value >>= 7;
+	} while (p_value > 0);
+	while (count > 1) {
+		p_out.push_back(bytes[--count] | 0x80);
+	}
+	p_out.push_back(bytes[0]);
+}
+
+// Builds a black MIDI style song in memory: one track per channel, each playing dense chords
+// of short notes, with some notes started again on the row that releases them
+static std::vector<uint8_t> generate_song(size_t p_notes) {
+	static constexpr int TRACKS = 16;
+	static constexpr int CHORD = 8;
+	static constexpr uint32_t STEP = 12;
+	const size_t chords = p_notes / (TRACKS * CHORD) + 1;
+
+	std::vector<uint8_t> song;
+	song.insert(song.end(), { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, TRACKS, 0, 96 });
+	uint32_t seed = 12345;
+	for (int tk = 0; tk < TRACKS; tk++) {
+		std::vector<uint8_t> track;
+		uint8_t channel = (uint8_t)tk;
+		uint8_t keys[CHORD];
+		track.insert(track.end(), { 0, (uint8_t)(0xC0 | channel), (uint8_t)(tk * 8) });
+		for (size_t c = 0; c < chords; c++) {
+			for (int k = 0; k < CHORD; k++) {
+				seed = seed * 1103515245 + 12345;
+				keys[k] = (uint8_t)(36 + (seed >> 16) % 60);
+				track.push_back(0);
+				track.insert(track.end(), { (uint8_t)(0x90 | channel), keys[k], 100 });
+			}
+			for (int k = 0; k < CHORD; k++) {
+				write_var_len(track, k == 0 ? STEP : 0);
+				track.insert(track.end(), { (uint8_t)(0x80 | channel), keys[k], 0 });
+			}
+		}
+		track.insert(track.end(), { 0, 0xFF, 0x2F, 0 });
+
+		song.insert(song.end(), { 'M', 'T', 'r', 'k' });
+		write_u32(song, (uint32_t)track.size());
+		song.insert(song.end(), track.begin(), track.end());
+	}
+	return song;
+}
+
+static bool read_file(const char *p_path, std::vector<uint8_t> &p_data) {
+	FILE *file = fopen(p_path, "rb");
+	if (!file) {
+		return false;
+	}
+	uint8_t chunk[65536];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		p_data.insert(p_data.end(), chunk, chunk + got);
+	}
+	fclose(file);
+	return true;
+}
+
+// usage: midibench [soundfont] [song | -n notes] [seconds] [threads] [incremental]
+int main(int argc, char **argv) {
+	const char *path = argc > 1 ? argv[1] : "csound.sf2flac";
+	int arg = 2;
+	std::vector<uint8_t> song;
+	const char *song_name = "ant_farm_melee.mid";
+	if (argc > 3 && strcmp(argv[2], "-n") == 0) {
+		size_t notes = (size_t)atol(argv[3]);
+		song = generate_song(notes);
+		printf("generated song with %zu notes\n", notes);
+		song_name = "generated song";
+		arg = 4;
+	} else {
+		if (argc > 2) {
+			song_name = argv[2];
+		}
+		if (!read_file(song_name, song)) {
+			printf("midibench: could not open %s\n", song_name);
+			return 1;
+		}
+		arg = 3;
+	}
+	double seconds = argc > arg ? atof(argv[arg]) : 60.0;
+	unsigned int threads = argc > arg + 1 ? (unsigned int)atoi(argv[arg + 1]) : 1;
+	bool incremental = argc > arg + 2 && atoi(argv[arg + 2]) != 0;
+
+	tinyprimesynth::Synthesizer synth(44100.0f);
+	synth.set_load_threads(threads);
+	synth.set_incremental_loading(incremental);
+	if (!synth.load_soundfont(path)) {
+		printf("midibench: could not load %s\n", path);
+		return 1;
+	}
+
+	// the file is read up front so that disk access is not part of the measurement
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool loaded = synth.load_song(song.data(), song.size());
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	if (!loaded) {
+		printf("midibench: could not load %s\n", song_name);
+		return 1;
+	}
+	double load_ms = std::chrono::duration<double, std::milli>(end - start).count();
+	if (incremental) {
+		// only the first part is read here, the rest is read as the song plays
+		printf("%s: %.2f MiB, ready to play in %.2f ms\n", song_name, song.size() / (1024.0 * 1024.0), load_ms);
+	} else {
+		printf("%s: %.2f MiB loaded in %.2f ms (%.1f MiB/s) on %u thread(s)\n", song_name, song.size() / (1024.0 * 1024.0),
+				load_ms, song.size() / (1024.0 * 1024.0) * 1000.0 / load_ms, threads);
+	}
+
+	// render in blocks the size of a typical audio callback, until the song or the time is over
+	static constexpr size_t FRAMES = 1024;
+	std::vector<float> buffer(FRAMES * 2);
+	size_t frames = 0;
+	start = std::chrono::steady_clock::now();
+	while (frames < seconds * 44100.0 && !synth.at_end()) {
+		synth.play_stream((uint8_t *)buffer.data(), buffer.size() * sizeof(float));
+		frames += FRAMES;
+	}
+	end = std::chrono::steady_clock::now();
+	double render_ms = std::chrono::duration<double, std::milli>(end - start).count();
+	double played = frames / 44100.0;
+	printf("played %.1f s in %.2f ms (%.1fx realtime)\n", played, render_ms, played * 1000.0 / render_ms);
+	return 0;
+}
@@ -0,0 +1,66 @@
+//------------------------------------------------------------------------------------------------
+//  tpscompile.cc
+//  Song compiler for tinyprimesynth
+//-------------------------------------------------------------------------------------------------
+//
+// Copyright (c) 2025 dashodanger
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//------------------------------------------------------------------------------------------------
+
+#define TINYPRIMESYNTH_IMPLEMENTATION
+#include "../tinyprimesynth.hpp"
+#include <chrono>
+#include <stdio.h>
+
+// usage: tpscompile song output
+// Loads a song of any supported format and saves it compiled, so that load_song can load the
+// output without reading its tracks
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		printf("usage: tpscompile song output\n");
+		return 1;
+	}
+
+	// the sequencer does not need a soundfont or a real output rate to read a song
+	tinyprimesynth::Synthesizer synth(44100.0f);
+	synth.set_load_threads(0);
+	if (!synth.load_song(argv[1])) {
+		printf("tpscompile: could not load %s\n", argv[1]);
+		return 1;
+	}
+	if (!synth.save_compiled_song(argv[2])) {
+		printf("tpscompile: could not write %s\n", argv[2]);
+		return 1;
+	}
+
+	// loading the output back checks it, and shows how long a compiled song takes to load
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool loaded = synth.load_song(argv[2]);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	if (!loaded) {
+		printf("tpscompile: could not load %s back\n", argv[2]);
+		return 1;
+	}
+	printf("%s: %.1f s long, loads in %.2f ms\n", argv[2], synth.get_song_length(),
+			std::chrono::duration<double, std::milli>(end - start).count());
+	return 0;
+}
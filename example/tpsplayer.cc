@@ -119,6 +119,7 @@ int main(int argc, char *argv[]) {
 	saudio_setup(&init_saudio);
 
 	midi_synth = new tinyprimesynth::Synthesizer(saudio_sample_rate(), midi_voices);
+	midi_synth->set_load_threads(0);
 
 	if (!midi_synth->load_soundfont(soundfont)) {
 		delete midi_synth;
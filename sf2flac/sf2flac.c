@@ -25,21 +25,43 @@ PERFORMANCE OF THIS SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define FRAME_SIZE   4096
 #define SAMPLERATE  44100
 #define BITDEPTH       16
 #define CHANNELS        1
 
+// Frames are never cut shorter than this to land on a boundary (the FLAC minimum block size)
+#define MIN_FRAME_SIZE 16
+
+#define SEEKPOINT_SIZE 18
+
 static tflac_u16 unpack_u16le(const tflac_u8* d) {
     return (((tflac_u16)d[0])    ) |
            (((tflac_u16)d[1])<< 8);
 }
 
+static tflac_u32 unpack_u32le(const tflac_u8* d) {
+    return (((tflac_u32)d[0])    ) |
+           (((tflac_u32)d[1])<< 8) |
+           (((tflac_u32)d[2])<<16) |
+           (((tflac_u32)d[3])<<24);
+}
+
 static tflac_s16 unpack_s16le(const tflac_u8* d) {
     return (tflac_s16)unpack_u16le(d);
 }
 
+static void pack_u64be(tflac_u8* d, tflac_u64 v, int bytes) {
+    while(bytes--) {
+        d[bytes] = (tflac_u8)(v & 0xFF);
+        v >>= 8;
+    }
+}
+
 void
 repack_samples(tflac_s16 *s, tflac_u32 channels, tflac_u32 num) {
     tflac_u32 i = 0;
@@ -51,19 +73,214 @@ repack_samples(tflac_s16 *s, tflac_u32 channels, tflac_u32 num) {
 
 typedef tflac_s16 sample;
 
+typedef struct {
+    tflac_u64 first_sample;
+    tflac_u32 length;
+    tflac_u8 *data;
+    tflac_u32 size;
+} frame;
+
+static tflac_u8 crc8(const tflac_u8 *d, size_t len) {
+    tflac_u8 crc = 0;
+    size_t i;
+    int bit;
+    for(i=0;i<len;i++) {
+        crc ^= d[i];
+        for(bit=0;bit<8;bit++) crc = (crc & 0x80) ? (tflac_u8)((crc << 1) ^ 0x07) : (tflac_u8)(crc << 1);
+    }
+    return crc;
+}
+
+static tflac_u16 crc16(const tflac_u8 *d, size_t len) {
+    tflac_u16 crc = 0;
+    size_t i;
+    int bit;
+    for(i=0;i<len;i++) {
+        crc ^= (tflac_u16)d[i] << 8;
+        for(bit=0;bit<8;bit++) crc = (crc & 0x8000) ? (tflac_u16)((crc << 1) ^ 0x8005) : (tflac_u16)(crc << 1);
+    }
+    return crc;
+}
+
+// UTF-8 style coding of frame and sample numbers, up to 36 bits
+static int encode_coded_number(tflac_u64 v, tflac_u8 *d) {
+    int len, i;
+    if(v < 0x80) {
+        d[0] = (tflac_u8)v;
+        return 1;
+    }
+    if(v < ((tflac_u64)1 << 11)) len = 2;
+    else if(v < ((tflac_u64)1 << 16)) len = 3;
+    else if(v < ((tflac_u64)1 << 21)) len = 4;
+    else if(v < ((tflac_u64)1 << 26)) len = 5;
+    else if(v < ((tflac_u64)1 << 31)) len = 6;
+    else len = 7;
+    for(i=len-1;i>0;i--) {
+        d[i] = (tflac_u8)(0x80 | (v & 0x3F));
+        v >>= 6;
+    }
+    d[0] = len == 7 ? 0xFE : (tflac_u8)((0xFF00 >> len) | v);
+    return len;
+}
+
+// tflac writes fixed-blocksize frames numbered from zero. Frames here can be shorter than
+// FRAME_SIZE anywhere in the stream, so the header is rewritten to the variable-blocksize form,
+// which carries the frame's first sample number instead.
+static int rewrite_frame_header(frame *f) {
+    tflac_u8 header[16];
+    tflac_u32 pos = 4, old_len, extra = 0, new_len, i;
+    tflac_u8 *out;
+    tflac_u16 crc;
+
+    if(f->size < 6) return -1;
+    old_len = 1;
+    if(f->data[4] >= 0xC0) {
+        old_len = 0;
+        while(old_len < 7 && (f->data[4] & (0x80 >> old_len))) old_len++;
+    }
+    pos += old_len;
+    switch(f->data[2] >> 4) {
+        case 6: extra += 1; break;
+        case 7: extra += 2; break;
+        default: break;
+    }
+    switch(f->data[2] & 0x0F) {
+        case 12: extra += 1; break;
+        case 13: case 14: extra += 2; break;
+        default: break;
+    }
+    if(pos + extra + 1 > f->size) return -1;
+
+    memcpy(header, f->data, 4);
+    header[1] |= 1;
+    new_len = 4 + encode_coded_number(f->first_sample, header + 4);
+    memcpy(header + new_len, f->data + pos, extra);
+    new_len += extra;
+    header[new_len] = crc8(header, new_len);
+    new_len++;
+
+    out = (tflac_u8 *)malloc(f->size - (pos + extra + 1) + new_len);
+    if(out == NULL) return -1;
+    memcpy(out, header, new_len);
+    memcpy(out + new_len, f->data + pos + extra + 1, f->size - (pos + extra + 1));
+    i = f->size - (pos + extra + 1) + new_len;
+    crc = crc16(out, i - 2);
+    out[i - 2] = (tflac_u8)(crc >> 8);
+    out[i - 1] = (tflac_u8)(crc & 0xFF);
+    free(f->data);
+    f->data = out;
+    f->size = i;
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    tflac_u64 x = *(const tflac_u64 *)a, y = *(const tflac_u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void add_boundary(tflac_u64 **list, tflac_u32 *count, tflac_u32 *capacity, tflac_u64 word) {
+    if(*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *list = (tflac_u64 *)realloc(*list, sizeof(tflac_u64) * *capacity);
+        if(*list == NULL) abort();
+    }
+    (*list)[(*count)++] = word;
+}
+
+// Collects the word offsets where frames should begin: every top-level chunk, the contents of
+// each sdta subchunk and, if requested, every sample start listed in the shdr chunk
+static void find_boundaries(const tflac_u8 *d, size_t size, int align_samples,
+  tflac_u64 **list, tflac_u32 *count, tflac_u32 *capacity) {
+    size_t pos = 12, smpl = 0, shdr = 0, shdr_size = 0;
+    while(pos + 8 <= size) {
+        tflac_u32 len = unpack_u32le(d + pos + 4);
+        size_t end = pos + 8 + len;
+        if(end > size) end = size;
+        add_boundary(list, count, capacity, pos / 2);
+        if(!memcmp(d + pos, "LIST", 4) && pos + 12 <= size) {
+            int sdta = !memcmp(d + pos + 8, "sdta", 4), pdta = !memcmp(d + pos + 8, "pdta", 4);
+            size_t sub = pos + 12;
+            while((sdta || pdta) && sub + 8 <= end) {
+                tflac_u32 sub_len = unpack_u32le(d + sub + 4);
+                if(sdta) {
+                    add_boundary(list, count, capacity, (sub + 8) / 2);
+                    add_boundary(list, count, capacity, (sub + 8 + sub_len) / 2);
+                    if(!memcmp(d + sub, "smpl", 4)) smpl = sub + 8;
+                } else if(!memcmp(d + sub, "shdr", 4)) {
+                    shdr = sub + 8;
+                    shdr_size = sub_len;
+                }
+                sub += 8 + sub_len;
+            }
+        }
+        pos += 8 + len;
+    }
+    if(align_samples && smpl && shdr && shdr + shdr_size <= size && smpl % 2 == 0) {
+        size_t rec;
+        for(rec = shdr; rec + 46 <= shdr + shdr_size; rec += 46) {
+            add_boundary(list, count, capacity, smpl / 2 + unpack_u32le(d + rec + 20));
+        }
+    }
+}
+
+static void write_streaminfo(tflac_u8 *d, int last, tflac_u32 min_block, tflac_u32 max_block,
+  tflac_u32 min_frame, tflac_u32 max_frame, tflac_u64 total_samples) {
+    d[0] = last ? 0x80 : 0x00;
+    pack_u64be(d + 1, 34, 3);
+    pack_u64be(d + 4, min_block, 2);
+    pack_u64be(d + 6, max_block, 2);
+    pack_u64be(d + 8, min_frame, 3);
+    pack_u64be(d + 11, max_frame, 3);
+    // 20 bits sample rate, 3 bits channels - 1, 5 bits depth - 1, 36 bits samples
+    pack_u64be(d + 14, ((tflac_u64)SAMPLERATE << 44) | ((tflac_u64)(CHANNELS - 1) << 41) |
+      ((tflac_u64)(BITDEPTH - 1) << 36) | (total_samples & UINT64_C(0xFFFFFFFFF)), 8);
+    memset(d + 22, 0, 16); // no MD5
+}
+
+static void print_usage(const char *name) {
+    printf("Usage: %s [-a] [-j threads] /path/to/sf2\n",name);
+    printf("  -a          start a new frame at every sample in the soundfont\n");
+    printf("  -j threads  number of frames to encode at once (default: all cores)\n");
+}
+
 int main(int argc, const char *argv[]) {
-    tflac_u8 *buffer = NULL;
-    tflac_u32 bufferlen = 0;
-    tflac_u32 bufferused = 0;
     FILE *input = NULL;
     FILE *output = NULL;
-    tflac_u32 frames = 0;
+    const char *input_name = NULL;
+    int align_samples = 0;
+    int threads = 0;
+    int arg;
+    tflac_u8 *file_data = NULL;
+    size_t file_size = 0;
     sample *samples = NULL;
-    void *tflac_mem = NULL;
-    tflac t;
+    tflac_u64 num_samples;
+    tflac_u64 *boundaries = NULL;
+    tflac_u32 num_boundaries = 0, boundary_capacity = 0;
+    frame *frames = NULL;
+    tflac_u32 num_frames = 0, frame_capacity = 0;
+    tflac_u32 i;
+    long f;
+    int failed = 0;
+    tflac_u8 metadata[4 + 34];
+    tflac_u32 min_block = FRAME_SIZE, min_frame = 0xFFFFFF, max_frame = 0;
+    tflac_u64 offset;
+    int seektable;
+
+    for(arg = 1; arg < argc; arg++) {
+        if(!strcmp(argv[arg], "-a")) {
+            align_samples = 1;
+        } else if(!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+            threads = atoi(argv[++arg]);
+        } else if(argv[arg][0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            input_name = argv[arg];
+        }
+    }
 
-    if(argc < 2) {
-        printf("Usage: %s /path/to/sf2\n",argv[0]);
+    if(input_name == NULL) {
+        print_usage(argv[0]);
         return 1;
     }
 
@@ -80,17 +297,8 @@ int main(int argc, const char *argv[]) {
     }
 
     tflac_detect_cpu();
-    tflac_init(&t);
 
-    t.samplerate = SAMPLERATE;
-    t.channels = CHANNELS;
-    t.bitdepth = BITDEPTH;
-    t.blocksize = FRAME_SIZE;
-    t.enable_md5 = 0;
-
-    if (argv[1] == NULL) return 1;
-
-    input = fopen(argv[1],"rb");
+    input = fopen(input_name,"rb");
 
     if(input == NULL) return 1;
 
@@ -108,15 +316,27 @@ int main(int argc, const char *argv[]) {
         printf("Header invalid! (Is this an SF2 file?)\n");
         fclose(input);
         return 1;
-    }    
+    }
 
+    // The whole file is read in, so that chunks can be located and frames encoded in any order
+    fseek(input, 0, SEEK_END);
+    file_size = (size_t)ftell(input);
     fseek(input, 0, SEEK_SET);
+    file_data = (tflac_u8 *)calloc(file_size + 1, 1);
+    if(file_data == NULL) abort();
+    if(fread(file_data, 1, file_size, input) != file_size) {
+        printf("Unable to read %s!\n", input_name);
+        fclose(input);
+        free(file_data);
+        return 1;
+    }
+    fclose(input);
 
     // Just append "flac" to whatever extension it had (probably sf2)
-    size_t arg_length = strlen(argv[1]);
+    size_t arg_length = strlen(input_name);
     char *out_name = (char *)calloc(arg_length + 5, sizeof(char));
     if (out_name == NULL) return 1;
-    strncpy(out_name, argv[1], arg_length);
+    strncpy(out_name, input_name, arg_length);
     out_name[arg_length] = 'f';
     out_name[arg_length+1] = 'l';
     out_name[arg_length+2] = 'a';
@@ -126,51 +346,136 @@ int main(int argc, const char *argv[]) {
     if(output == NULL) {
         printf("Unable to open output file %s!\n", out_name);
         free(out_name);
-        fclose(input);
+        free(file_data);
         return 1;
     }
     else
         free(out_name);
 
-    tflac_mem = malloc(tflac_size_memory(t.blocksize));
-    if(tflac_mem == NULL) abort();
-
-    tflac_set_constant_subframe(&t, 1);
-    tflac_set_fixed_subframe(&t, 1);
+    // An odd trailing byte is kept by padding the last sample with zero
+    num_samples = (file_size + 1) / (sizeof(sample) * CHANNELS);
+    find_boundaries(file_data, file_size, align_samples, &boundaries, &num_boundaries, &boundary_capacity);
+    add_boundary(&boundaries, &num_boundaries, &boundary_capacity, 0);
+    add_boundary(&boundaries, &num_boundaries, &boundary_capacity, num_samples);
+    qsort(boundaries, num_boundaries, sizeof(tflac_u64), compare_u64);
+
+    // Split the stream at each boundary that leaves room for frames of at least MIN_FRAME_SIZE,
+    // and into even pieces of at most FRAME_SIZE in between
+    tflac_u64 start = 0;
+    for(i = 1; i < num_boundaries; i++) {
+        tflac_u64 end = boundaries[i], pieces, piece;
+        if(end > num_samples) end = num_samples;
+        if(end != num_samples && (end < start + MIN_FRAME_SIZE || num_samples - end < MIN_FRAME_SIZE)) continue;
+        pieces = (end - start + FRAME_SIZE - 1) / FRAME_SIZE;
+        for(piece = 0; piece < pieces; piece++) {
+            tflac_u64 length = (end - start) * (piece + 1) / pieces - (end - start) * piece / pieces;
+            if(num_frames == frame_capacity) {
+                frame_capacity = frame_capacity ? frame_capacity * 2 : 256;
+                frames = (frame *)realloc(frames, sizeof(frame) * frame_capacity);
+                if(frames == NULL) abort();
+            }
+            frames[num_frames].first_sample = start + (end - start) * piece / pieces;
+            frames[num_frames].length = (tflac_u32)length;
+            frames[num_frames].data = NULL;
+            frames[num_frames].size = 0;
+            num_frames++;
+        }
+        start = end;
+    }
 
-    if(tflac_validate(&t, tflac_mem, tflac_size_memory(t.blocksize)) != 0) abort();
+    samples = (sample *)file_data;
+    repack_samples(samples, CHANNELS, (tflac_u32)num_samples);
 
-    bufferlen = tflac_size_frame(FRAME_SIZE,CHANNELS,BITDEPTH);
-    buffer = malloc(bufferlen);
-    if(buffer == NULL) abort();
+#ifdef _OPENMP
+    if(threads > 0) omp_set_num_threads(threads);
+#else
+    (void)threads;
+#endif
 
-    samples = (sample *)malloc(sizeof(sample) * CHANNELS * FRAME_SIZE);
-    if(!samples) abort();
+    // Each thread encodes whole frames with its own encoder
+#pragma omp parallel reduction(|:failed)
+    {
+        tflac t;
+        void *tflac_mem = malloc(tflac_size_memory(FRAME_SIZE));
+        tflac_u32 bufferlen = tflac_size_frame(FRAME_SIZE,CHANNELS,BITDEPTH);
+        tflac_u8 *buffer = (tflac_u8 *)malloc(bufferlen);
+        tflac_u32 bufferused = 0;
+
+        if(tflac_mem == NULL || buffer == NULL) abort();
+
+        tflac_init(&t);
+        t.samplerate = SAMPLERATE;
+        t.channels = CHANNELS;
+        t.bitdepth = BITDEPTH;
+        t.blocksize = FRAME_SIZE;
+        t.enable_md5 = 0;
+        tflac_set_constant_subframe(&t, 1);
+        tflac_set_fixed_subframe(&t, 1);
+
+        if(tflac_validate(&t, tflac_mem, tflac_size_memory(t.blocksize)) != 0) abort();
+
+#pragma omp for schedule(dynamic, 16)
+        for(f = 0; f < (long)num_frames; f++) {
+            frame *fr = &frames[f];
+            if(tflac_encode_s16i(&t, fr->length, samples + fr->first_sample * CHANNELS, buffer, bufferlen, &bufferused) != 0) {
+                failed = 1;
+                continue;
+            }
+            fr->data = (tflac_u8 *)malloc(bufferused);
+            if(fr->data == NULL) abort();
+            memcpy(fr->data, buffer, bufferused);
+            fr->size = bufferused;
+            if(rewrite_frame_header(fr) != 0) failed = 1;
+        }
+
+        free(tflac_mem);
+        free(buffer);
+    }
 
-    fwrite("fLaC",1,4,output);
+    if(failed) {
+        printf("Unable to encode %s!\n", input_name);
+        fclose(output);
+        return 1;
+    }
 
-    tflac_encode_streaminfo(&t, 1, buffer, bufferlen, &bufferused);
-    fwrite(buffer,1,bufferused,output);
+    for(i = 0; i < num_frames; i++) {
+        if(i + 1 < num_frames && frames[i].length < min_block) min_block = frames[i].length;
+        if(frames[i].size < min_frame) min_frame = frames[i].size;
+        if(frames[i].size > max_frame) max_frame = frames[i].size;
+    }
 
-    while((frames = fread(samples,sizeof(sample) * CHANNELS, FRAME_SIZE, input)) > 0) {
-        repack_samples(samples, CHANNELS, frames);
+    // A seek point for every frame lets decoders find any sample without scanning, as long as
+    // the table fits in a metadata block
+    seektable = (tflac_u64)num_frames * SEEKPOINT_SIZE <= 0xFFFFFF;
 
-        if(tflac_encode_s16i(&t, frames, samples, buffer, bufferlen, &bufferused) != 0) abort();
-        fwrite(buffer,1,bufferused,output);
+    fwrite("fLaC",1,4,output);
+    write_streaminfo(metadata, !seektable, min_block, FRAME_SIZE, min_frame, max_frame, num_samples);
+    fwrite(metadata,1,4 + 34,output);
+
+    if(seektable) {
+        metadata[0] = 0x80 | 3;
+        pack_u64be(metadata + 1, (tflac_u64)num_frames * SEEKPOINT_SIZE, 3);
+        fwrite(metadata,1,4,output);
+        offset = 0;
+        for(i = 0; i < num_frames; i++) {
+            tflac_u8 point[SEEKPOINT_SIZE];
+            pack_u64be(point, frames[i].first_sample, 8);
+            pack_u64be(point + 8, offset, 8);
+            pack_u64be(point + 16, frames[i].length, 2);
+            fwrite(point,1,SEEKPOINT_SIZE,output);
+            offset += frames[i].size;
+        }
     }
 
-    tflac_finalize(&t);
-
-    fseek(output,4,SEEK_SET);
-    tflac_encode_streaminfo(&t, 1, buffer, bufferlen, &bufferused);
-    fwrite(buffer,1,bufferused,output);
+    for(i = 0; i < num_frames; i++) {
+        fwrite(frames[i].data,1,frames[i].size,output);
+        free(frames[i].data);
+    }
 
-    fclose(input);
     fclose(output);
-    free(tflac_mem);
-    free(samples);
-    free(buffer);
+    free(frames);
+    free(boundaries);
+    free(file_data);
 
     return 0;
 }
-
@@ -30,7 +30,7 @@
 //
 //------------------------------------------------------------------------------------------------
 //
-// MUS-to-MIDI conversion adapted from code Copyright (c) 2021-2022 Steve Clark
+// DMX MUS event decoding adapted from code Copyright (c) 2021-2022 Steve Clark
 // with the following license (zlib):
 //
 // This software is provided 'as-is', without any express or implied
@@ -56,9 +56,12 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <atomic>
 #include <vector>
 
 namespace tinyprimesynth {
+class FileAndMemReader;
+
 class Synthesizer {
 public:
 	Synthesizer(float p_rate, size_t p_voices = 64);
@@ -68,13 +71,35 @@ public:
 	bool load_soundfont(const uint8_t *p_data, size_t p_length);
 	bool load_song(const char *p_filename);
 	bool load_song(const uint8_t *p_data, size_t p_length);
+	bool save_compiled_song(const char *p_filename);
+	bool save_compiled_song(std::vector<uint8_t> &p_data);
 	int play_stream(uint8_t *p_stream, size_t p_length);
 	void set_volume(float p_volume);
+	void set_voice_stealing_weights(float p_released, float p_sustained, float p_age);
+	void set_load_threads(unsigned int p_threads);
+	void set_sample_cache_size(size_t p_bytes);
+	void set_compact_samples(bool p_compact);
+	void set_incremental_loading(bool p_incremental);
+	void set_song_layers(size_t p_count);
+	void select_song_layer(size_t p_layer);
+	void set_song_layer_volume(size_t p_layer, float p_volume);
+
+	struct SampleCacheStats {
+		// voices that found their sample data decoded, and that had to decode it
+		size_t hits, misses;
+		size_t evictions;
+		// decoded sample data held, and compressed sample data it is decoded from
+		size_t cached_bytes, source_bytes;
+	};
+	SampleCacheStats get_sample_cache_stats() const;
 	void pause();
 	void stop();
 	void reset();
 	bool at_end() const;
 	void rewind();
+	void seek(double p_seconds, bool p_restart_notes = true);
+	void seek_tick(uint64_t p_tick, bool p_restart_notes = true);
+	double get_song_length() const;
 	bool get_load_error() const;
 	void set_load_error(bool p_error);
 
@@ -90,16 +115,25 @@ private:
 	class Sequencer;
 	class SoundFont;
 	class Voice;
+	class VoicePool;
 
-	Standard standard;
 	bool no_drums, no_piano;
+	float output_rate;
 	float volume;
-	bool load_error;
-	std::vector<Channel *> channels;
+	std::atomic<bool> load_error;
+	unsigned int load_threads;
+	size_t sample_cache_size;
+	bool compact_samples;
+	bool incremental_loading;
 	std::vector<Voice *> voices;
+	VoicePool *voice_pool;
 	SoundFont *soundfont;
+	// Every song layer plays on its own sequencer and channels, sharing the voices, and
+	// song functions apply to the selected one
+	std::vector<Sequencer *> sequencers;
 	Sequencer *sequencer;
 
+	bool load_soundfont_from(FileAndMemReader *p_font);
 	const Preset *find_preset(uint16_t p_bank, uint16_t p_id);
 };
 
@@ -112,23 +146,37 @@ private:
 #include <limits.h>
 #include <math.h>
 #include <string.h>
+#include <algorithm>
+#include <bitset>
+#include <functional>
 #include <list>
-#include <set>
+#include <map>
+#include <memory>
 #include <string>
+#ifndef TINYPRIMESYNTH_NO_THREADS
+#include <thread>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TINYPRIMESYNTH_SSE2
+#endif
 #ifdef _WIN32
 #include <windows.h>
 #endif
 namespace tinyprimesynth {
 
 static constexpr char MUS_MAGIC[4] = { 'M', 'U', 'S', 0x1a };
-static constexpr char MID_MAGIC[4] = { 'M', 'T', 'h', 'd' };
 static constexpr char TRACK_MAGIC[4] = { 'M', 'T', 'r', 'k' };
 static constexpr char FLAC_MAGIC[4] = { 'f', 'L', 'a', 'C' };
+static constexpr char COMPILED_SONG_MAGIC[4] = { 'T', 'P', 'S', 'C' };
+static constexpr uint32_t COMPILED_SONG_VERSION = 2;
+static constexpr uint32_t COMPILED_SONG_BYTE_ORDER = 0x01020304;
 static constexpr int MUS_CONTROLLER_MAP[16] = { -1, 0, 1, 7, 10, 11, 91, 93, 64, 67, 120, 123, 126, 127, 121, -1 };
 static constexpr size_t MIDI_PARSE_HEADER_SIZE = 14;
 static constexpr uint8_t PERCUSSION_CHANNEL = 9;
 static constexpr uint8_t MAX_KEY = 127;
 static constexpr size_t NUM_CHANNELS = 16;
+static constexpr size_t MIDI_NOTE_COUNT = NUM_CHANNELS * (MAX_KEY + 1);
 static constexpr size_t NUM_CONTROLLERS = 128;
 static constexpr uint16_t PERCUSSION_BANK = 128;
 static constexpr float PAN_FACTOR = 3.141592653589793f / 2000.0f;
@@ -170,15 +218,15 @@ static constexpr unsigned char GS_SYSTEM_MODE_SET2[11] = { 0xf0, 0x41, 0, 0x42,
 static constexpr unsigned char XG_SYSTEM_ON[9] = { 0xf0, 0x43, 0, 0x4c, 0x00, 0x00, 0x7e, 0x00, 0xf7 };
 static constexpr uint16_t ATTEN_TABLE_SIZE = 1441;
 static constexpr uint16_t CENT_TABLE_SIZE = 1200;
+static constexpr size_t CONTROLLER_TABLE_SIZE = 128;
+static constexpr size_t CURVE_TABLE_RESOLUTION = 16384;
+static constexpr size_t NUM_SOURCE_TYPES = 4;
 static float attenuation_to_amp_table[ATTEN_TABLE_SIZE];
 static float cent_to_hertz_table[CENT_TABLE_SIZE];
-static uint8_t *mus_to_midi_data = NULL;
-static int mus_to_midi_size;
-static uint8_t *mus_to_midi_pos = NULL;
-static int mus_to_midi_eot;
-static uint8_t mus_to_midi_delta_bytes[4];
-static int mus_to_midi_delta_count;
-static uint8_t mus_to_midi_channels[16];
+static float concave_curve_table[CURVE_TABLE_RESOLUTION + 1];
+static float convex_curve_table[CURVE_TABLE_RESOLUTION + 1];
+static float controller_curve_table[NUM_SOURCE_TYPES][2][2][CONTROLLER_TABLE_SIZE];
+static float compact_sample_table[256];
 
 enum class SF2Generator : uint16_t {
 	START_ADDRESS_OFFSET = 0,
@@ -283,45 +331,52 @@ struct MUSHeader {
 	uint16_t score_start;
 };
 
-struct MIDHeader {
+// A song saved after loading, see Synthesizer::save_compiled_song. The header is followed by
+// row_count rows, event_count events, event_data_size bytes of event data and then
+// loop_stack_size loop stack entries. Every field is in the byte order of the machine that
+// saved it, which byte_order (COMPILED_SONG_BYTE_ORDER as written there) records
+struct CompiledSongHeader {
 	char id[4];
-	int length;
-	uint16_t type;
-	uint16_t ntracks;
-	uint16_t ticks;
+	uint32_t byte_order;
+	uint32_t version;
+	uint8_t format;
+	uint8_t smf_format;
+	uint8_t loop_format;
+	uint8_t invalid_loop;
+	uint64_t tick_delta_num, tick_delta_den;
+	uint64_t tempo_num, tempo_den;
+	double length;
+	double loop_start_time, loop_end_time;
+	uint64_t loop_begin_row;
+	double loop_begin_time;
+	uint64_t row_count, event_count, event_data_size, loop_stack_size;
 };
-#pragma pack(pop)
 
-#if defined(__GNUC__) || defined(__clang__)
-static inline uint16_t byte_swap_16(uint16_t n) {
-	return __builtin_bswap16(n);
-}
-static inline uint32_t byte_swap_32(uint32_t n) {
-	return __builtin_bswap32(n);
-}
-#elif defined(_MSC_VER)
-static inline uint16_t byte_swap_16(uint16_t n) {
-	return _byteswap_ushort(n);
-}
-static inline uint32_t byte_swap_32(uint32_t n) {
-	return _byteswap_ulong(n);
-}
-#else
-static inline uint16_t byte_swap_16(uint16_t n) {
-	uint16_t a;
-	a = (n & 0xFF) << 8;
-	a |= (n >> 8) & 0xFF;
-	return a;
-}
-static inline uint32_t byte_swap_32(uint32_t n) {
-	uint32_t a;
-	a = (n & 0xFFU) << 24;
-	a |= (n & 0xFF00U) << 8;
-	a |= (n >> 8) & 0xFF00U;
-	a |= (n >> 24) & 0xFFU;
-	return a;
-}
-#endif
+struct CompiledSongRow {
+	double time;
+	uint64_t delay;
+	uint64_t absolute_position;
+	double time_delay;
+	uint32_t num_events;
+};
+
+struct CompiledSongEvent {
+	uint8_t type;
+	uint8_t channel;
+	uint16_t sub_type;
+	uint8_t is_valid;
+	uint16_t track;
+	uint32_t data_size;
+	uint8_t data[4];
+	uint32_t data_offset;
+};
+
+struct CompiledSongLoop {
+	uint8_t infinity;
+	int32_t loops;
+	uint64_t start, end;
+};
+#pragma pack(pop)
 
 static inline uint64_t read_int_big_endian(const void *p_buffer, size_t p_nbytes) {
 	uint64_t result = 0;
@@ -353,21 +408,6 @@ static inline uint64_t read_variable_length_value(const uint8_t **p_ptr, const u
 	return result;
 }
 
-static void initialize_conversion_tables() {
-	static bool initialized = false;
-	if (!initialized) {
-		initialized = true;
-
-		for (size_t i = 0; i < ATTEN_TABLE_SIZE; ++i) {
-			// -200 instead of -100 for compatibility
-			attenuation_to_amp_table[i] = pow(10.0f, i / -200.0f);
-		}
-		for (size_t i = 0; i < CENT_TABLE_SIZE; i++) {
-			cent_to_hertz_table[i] = 6.875 * exp2f(i / 1200.0f);
-		}
-	}
-}
-
 static inline float attenuation_to_amplitude(float p_atten) {
 	if (p_atten <= 0.0f) {
 		return 1.0f;
@@ -428,13 +468,125 @@ static inline float convex_curve(float p_x) {
 	}
 }
 
+// Controller values that land exactly on a table point (every 7-bit and 14-bit
+// controller value does) are looked up instead of calling log10f
+static inline float lookup_concave_curve(float p_x) {
+	const float index = p_x * CURVE_TABLE_RESOLUTION;
+	if (p_x >= 0.0f && p_x <= 1.0f && index == (uint32_t)index) {
+		return concave_curve_table[(uint32_t)index];
+	}
+	return concave_curve(p_x);
+}
+
+static inline float lookup_convex_curve(float p_x) {
+	const float index = p_x * CURVE_TABLE_RESOLUTION;
+	if (p_x >= 0.0f && p_x <= 1.0f && index == (uint32_t)index) {
+		return convex_curve_table[(uint32_t)index];
+	}
+	return convex_curve(p_x);
+}
+
+static float map_controller_curve(float p_value, SourceType p_type, SourcePolarity p_polarity, SourceDirection p_direction) {
+	if (p_type == SourceType::SWITCH) {
+		const float off = p_polarity == SourcePolarity::UNIPOLAR ? 0.0f : -1.0f;
+		const float x = p_direction == SourceDirection::POSITIVE ? p_value : 1.0f - p_value;
+		return x >= 0.5f ? 1.0f : off;
+	} else if (p_polarity == SourcePolarity::UNIPOLAR) {
+		const float x = p_direction == SourceDirection::POSITIVE ? p_value : 1.0f - p_value;
+		switch (p_type) {
+			case SourceType::LINEAR:
+				return x;
+			case SourceType::CONCAVE:
+				return lookup_concave_curve(x);
+			case SourceType::CONVEX:
+				return lookup_convex_curve(x);
+			default:
+				break;
+		}
+	} else {
+		const int dir = p_direction == SourceDirection::POSITIVE ? 1 : -1;
+		const int sign = p_value > 0.5f ? 1 : -1;
+		const float x = 2.0f * p_value - 1.0f;
+		switch (p_type) {
+			case SourceType::LINEAR:
+				return dir * x;
+			case SourceType::CONCAVE:
+				return sign * dir * lookup_concave_curve(sign * x);
+			case SourceType::CONVEX:
+				return sign * dir * lookup_convex_curve(sign * x);
+			default:
+				break;
+		}
+	}
+	return 0.0f;
+}
+
+// 8-bit mu-law companding as in G.711, used for compact sample data
+static constexpr int MU_LAW_BIAS = 0x84;
+static constexpr int MU_LAW_CLIP = 32635;
+
+static uint8_t encode_mu_law(int16_t p_sample) {
+	const int sign = p_sample < 0 ? 0x80 : 0;
+	const int magnitude = std::min(sign ? -(int)p_sample : (int)p_sample, MU_LAW_CLIP) + MU_LAW_BIAS;
+	int exponent = 7;
+	for (int mask = 0x4000; !(magnitude & mask) && exponent > 0; mask >>= 1) {
+		--exponent;
+	}
+	const int mantissa = (magnitude >> (exponent + 3)) & 0x0f;
+	return ~(sign | exponent << 4 | mantissa);
+}
+
+static int16_t decode_mu_law(uint8_t p_code) {
+	p_code = ~p_code;
+	const int exponent = (p_code >> 4) & 0x07;
+	const int magnitude = ((((p_code & 0x0f) << 3) + MU_LAW_BIAS) << exponent) - MU_LAW_BIAS;
+	return (p_code & 0x80) ? -magnitude : magnitude;
+}
+
+static void initialize_conversion_tables() {
+	static bool initialized = false;
+	if (!initialized) {
+		initialized = true;
+
+		for (size_t i = 0; i < ATTEN_TABLE_SIZE; ++i) {
+			// -200 instead of -100 for compatibility
+			attenuation_to_amp_table[i] = pow(10.0f, i / -200.0f);
+		}
+		for (size_t i = 0; i < CENT_TABLE_SIZE; i++) {
+			cent_to_hertz_table[i] = 6.875 * exp2f(i / 1200.0f);
+		}
+		for (size_t i = 0; i <= CURVE_TABLE_RESOLUTION; ++i) {
+			concave_curve_table[i] = concave_curve((float)i / CURVE_TABLE_RESOLUTION);
+			convex_curve_table[i] = convex_curve((float)i / CURVE_TABLE_RESOLUTION);
+		}
+		for (size_t i = 0; i < 256; ++i) {
+			compact_sample_table[i] = decode_mu_law(i);
+		}
+		// Must come after the curve tables, as the 7-bit entries are built from them
+		for (size_t type = 0; type < NUM_SOURCE_TYPES; ++type) {
+			for (size_t polarity = 0; polarity < 2; ++polarity) {
+				for (size_t direction = 0; direction < 2; ++direction) {
+					for (size_t i = 0; i < CONTROLLER_TABLE_SIZE; ++i) {
+						controller_curve_table[type][polarity][direction][i] = map_controller_curve((float)i / CONTROLLER_TABLE_SIZE,
+								(SourceType)type, (SourcePolarity)polarity, (SourceDirection)direction);
+					}
+				}
+			}
+		}
+	}
+}
+
 class FileAndMemReader {
 public:
 	FileAndMemReader() :
 			fp(NULL),
 			mp(NULL),
 			mp_size(0),
-			mp_tell(0) {}
+			mp_tell(0),
+			fp_size(0),
+			fp_tell(0),
+			buffer_pos(0),
+			buffer_fill(0) {}
 
 	~FileAndMemReader() {
 		close();
@@ -453,7 +605,7 @@ public:
 			return 0;
 		}
 		if (fp) { //If a file
-			return (size_t)ftell(fp);
+			return fp_tell - (buffer_fill - buffer_pos);
 		} else { //If a memory block
 			return mp_tell;
 		}
@@ -464,7 +616,7 @@ public:
 			return true;
 		}
 		if (fp) {
-			return (feof(fp) != 0);
+			return tell() >= fp_size;
 		} else {
 			return mp_tell >= mp_size;
 		}
@@ -476,7 +628,10 @@ public:
 		}
 		if (fp) //If a file
 		{
-			return getc(fp);
+			if (buffer_pos >= buffer_fill && !fill_buffer()) {
+				return -1;
+			}
+			return buffer[buffer_pos++];
 		} else //If a memory block
 		{
 			if (mp_tell >= mp_size) {
@@ -501,6 +656,10 @@ public:
 		mp = NULL;
 		mp_size = 0;
 		mp_tell = 0;
+		fp_size = 0;
+		fp_tell = 0;
+		buffer_pos = 0;
+		buffer_fill = 0;
 	}
 
 	size_t file_size() {
@@ -510,32 +669,67 @@ public:
 		if (!fp) {
 			return mp_size; //Size of memory block is well known
 		}
-		size_t old_pos = this->tell();
-		seek(0l, SEEK_END);
-		size_t file_size = this->tell();
-		seek((long)old_pos, SEEK_SET);
-		return file_size;
+		return fp_size; //Measured when the file was opened
 	}
 
 	size_t read(void *p_buf, size_t p_num, size_t p_size) {
 		if (!this->is_valid()) {
 			return 0;
 		}
+		uint8_t *dest = (uint8_t *)p_buf;
+		const size_t max_size = p_size * p_num;
 		if (fp) {
-			return fread(p_buf, p_num, p_size, fp);
-		} else {
 			size_t pos = 0;
-			size_t maxSize = (size_t)p_size * p_num;
-
-			while ((pos < maxSize) && (mp_tell < mp_size)) {
-				uint8_t *dest = (uint8_t *)p_buf;
-				const uint8_t *src = (const uint8_t *)mp;
-				dest[pos] = src[mp_tell];
-				mp_tell++;
-				pos++;
+			while (pos < max_size) {
+				if (buffer_pos >= buffer_fill) {
+					// large reads skip the buffer entirely
+					if (max_size - pos >= FILE_BUFFER_SIZE) {
+						const size_t got = fread(dest + pos, 1, max_size - pos, fp);
+						fp_tell += got;
+						pos += got;
+						buffer_pos = 0;
+						buffer_fill = 0;
+						break;
+					}
+					if (!fill_buffer()) {
+						break;
+					}
+				}
+				const size_t chunk = std::min(max_size - pos, buffer_fill - buffer_pos);
+				memcpy(dest + pos, buffer.data() + buffer_pos, chunk);
+				buffer_pos += chunk;
+				pos += chunk;
 			}
-
 			return pos / p_num;
+		} else {
+			const size_t pos = std::min(max_size, mp_size - mp_tell);
+			memcpy(dest, (const uint8_t *)mp + mp_tell, pos);
+			mp_tell += pos;
+			return pos / p_num;
+		}
+	}
+
+	// Points p_data at up to p_max_size of the next bytes without copying them and moves past
+	// them, returning how many are available; the bytes stay valid until the next call on this
+	// reader. Memory blocks are viewed directly, files through the read buffer.
+	size_t read_in_place(const uint8_t **p_data, size_t p_max_size) {
+		*p_data = NULL;
+		if (!this->is_valid()) {
+			return 0;
+		}
+		if (fp) {
+			if (buffer_pos >= buffer_fill && !fill_buffer()) {
+				return 0;
+			}
+			const size_t size = std::min(p_max_size, buffer_fill - buffer_pos);
+			*p_data = buffer.data() + buffer_pos;
+			buffer_pos += size;
+			return size;
+		} else {
+			const size_t size = std::min(p_max_size, mp_size - mp_tell);
+			*p_data = (const uint8_t *)mp + mp_tell;
+			mp_tell += size;
+			return size;
 		}
 	}
 
@@ -546,7 +740,36 @@ public:
 
 		if (fp) //If a file
 		{
-			fseek(fp, p_pos, p_rel_to);
+			size_t target;
+			switch (p_rel_to) {
+				default:
+				case SEEK_SET:
+					target = (size_t)p_pos;
+					break;
+
+				case SEEK_END:
+					target = fp_size + p_pos;
+					break;
+
+				case SEEK_CUR:
+					target = tell() + p_pos;
+					break;
+			}
+
+			if (target > fp_size) {
+				target = fp_size;
+			}
+
+			// stay inside the buffer when possible, so that skipping small chunks costs nothing
+			const size_t buffer_start = fp_tell - buffer_fill;
+			if (target >= buffer_start && target <= fp_tell) {
+				buffer_pos = target - buffer_start;
+			} else {
+				fseek(fp, (long)target, SEEK_SET);
+				fp_tell = target;
+				buffer_pos = 0;
+				buffer_fill = 0;
+			}
 		} else //If a memory block
 		{
 			switch (p_rel_to) {
@@ -585,6 +808,15 @@ public:
 		mp = NULL;
 		mp_size = 0;
 		mp_tell = 0;
+		fp_size = 0;
+		fp_tell = 0;
+		buffer_pos = 0;
+		buffer_fill = 0;
+		if (fp) {
+			fseek(fp, 0l, SEEK_END);
+			fp_size = (size_t)ftell(fp);
+			fseek(fp, 0l, SEEK_SET);
+		}
 	}
 
 	void open_data(const void *p_mem, size_t p_length) {
@@ -602,84 +834,111 @@ public:
 	}
 
 private:
+	static constexpr size_t FILE_BUFFER_SIZE = 65536;
+
 	FILE *fp;
 	const void *mp;
 	size_t mp_size;
 	size_t mp_tell;
+	size_t fp_size;
+	// position of the file itself, which is past the buffered bytes
+	size_t fp_tell;
+	std::vector<uint8_t> buffer;
+	size_t buffer_pos, buffer_fill;
+
+	bool fill_buffer() {
+		buffer.resize(FILE_BUFFER_SIZE);
+		buffer_fill = fread(buffer.data(), 1, FILE_BUFFER_SIZE, fp);
+		buffer_pos = 0;
+		fp_tell += buffer_fill;
+		return buffer_fill != 0;
+	}
 };
 
-static void mus_event_convert() {
-	uint8_t data, last, channel;
-	uint8_t event[3];
-	int count;
-
-	data = *mus_to_midi_pos++;
-	last = data & 0x80;
-	channel = data & 0xf;
+// Decodes the DMX MUS event at p_ptr into the MIDI event it stands for, in p_event, with the
+// percussion channel moved from 15 to 9. Notes played without a volume take the last one
+// played on their channel, kept in p_volumes. Returns the size of the MIDI event, which is 0
+// for MUS events that have none; an event cut short by the end of the data ends the score.
+// p_last is set when a delay follows the event
+static size_t decode_mus_event(const uint8_t **p_ptr, const uint8_t *p_end, uint8_t p_volumes[16], uint8_t p_event[3],
+		bool &p_last) {
+	const uint8_t *&ptr = *p_ptr;
+	bool ok = ptr < p_end;
+	auto next = [&]() -> uint8_t {
+		if (ptr < p_end) {
+			return *ptr++;
+		}
+		ok = false;
+		return 0;
+	};
 
-	switch (data & 0x70) {
+	uint8_t data = next();
+	p_last = (data & 0x80) != 0;
+	uint8_t channel = data & 0xf;
+	const uint8_t type = ok ? data & 0x70 : 0x60;
+	size_t count = 3;
+	switch (type) {
 		case 0x00:
-			event[0] = 0x80;
-			event[1] = *mus_to_midi_pos++ & 0x7f;
-			event[2] = mus_to_midi_channels[channel];
-			count = 3;
+			p_event[0] = 0x80;
+			p_event[1] = next() & 0x7f;
+			p_event[2] = p_volumes[channel];
 			break;
 
 		case 0x10:
-			event[0] = 0x90;
-			data = *mus_to_midi_pos++;
-			event[1] = data & 0x7f;
-			event[2] = data & 0x80 ? *mus_to_midi_pos++ : mus_to_midi_channels[channel];
-			mus_to_midi_channels[channel] = event[2];
-			count = 3;
+			p_event[0] = 0x90;
+			data = next();
+			p_event[1] = data & 0x7f;
+			p_event[2] = data & 0x80 ? next() : p_volumes[channel];
+			p_volumes[channel] = p_event[2];
 			break;
 
 		case 0x20:
-			event[0] = 0xe0;
-			event[1] = (*mus_to_midi_pos & 0x01) << 6;
-			event[2] = *mus_to_midi_pos++ >> 1;
-			count = 3;
+			p_event[0] = 0xe0;
+			data = next();
+			p_event[1] = (data & 0x01) << 6;
+			p_event[2] = data >> 1;
 			break;
 
 		case 0x30:
-			event[0] = 0xb0;
-			event[1] = MUS_CONTROLLER_MAP[*mus_to_midi_pos++ & 0xf];
-			event[2] = 0x7f;
-			count = 3;
+			p_event[0] = 0xb0;
+			p_event[1] = (uint8_t)MUS_CONTROLLER_MAP[next() & 0xf];
+			p_event[2] = 0x7f;
 			break;
 
 		case 0x40:
-			data = *mus_to_midi_pos++;
+			data = next();
 			if (data == 0) {
-				event[0] = 0xc0;
-				event[1] = *mus_to_midi_pos++;
+				p_event[0] = 0xc0;
+				p_event[1] = next();
 				count = 2;
 				break;
 			}
-			event[0] = 0xb0;
-			event[1] = MUS_CONTROLLER_MAP[data & 0xf];
-			event[2] = *mus_to_midi_pos++;
-			count = 3;
+			p_event[0] = 0xb0;
+			p_event[1] = (uint8_t)MUS_CONTROLLER_MAP[data & 0xf];
+			p_event[2] = next();
 			break;
 
 		case 0x50:
-			return;
+			// not a MUS event, and no delay is read after it
+			p_last = false;
+			return 0;
 
 		case 0x60:
-			event[0] = 0xff;
-			event[1] = 0x2f;
-			event[2] = 0x00;
-			count = 3;
-
-			// this prevents mus_to_midi_delta_bytes being read past the end of the MUS data
-			last = 0;
-
-			mus_to_midi_eot = 1;
 			break;
 
 		case 0x70:
-			mus_to_midi_pos++;
-			return;
+			next();
+			p_last = false;
+			return 0;
+	}
+
+	if (!ok || type == 0x60) {
+		// the score end has no delay after it, however it is marked
+		p_event[0] = 0xff;
+		p_event[1] = 0x2f;
+		p_event[2] = 0x00;
+		p_last = false;
+		return 3;
 	}
 
 	if (channel == 9) {
@@ -687,80 +946,8 @@ static void mus_event_convert() {
 	} else if (channel == 15) {
 		channel = 9;
 	}
-
-	event[0] |= channel;
-
-	mus_to_midi_data = (uint8_t *)realloc(mus_to_midi_data, mus_to_midi_size + mus_to_midi_delta_count + count);
-
-	memcpy(mus_to_midi_data + mus_to_midi_size, &mus_to_midi_delta_bytes, mus_to_midi_delta_count);
-	mus_to_midi_size += mus_to_midi_delta_count;
-	memcpy(mus_to_midi_data + mus_to_midi_size, &event, count);
-	mus_to_midi_size += count;
-
-	if (last) {
-		mus_to_midi_delta_count = 0;
-		do {
-			data = *mus_to_midi_pos++;
-			mus_to_midi_delta_bytes[mus_to_midi_delta_count] = data;
-			mus_to_midi_delta_count++;
-		} while (data & 128);
-	} else {
-		mus_to_midi_delta_bytes[0] = 0;
-		mus_to_midi_delta_count = 1;
-	}
-}
-
-static FileAndMemReader *mus_to_midi(FileAndMemReader *p_fmr) {
-	MUSHeader *mus_header = (MUSHeader *)p_fmr->get_data();
-	MIDHeader mid_header;
-	int mid_track_length_offset;
-	int converted_track_length;
-	int i;
-
-	if (strncmp(mus_header->id, MUS_MAGIC, 4) != 0) {
-		return nullptr;
-	}
-
-	if (p_fmr->file_size() != mus_header->score_start + mus_header->score_length) {
-		return nullptr;
-	}
-
-	mus_to_midi_size = sizeof(MIDHeader);
-	memcpy(mid_header.id, MID_MAGIC, 4);
-	mid_header.length = byte_swap_32(6);
-	mid_header.type = byte_swap_16(0);
-	mid_header.ntracks = byte_swap_16(1);
-	mid_header.ticks = byte_swap_16(70);
-	mus_to_midi_data = (uint8_t *)malloc(mus_to_midi_size);
-	memcpy(mus_to_midi_data, &mid_header, mus_to_midi_size);
-
-	mus_to_midi_data = (uint8_t *)realloc(mus_to_midi_data, mus_to_midi_size + 8);
-	memcpy(mus_to_midi_data + mus_to_midi_size, TRACK_MAGIC, 4);
-	mus_to_midi_size += 4;
-	mid_track_length_offset = mus_to_midi_size;
-	mus_to_midi_size += 4;
-
-	converted_track_length = 0;
-
-	mus_to_midi_pos = (uint8_t *)p_fmr->get_data() + mus_header->score_start;
-	mus_to_midi_eot = 0;
-	mus_to_midi_delta_bytes[0] = 0;
-	mus_to_midi_delta_count = 1;
-
-	for (i = 0; i < 16; i++) {
-		mus_to_midi_channels[i] = 0;
-	}
-
-	while (!mus_to_midi_eot) {
-		mus_event_convert();
-	}
-	converted_track_length = byte_swap_32(mus_to_midi_size - sizeof(MIDHeader) - 8);
-	memcpy(mus_to_midi_data + mid_track_length_offset, &converted_track_length, 4);
-
-	FileAndMemReader *converted = new FileAndMemReader;
-	converted->open_data(mus_to_midi_data, mus_to_midi_size);
-
-	return converted;
+	p_event[0] |= channel;
+	return count;
 }
 
 struct SF2Modulator {
@@ -1080,70 +1267,190 @@ private:
 
 	static float map(float p_value, const SF2Modulator &p_mod) {
 		if (p_mod.palette == ControllerPalette::GENERAL && p_mod.index.general == GeneralController::PITCH_WHEEL) {
-			p_value /= 1 << 14;
-		} else {
-			p_value /= 1 << 7;
-		}
-
-		if (p_mod.type == SourceType::SWITCH) {
-			const float off = p_mod.polarity == SourcePolarity::UNIPOLAR ? 0.0f : -1.0f;
-			const float x = p_mod.direction == SourceDirection::POSITIVE ? p_value : 1.0f - p_value;
-			return x >= 0.5f ? 1.0f : off;
-		} else if (p_mod.polarity == SourcePolarity::UNIPOLAR) {
-			const float x = p_mod.direction == SourceDirection::POSITIVE ? p_value : 1.0f - p_value;
-			switch (p_mod.type) {
-				case SourceType::LINEAR:
-					return x;
-				case SourceType::CONCAVE:
-					return concave_curve(x);
-				case SourceType::CONVEX:
-					return convex_curve(x);
-				default:
-					break;
-			}
-		} else {
-			const int dir = p_mod.direction == SourceDirection::POSITIVE ? 1 : -1;
-			const int sign = p_value > 0.5f ? 1 : -1;
-			const float x = 2.0f * p_value - 1.0f;
-			switch (p_mod.type) {
-				case SourceType::LINEAR:
-					return dir * x;
-				case SourceType::CONCAVE:
-					return sign * dir * concave_curve(sign * x);
-				case SourceType::CONVEX:
-					return sign * dir * convex_curve(sign * x);
-				default:
-					break;
-			}
+			return map_controller_curve(p_value / (1 << 14), p_mod.type, p_mod.polarity, p_mod.direction);
 		}
-		return 0.0f;
+		if (p_mod.type <= SourceType::SWITCH && p_value >= 0.0f && p_value < CONTROLLER_TABLE_SIZE &&
+				p_value == (uint32_t)p_value) {
+			return controller_curve_table[(size_t)p_mod.type][(size_t)p_mod.polarity][(size_t)p_mod.direction][(size_t)p_value];
+		}
+		return map_controller_curve(p_value / (1 << 7), p_mod.type, p_mod.polarity, p_mod.direction);
 	}
 };
 
+// Calls p_job with every index below p_count, spread over up to p_threads threads (including
+// the calling one); jobs must be independent of each other
+template <typename T>
+static void parallel_for(size_t p_count, unsigned int p_threads, const T &p_job) {
+#ifdef TINYPRIMESYNTH_NO_THREADS
+	(void)p_threads;
+	for (size_t i = 0; i < p_count; ++i) {
+		p_job(i);
+	}
+#else
+	if (p_threads <= 1 || p_count <= 1) {
+		for (size_t i = 0; i < p_count; ++i) {
+			p_job(i);
+		}
+		return;
+	}
+	std::atomic<size_t> next_index(0);
+	const auto worker = [&]() {
+		for (size_t i = next_index++; i < p_count; i = next_index++) {
+			p_job(i);
+		}
+	};
+	std::vector<std::thread> threads;
+	const size_t num_threads = std::min((size_t)p_threads, p_count);
+	threads.reserve(num_threads - 1);
+	for (size_t i = 1; i < num_threads; ++i) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+#endif
+}
+
+// Largest absolute value among p_length samples
+static int find_sample_peak(const int16_t *p_data, size_t p_length) {
+	int sample_max = 0;
+	size_t i = 0;
+#ifdef TINYPRIMESYNTH_SSE2
+	if (p_length >= 8) {
+		// track minimum and maximum separately, as the absolute value of INT16_MIN does not fit in 16 bits
+		__m128i lowest = _mm_setzero_si128();
+		__m128i highest = _mm_setzero_si128();
+		for (; i + 8 <= p_length; i += 8) {
+			const __m128i values = _mm_loadu_si128((const __m128i *)(p_data + i));
+			lowest = _mm_min_epi16(lowest, values);
+			highest = _mm_max_epi16(highest, values);
+		}
+		int16_t lowest_lanes[8], highest_lanes[8];
+		_mm_storeu_si128((__m128i *)lowest_lanes, lowest);
+		_mm_storeu_si128((__m128i *)highest_lanes, highest);
+		for (size_t lane = 0; lane < 8; ++lane) {
+			sample_max = std::max(sample_max, std::max(-(int)lowest_lanes[lane], (int)highest_lanes[lane]));
+		}
+	}
+#endif
+	for (; i < p_length; ++i) {
+		sample_max = std::max(sample_max, abs(p_data[i]));
+	}
+	return sample_max;
+}
+
 struct Sample {
 	uint32_t start, end, start_loop, end_loop, sample_rate;
 	int8_t key, correction;
 	float min_atten;
-	const std::vector<int16_t> *buffer;
+	const int16_t *buffer;
+	// sample data in mu-law instead of buffer, see Synthesizer::set_compact_samples
+	const uint8_t *compact_buffer;
+	uint32_t buffer_size;
+	bool has_peak;
 
 	Sample() {
 	}
 
-	Sample(const SF2Sample &p_sample, const std::vector<int16_t> &p_sample_buffer, Synthesizer *p_synth) :
-			start(p_sample.start), end(p_sample.end), start_loop(p_sample.start_loop), end_loop(p_sample.end_loop), sample_rate(p_sample.sample_rate), key(p_sample.original_key), correction(p_sample.correction), buffer(&p_sample_buffer) {
-		if (start >= p_sample_buffer.size() || end >= p_sample_buffer.size()) {
+	Sample(const SF2Sample &p_sample, const int16_t *p_sample_buffer, uint32_t p_sample_buffer_size, Synthesizer *p_synth) :
+			start(p_sample.start), end(p_sample.end), start_loop(p_sample.start_loop), end_loop(p_sample.end_loop), sample_rate(p_sample.sample_rate), key(p_sample.original_key), correction(p_sample.correction), buffer(p_sample_buffer), compact_buffer(nullptr), buffer_size(p_sample_buffer_size) {
+		if (start >= buffer_size || end >= buffer_size) {
 			printf("Generator extends sample range beyond end\n");
 			p_synth->set_load_error(true);
 			return;
 		}
 		if (start < end) {
-			int sample_max = 0;
-			for (size_t i = start; i < end; ++i) {
-				sample_max = std::max(sample_max, abs(p_sample_buffer[i]));
-			}
-			min_atten = amplitude_to_attenuation((float)sample_max / INT16_MAX);
+			// samples decoded on demand get their peak when they are first played
+			has_peak = buffer != nullptr;
+			min_atten = has_peak ? amplitude_to_attenuation((float)find_sample_peak(buffer + start, end - start) / INT16_MAX) : 0.0f;
 		} else { // "Disable" the sample; this is consistent with Fluidsynth/TinySoundFont
 			start = end = start_loop = end_loop = 0;
+			has_peak = true;
+		}
+	}
+};
+
+// Sample data decoded on demand, kept per range of the sample buffer. Voices pin the range they
+// play; past the size budget, the least recently used ranges that are not pinned are dropped
+class SampleCache {
+public:
+	typedef std::function<bool(uint32_t p_first, uint32_t p_count, int16_t *p_out)> Decoder;
+
+	// p_source_size is the memory held by the decoder, for statistics
+	SampleCache(size_t p_budget, size_t p_source_size, const Decoder &p_decoder) :
+			budget(p_budget), used(0), source_size(p_source_size), hits(0), misses(0), evictions(0), decoder(p_decoder) {
+	}
+
+	// The counters are updated by the thread calling play_stream, so they can be read from
+	// any other thread
+	void get_stats(Synthesizer::SampleCacheStats &p_stats) const {
+		p_stats.hits = hits.load(std::memory_order_relaxed);
+		p_stats.misses = misses.load(std::memory_order_relaxed);
+		p_stats.evictions = evictions.load(std::memory_order_relaxed);
+		p_stats.cached_bytes = used.load(std::memory_order_relaxed);
+		p_stats.source_bytes = source_size;
+	}
+
+	// Returns the samples [p_first, p_end) followed by a zero, and a pin count the caller must
+	// decrement when done with them; nullptr if they could not be decoded
+	const int16_t *get(uint32_t p_first, uint32_t p_end, uint32_t **p_pins) {
+		const uint64_t key = (uint64_t)p_first << 32 | p_end;
+		std::map<uint64_t, Range>::iterator found = ranges.find(key);
+		if (found != ranges.end()) {
+			hits.fetch_add(1, std::memory_order_relaxed);
+			lru.splice(lru.begin(), lru, found->second.lru_position);
+		} else {
+			misses.fetch_add(1, std::memory_order_relaxed);
+			const size_t size = (p_end - p_first + 1) * sizeof(int16_t);
+			make_room(size);
+			Range &range = ranges[key];
+			range.samples.resize(p_end - p_first + 1);
+			if (!decoder(p_first, p_end - p_first, range.samples.data())) {
+				ranges.erase(key);
+				return nullptr;
+			}
+			range.samples.back() = 0;
+			range.pins = 0;
+			lru.push_front(key);
+			range.lru_position = lru.begin();
+			used.fetch_add(size, std::memory_order_relaxed);
+			found = ranges.find(key);
+		}
+		Range &range = found->second;
+		++range.pins;
+		*p_pins = &range.pins;
+		return range.samples.data();
+	}
+
+private:
+	struct Range {
+		std::vector<int16_t> samples;
+		uint32_t pins;
+		std::list<uint64_t>::iterator lru_position;
+	};
+
+	size_t budget;
+	std::atomic<size_t> used;
+	size_t source_size;
+	std::atomic<size_t> hits, misses, evictions;
+	Decoder decoder;
+	std::map<uint64_t, Range> ranges;
+	// most recently used first
+	std::list<uint64_t> lru;
+
+	void make_room(size_t p_size) {
+		std::list<uint64_t>::iterator it = lru.end();
+		while (used.load(std::memory_order_relaxed) + p_size > budget && it != lru.begin()) {
+			--it;
+			std::map<uint64_t, Range>::iterator range = ranges.find(*it);
+			if (range->second.pins) {
+				continue;
+			}
+			used.fetch_sub(range->second.samples.size() * sizeof(int16_t), std::memory_order_relaxed);
+			evictions.fetch_add(1, std::memory_order_relaxed);
+			ranges.erase(range);
+			it = lru.erase(it);
 		}
 	}
 };
@@ -1188,10 +1495,8 @@ class ModulatorParameterSet {
 public:
 	static const ModulatorParameterSet &get_default_parameters() {
 		static ModulatorParameterSet def_params;
-		static bool initialized = false;
-		if (!initialized) {
-			initialized = true;
-
+		// filled in while initializing a local static, which is safe when soundfonts load on several threads
+		static const bool initialized = []() {
 			// See "SoundFont Technical Specification" Version 2.04
 			// p.41 "8.4 Default Modulators"
 			{
@@ -1347,7 +1652,9 @@ public:
 				param.mod_trans_oper = Transform::LINEAR;
 				def_params.append(param);
 			}
-		}
+			return true;
+		}();
+		(void)initialized;
 		return def_params;
 	}
 
@@ -1421,56 +1728,59 @@ struct Zone {
 	}
 };
 
-static void read_bags(std::vector<Zone> &p_zones, std::vector<Bag>::const_iterator p_bag_begin,
-		std::vector<Bag>::const_iterator p_bag_end, const std::vector<ModList> &p_mods,
-		const std::vector<GenList> &p_gens, SF2Generator p_index_gen, Synthesizer *p_synth) {
-	if (&(*p_bag_begin) > &(*p_bag_end)) {
+// Bags [p_bag_begin, p_bag_end) of p_bags; the bag after each one marks where its modulators and generators end
+static void read_bags(std::vector<Zone> &p_zones, const std::vector<Bag> &p_bags, size_t p_bag_begin, size_t p_bag_end,
+		const std::vector<ModList> &p_mods, const std::vector<GenList> &p_gens, SF2Generator p_index_gen,
+		Synthesizer *p_synth) {
+	if (p_bag_begin > p_bag_end) {
 		printf("bag indices not monotonically increasing");
 		p_synth->set_load_error(true);
 		return;
 	}
+	if (p_bag_end >= p_bags.size()) {
+		printf("bag index out of range");
+		p_synth->set_load_error(true);
+		return;
+	}
 
 	Zone global_zone;
 
-	for (std::vector<Bag>::const_iterator it_bag = p_bag_begin; it_bag != p_bag_end; ++it_bag) {
+	p_zones.reserve(p_bag_end - p_bag_begin);
+	for (size_t bag = p_bag_begin; bag < p_bag_end; ++bag) {
 		Zone zone;
 
-		std::vector<Bag>::const_iterator next_bag = it_bag;
-		++next_bag;
-
-		std::vector<ModList>::const_iterator begin_mod = p_mods.begin();
-		for (uint16_t i = 0; i < it_bag->mod_index; ++i) {
-			++begin_mod;
-		}
-		std::vector<ModList>::const_iterator end_mod = p_mods.begin();
-		for (uint16_t i = 0; i < next_bag->mod_index; ++i) {
-			++end_mod;
-		}
-		if (&(*begin_mod) > &(*end_mod)) {
+		const size_t begin_mod = p_bags[bag].mod_index;
+		const size_t end_mod = p_bags[bag + 1].mod_index;
+		if (begin_mod > end_mod) {
 			printf("modulator indices not monotonically increasing");
 			p_synth->set_load_error(true);
 			return;
 		}
-		for (std::vector<ModList>::const_iterator it_mod = begin_mod; it_mod != end_mod; ++it_mod) {
-			zone.modulator_parameters.append(*it_mod);
-		}
-
-		std::vector<GenList>::const_iterator begin_gen = p_gens.begin();
-		for (uint16_t i = 0; i < it_bag->gen_index; ++i) {
-			++begin_gen;
+		if (end_mod > p_mods.size()) {
+			printf("modulator index out of range");
+			p_synth->set_load_error(true);
+			return;
 		}
-		std::vector<GenList>::const_iterator end_gen = p_gens.begin();
-		for (uint16_t i = 0; i < next_bag->gen_index; ++i) {
-			++end_gen;
+		for (size_t mod = begin_mod; mod < end_mod; ++mod) {
+			zone.modulator_parameters.append(p_mods[mod]);
 		}
-		if (&(*begin_gen) > &(*end_gen)) {
+
+		const size_t begin_gen = p_bags[bag].gen_index;
+		const size_t end_gen = p_bags[bag + 1].gen_index;
+		if (begin_gen > end_gen) {
 			printf("generator indices not monotonically increasing");
 			p_synth->set_load_error(true);
 			return;
 		}
-		for (std::vector<GenList>::const_iterator it_gen = begin_gen; it_gen != end_gen; ++it_gen) {
-			const RangesType &range = it_gen->gen_amount.ranges;
-			switch (it_gen->gen_oper) {
+		if (end_gen > p_gens.size()) {
+			printf("generator index out of range");
+			p_synth->set_load_error(true);
+			return;
+		}
+		for (size_t gen = begin_gen; gen < end_gen; ++gen) {
+			const GenList &gen_list = p_gens[gen];
+			const RangesType &range = gen_list.gen_amount.ranges;
+			switch (gen_list.gen_oper) {
 				case SF2Generator::KEY_RANGE:
 					zone.key_range = { range.lo, range.hi };
 					break;
@@ -1478,19 +1788,16 @@ static void read_bags(std::vector<Zone> &p_zones, std::vector<Bag>::const_iterat
 					zone.velocity_range = { range.lo, range.hi };
 					break;
 				default:
-					if (it_gen->gen_oper < SF2Generator::END_OPERATOR) {
-						zone.generators.set(it_gen->gen_oper, it_gen->gen_amount.sh_amount);
+					if (gen_list.gen_oper < SF2Generator::END_OPERATOR) {
+						zone.generators.set(gen_list.gen_oper, gen_list.gen_amount.sh_amount);
 					}
 					break;
 			}
 		}
 
-		std::vector<GenList>::const_iterator prev_gen = end_gen;
-		--prev_gen;
-
-		if (begin_gen != end_gen && prev_gen->gen_oper == p_index_gen) {
+		if (begin_gen != end_gen && p_gens[end_gen - 1].gen_oper == p_index_gen) {
 			p_zones.push_back(zone);
-		} else if (it_bag == p_bag_begin && (begin_gen != end_gen || begin_mod != end_mod)) {
+		} else if (bag == p_bag_begin && (begin_gen != end_gen || begin_mod != end_mod)) {
 			global_zone = zone;
 		}
 	}
@@ -1508,42 +1815,33 @@ struct Instrument {
 	Instrument(std::vector<Inst>::iterator p_inst_iter, const std::vector<Bag> &p_ibag,
 			const std::vector<ModList> &p_imod, const std::vector<GenList> &p_igen,
 			Synthesizer *p_synth) {
-		std::vector<Bag>::const_iterator bag_begin = p_ibag.begin();
-		for (uint16_t i = 0; i < p_inst_iter->inst_bag_index; ++i) {
-			++bag_begin;
-		}
-		std::vector<Inst>::iterator next_inst = p_inst_iter;
-		++next_inst;
-		std::vector<Bag>::const_iterator bag_end = p_ibag.begin();
-		for (uint16_t i = 0; i < next_inst->inst_bag_index; ++i) {
-			++bag_end;
-		}
-		read_bags(zones, bag_begin, bag_end, p_imod, p_igen, SF2Generator::SAMPLE_ID, p_synth);
+		std::vector<Inst>::iterator next_inst = p_inst_iter + 1;
+		read_bags(zones, p_ibag, p_inst_iter->inst_bag_index, next_inst->inst_bag_index, p_imod, p_igen,
+				SF2Generator::SAMPLE_ID, p_synth);
 	}
 };
 
 struct Synthesizer::Preset {
 	uint16_t bank, preset_id;
 	std::vector<Zone> zones;
-	const SoundFont *soundfont;
+	SoundFont *soundfont;
+	// Initialized voice for every instrument zone of every preset zone, indexed the same way
+	// as zones and the instrument's zones; see SoundFont::build_voice_templates
+	std::vector<std::vector<Voice *>> voice_templates;
 
 	Preset() {
 	}
+	~Preset();
+	// The voice templates are owned and deleted by the preset, so it is never copied
+	Preset(const Preset &) = delete;
+	Preset &operator=(const Preset &) = delete;
 	Preset(std::vector<PresetHeader>::iterator p_phdr_iter, const std::vector<Bag> &p_pbag,
 			const std::vector<ModList> &p_pmod, const std::vector<GenList> &p_pgen,
-			const SoundFont *p_sfont, Synthesizer *p_synth) :
+			SoundFont *p_sfont, Synthesizer *p_synth) :
 			bank(p_phdr_iter->bank), preset_id(p_phdr_iter->preset), soundfont(p_sfont) {
-		std::vector<Bag>::const_iterator bag_begin = p_pbag.begin();
-		for (uint16_t i = 0; i < p_phdr_iter->preset_bag_index; ++i) {
-			++bag_begin;
-		}
-		std::vector<PresetHeader>::iterator next_preset = p_phdr_iter;
-		++next_preset;
-		std::vector<Bag>::const_iterator bag_end = p_pbag.begin();
-		for (uint16_t i = 0; i < next_preset->preset_bag_index; ++i) {
-			++bag_end;
-		}
-		read_bags(zones, bag_begin, bag_end, p_pmod, p_pgen, SF2Generator::INSTRUMENT, p_synth);
+		std::vector<PresetHeader>::iterator next_preset = p_phdr_iter + 1;
+		read_bags(zones, p_pbag, p_phdr_iter->preset_bag_index, next_preset->preset_bag_index, p_pmod, p_pgen,
+				SF2Generator::INSTRUMENT, p_synth);
 	}
 };
 
@@ -1573,7 +1871,67 @@ static const uint32_t to_four_cc(const char p_str[5]) {
 }
 class Synthesizer::SoundFont {
 public:
-	explicit SoundFont(FileAndMemReader *p_file, Synthesizer *p_synth) {
+	explicit SoundFont(FileAndMemReader *p_file, Synthesizer *p_synth) :
+			sample_buffer(nullptr), sample_buffer_size(0), sample_cache(nullptr) {
+		load(p_file, nullptr, p_synth);
+	}
+
+	// Loads the image of an SF2 file decoded from SF2FLAC, taking over its smpl region as sample
+	// data instead of copying it out
+	explicit SoundFont(std::vector<int16_t> &p_image, Synthesizer *p_synth) :
+			sample_buffer(nullptr), sample_buffer_size(0), sample_cache(nullptr) {
+		FileAndMemReader reader;
+		reader.open_data(p_image.data(), p_image.size() * sizeof(int16_t));
+		load(&reader, &p_image, p_synth);
+	}
+
+	// Loads an SF2 file whose smpl chunk has no contents, taking its sample data from p_cache as
+	// voices start playing it
+	explicit SoundFont(const std::vector<uint8_t> &p_header, SampleCache *p_cache, Synthesizer *p_synth) :
+			sample_buffer(nullptr), sample_buffer_size(0), sample_cache(p_cache) {
+		FileAndMemReader reader;
+		reader.open_data(p_header.data(), p_header.size());
+		load(&reader, nullptr, p_synth);
+	}
+
+	~SoundFont() {
+		for (const Preset *preset : presets) {
+			delete preset;
+		}
+		delete sample_cache;
+	}
+
+	inline const std::vector<Sample> &get_samples() const {
+		return samples;
+	}
+
+	inline const std::vector<Instrument> &get_instruments() const {
+		return instruments;
+	}
+
+	inline const std::vector<Synthesizer::Preset *> &get_preset_pointers() const {
+		return presets;
+	}
+
+	bool attach_samples(Voice &p_voice);
+
+	inline const SampleCache *get_sample_cache() const {
+		return sample_cache;
+	}
+
+private:
+	std::vector<int16_t> sample_storage;
+	const int16_t *sample_buffer;
+	uint32_t sample_buffer_size;
+	std::vector<uint8_t> compact_storage;
+	SampleCache *sample_cache;
+	std::vector<Sample> samples;
+	std::vector<Instrument> instruments;
+	std::vector<Preset *> presets;
+
+	void build_voice_templates(float p_output_rate, unsigned int p_threads);
+
+	void load(FileAndMemReader *p_file, std::vector<int16_t> *p_image, Synthesizer *p_synth) {
 		if (!p_file) {
 			p_synth->set_load_error(true);
 			return;
@@ -1599,7 +1957,7 @@ public:
 							read_info_chunk(p_file, chunk_size, p_synth);
 							break;
 						case FOUR_CC_SDTA:
-							read_sdta_chunk(p_file, chunk_size, p_synth);
+							read_sdta_chunk(p_file, chunk_size, p_image, p_synth);
 							break;
 						case FOUR_CC_PDTA:
 							read_pdta_chunk(p_file, chunk_size, p_synth);
@@ -1615,35 +1973,35 @@ public:
 					break;
 			}
 			if (p_synth->get_load_error()) {
-				break;
+				return;
 			}
 		}
-	}
 
-	~SoundFont() {
-		for (const Preset *preset : presets) {
-			delete preset;
+		if (p_synth->compact_samples && sample_buffer) {
+			compact_sample_data(p_synth->load_threads);
 		}
+		build_voice_templates(p_synth->output_rate, p_synth->load_threads);
 	}
 
-	inline const std::vector<Sample> &get_samples() const {
-		return samples;
-	}
-
-	inline const std::vector<Instrument> &get_instruments() const {
-		return instruments;
-	}
-
-	inline const std::vector<const Synthesizer::Preset *> &get_preset_pointers() const {
-		return presets;
+	// Replaces the 16-bit sample data with mu-law, which voices expand as they render. Sample
+	// peaks were already found from the original data
+	void compact_sample_data(unsigned int p_threads) {
+		static const size_t BATCH_SIZE = 65536;
+		compact_storage.resize(sample_buffer_size);
+		parallel_for((sample_buffer_size + BATCH_SIZE - 1) / BATCH_SIZE, p_threads, [&](size_t p_batch) {
+			const size_t end = std::min((size_t)sample_buffer_size, (p_batch + 1) * BATCH_SIZE);
+			for (size_t i = p_batch * BATCH_SIZE; i < end; ++i) {
+				compact_storage[i] = encode_mu_law(sample_buffer[i]);
+			}
+		});
+		std::vector<int16_t>().swap(sample_storage);
+		sample_buffer = nullptr;
+		for (Sample &sample : samples) {
+			sample.buffer = nullptr;
+			sample.compact_buffer = compact_storage.data();
+		}
 	}
 
-private:
-	std::vector<int16_t> sample_buffer;
-	std::vector<Sample> samples;
-	std::vector<Instrument> instruments;
-	std::vector<const Preset *> presets;
-
 	void read_info_chunk(FileAndMemReader *p_file, size_t p_size, Synthesizer *p_synth) {
 		for (size_t s = 0; s < p_size;) {
 			const RIFFHeader subchunk_header = read_header(p_file);
@@ -1667,7 +2025,7 @@ private:
 		}
 	}
 
-	void read_sdta_chunk(FileAndMemReader *p_file, size_t p_size, Synthesizer *p_synth) {
+	void read_sdta_chunk(FileAndMemReader *p_file, size_t p_size, std::vector<int16_t> *p_image, Synthesizer *p_synth) {
 		for (size_t s = 0; s < p_size;) {
 			const RIFFHeader subchunk_header = read_header(p_file);
 			s += sizeof(subchunk_header) + subchunk_header.size;
@@ -1678,8 +2036,22 @@ private:
 						p_synth->set_load_error(true);
 						return;
 					}
-					sample_buffer.resize(subchunk_header.size / sizeof(int16_t));
-					p_file->read((char *)sample_buffer.data(), 1, subchunk_header.size);
+					sample_buffer_size = subchunk_header.size / sizeof(int16_t);
+					if (sample_cache) {
+						// the contents are not part of the file, see sample_cache
+						break;
+					}
+					if (p_image && p_file->get_data() == p_image->data() && p_file->tell() % sizeof(int16_t) == 0 &&
+							p_file->tell() + subchunk_header.size <= p_file->file_size()) {
+						// the reader keeps pointing at the same memory after the swap
+						sample_storage.swap(*p_image);
+						sample_buffer = sample_storage.data() + p_file->tell() / sizeof(int16_t);
+						p_file->seek(subchunk_header.size, SEEK_CUR);
+					} else {
+						sample_storage.resize(sample_buffer_size);
+						p_file->read((char *)sample_storage.data(), 1, subchunk_header.size);
+						sample_buffer = sample_storage.data();
+					}
 					break;
 				default:
 					p_file->seek(subchunk_header.size, SEEK_CUR);
@@ -1688,9 +2060,8 @@ private:
 		}
 	}
 
-	void read_modulator(FileAndMemReader *p_file, SF2Modulator &p_mod) {
-		uint16_t data;
-		p_file->read((char *)&data, 1, sizeof(uint16_t));
+	static void read_modulator(const uint8_t *p_data, SF2Modulator &p_mod) {
+		const uint16_t data = p_data[0] | (p_data[1] << 8);
 
 		p_mod.index.midi = data & 127;
 		p_mod.palette = (ControllerPalette)((data >> 7) & 1);
@@ -1706,15 +2077,29 @@ private:
 			p_synth->set_load_error(true);
 			return;
 		}
-		p_list.reserve(p_total_size / STRUCT_SIZE);
-		for (size_t i = 0; i < p_total_size / STRUCT_SIZE; ++i) {
-			ModList mod;
-			read_modulator(p_file, mod.mod_src_oper);
-			p_file->read((char *)&mod.mod_dest_oper, 1, 2);
-			p_file->read((char *)&mod.mod_amount, 1, 2);
-			read_modulator(p_file, mod.mod_amount_src_oper);
-			p_file->read((char *)&mod.mod_trans_oper, 1, 2);
-			p_list.push_back(mod);
+		// view the records in place when the reader allows it, otherwise copy them out
+		const uint8_t *records;
+		std::vector<uint8_t> data;
+		const size_t viewed = p_file->read_in_place(&records, p_total_size);
+		if (viewed != p_total_size) {
+			p_file->seek(-(long)viewed, SEEK_CUR);
+			data.resize(p_total_size);
+			if (p_file->read(data.data(), 1, p_total_size) != p_total_size) {
+				printf("unexpected end of file");
+				p_synth->set_load_error(true);
+				return;
+			}
+			records = data.data();
+		}
+		p_list.resize(p_total_size / STRUCT_SIZE);
+		for (size_t i = 0; i < p_list.size(); ++i) {
+			const uint8_t *record = records + i * STRUCT_SIZE;
+			ModList &mod = p_list[i];
+			read_modulator(record, mod.mod_src_oper);
+			memcpy(&mod.mod_dest_oper, record + 2, 2);
+			memcpy(&mod.mod_amount, record + 4, 2);
+			read_modulator(record + 6, mod.mod_amount_src_oper);
+			memcpy(&mod.mod_trans_oper, record + 8, 2);
 		}
 	}
 
@@ -1725,10 +2110,10 @@ private:
 			p_synth->set_load_error(true);
 			return;
 		}
-		size_t num_members = p_total_size / sizeof(T);
-		p_list.resize(num_members);
-		for (size_t i = 0; i < num_members; ++i) {
-			p_file->read((char *)&p_list[i], 1, sizeof(T));
+		p_list.resize(p_total_size / sizeof(T));
+		if (p_file->read(p_list.data(), 1, p_total_size) != p_total_size) {
+			printf("unexpected end of file");
+			p_synth->set_load_error(true);
 		}
 	}
 
@@ -1787,39 +2172,34 @@ private:
 			p_synth->set_load_error(true);
 			return;
 		}
-		instruments.reserve(inst.size() - 1);
-		for (std::vector<Inst>::iterator it_inst = inst.begin(), it_end = --inst.end(); it_inst != it_end; ++it_inst) {
-			instruments.push_back({ it_inst, ibag, imod, igen, p_synth });
-			if (p_synth->get_load_error()) {
-				return;
-			}
-		}
-
 		if (phdr.size() < 2) {
 			printf("no preset found");
 			p_synth->set_load_error(true);
 			return;
 		}
-		presets.reserve(phdr.size() - 1);
-		for (std::vector<PresetHeader>::iterator it_phdr = phdr.begin(), it_end = --phdr.end(); it_phdr != it_end; ++it_phdr) {
-			presets.push_back(new Preset(it_phdr, pbag, pmod, pgen, this, p_synth));
-			if (p_synth->get_load_error()) {
-				return;
-			}
-		}
-
 		if (shdr.size() < 2) {
 			printf("no sample found");
 			p_synth->set_load_error(true);
 			return;
 		}
-		samples.reserve(shdr.size() - 1);
-		for (std::vector<SF2Sample>::iterator it_shdr = shdr.begin(), it_end = --shdr.end(); it_shdr != it_end; ++it_shdr) {
-			samples.push_back({ *it_shdr, sample_buffer, p_synth });
-			if (p_synth->get_load_error()) {
-				return;
+
+		// every instrument, preset and sample only reads the lists above, so they can be built side by side
+		instruments.resize(inst.size() - 1);
+		presets.resize(phdr.size() - 1, nullptr);
+		samples.resize(shdr.size() - 1);
+		const size_t num_instruments = instruments.size();
+		const size_t num_presets = presets.size();
+		parallel_for(num_instruments + num_presets + samples.size(), p_synth->load_threads, [&](size_t p_index) {
+			if (p_index < num_instruments) {
+				instruments[p_index] = { inst.begin() + p_index, ibag, imod, igen, p_synth };
+			} else if (p_index < num_instruments + num_presets) {
+				p_index -= num_instruments;
+				presets[p_index] = new Preset(phdr.begin() + p_index, pbag, pmod, pgen, this, p_synth);
+			} else {
+				p_index -= num_instruments + num_presets;
+				samples[p_index] = { shdr[p_index], sample_buffer, sample_buffer_size, p_synth };
 			}
-		}
+		});
 	}
 };
 
@@ -1858,6 +2238,16 @@ static inline StereoValue calculate_panned_volume(float p_pan) {
 	}
 }
 
+// Generators that set up envelopes, LFOs, panning and pitch when a voice starts
+static const SF2Generator INIT_GENERATORS[] = {
+	SF2Generator::PAN, SF2Generator::DELAY_MOD_LFO, SF2Generator::FREQ_MOD_LFO,
+	SF2Generator::DELAY_VIB_LFO, SF2Generator::FREQ_VIB_LFO, SF2Generator::DELAY_MOD_ENV,
+	SF2Generator::ATTACK_MOD_ENV, SF2Generator::HOLD_MOD_ENV, SF2Generator::DECAY_MOD_ENV,
+	SF2Generator::SUSTAIN_MOD_ENV, SF2Generator::RELEASE_MOD_ENV, SF2Generator::DELAY_VOL_ENV,
+	SF2Generator::ATTACK_VOL_ENV, SF2Generator::HOLD_VOL_ENV, SF2Generator::DECAY_VOL_ENV,
+	SF2Generator::SUSTAIN_VOL_ENV, SF2Generator::RELEASE_VOL_ENV, SF2Generator::COARSE_TUNE
+};
+
 class Synthesizer::Voice {
 public:
 	enum class State {
@@ -1868,20 +2258,80 @@ public:
 		UNUSED
 	};
 
+	enum class List {
+		CHANNEL,
+		KEY,
+		EXCLUSIVE_CLASS,
+		LAST
+	};
+
+	// How readily a voice can be taken over when the pool is exhausted
+	enum class StealClass {
+		FREE,
+		RELEASED,
+		RELEASED_PERCUSSION,
+		SUSTAINED,
+		PLAYING,
+		LAST
+	};
+
+	struct Queue {
+		Voice *head, *tail;
+	};
+
 	Voice() :
-			status(State::UNUSED) {
+			song_volume(nullptr), sample_pins(nullptr), status(State::UNUSED), links(), queues(nullptr), queue(nullptr), queue_prev(nullptr), queue_next(nullptr) {
+	}
+
+	inline Voice *get_next(List p_list) const {
+		return links[(size_t)p_list].next;
+	}
+
+	// Voices are threaded onto intrusive lists owned by the Channel that is playing them,
+	// so that note and controller messages only visit the voices they apply to
+	void link(List p_list, Voice **p_head) {
+		ListLink &entry = links[(size_t)p_list];
+		entry.next = *p_head;
+		if (entry.next) {
+			entry.next->links[(size_t)p_list].prev_next = &entry.next;
+		}
+		entry.prev_next = p_head;
+		*p_head = this;
+	}
+
+	// The VoicePool keeps every voice in the queue matching its StealClass, in the order the
+	// voice entered that class, so the oldest candidate of each class is always at the head
+	void attach(Queue *p_queues) {
+		queues = p_queues;
+		requeue(true);
+	}
+
+	void unlink() {
+		for (size_t i = 0; i < (size_t)List::LAST; ++i) {
+			ListLink &entry = links[i];
+			if (!entry.prev_next) {
+				continue;
+			}
+			*entry.prev_next = entry.next;
+			if (entry.next) {
+				entry.next->links[i].prev_next = entry.prev_next;
+			}
+			entry.next = nullptr;
+			entry.prev_next = nullptr;
+		}
 	}
 
 	inline size_t get_channel() const {
 		return channel;
 	}
 
-	inline size_t get_note_id() const {
-		return note_id;
+	// Volume of the song layer whose channel is playing the voice
+	inline float get_song_volume() const {
+		return *song_volume;
 	}
 
-	inline float get_amp() const {
-		return amp;
+	inline size_t get_note_id() const {
+		return note_id;
 	}
 
 	inline unsigned int get_steps() const {
@@ -1903,22 +2353,27 @@ public:
 	inline StereoValue render() const {
 		const uint32_t i = index.get_integer_part();
 		const float r = index.get_fractional_part();
-		const float interpolated = (1.0f - r) * sample_buffer->operator[](i) + r * sample_buffer->operator[](i + 1);
+		const float interpolated = compact_buffer
+				? (1.0f - r) * compact_sample_table[compact_buffer[i]] + r * compact_sample_table[compact_buffer[i + 1]]
+				: (1.0f - r) * sample_buffer[i] + r * sample_buffer[i + 1];
 		return amp * volume * (interpolated / INT16_MAX);
 	}
 
-	void init(size_t p_channel, size_t p_note_id, float p_output_rate, const Sample &p_sample, const GeneratorSet &p_generators,
-			const ModulatorParameterSet &p_mod_params, uint8_t p_key, uint8_t p_velocity, bool p_percussion) {
-		channel = p_channel;
-		note_id = p_note_id;
-		actual_key = p_key;
+	// Sets up everything that only depends on the zone being played, so that note-on only has to
+	// copy the result and apply the key and velocity dependent parts (see init)
+	void init_template(float p_output_rate, const Sample &p_sample, const GeneratorSet &p_generators,
+			const ModulatorParameterSet &p_mod_params) {
+		channel = 0;
+		note_id = 0;
+		actual_key = 0;
 		sample_buffer = p_sample.buffer;
+		compact_buffer = p_sample.compact_buffer;
 		generators = p_generators;
-		percussion = p_percussion;
+		modulator_parameters = p_mod_params;
+		percussion = false;
 		fine_tuning = 0.0;
 		coarse_tuning = 0.0;
 		steps = 0;
-		status = State::PLAYING;
 		index = p_sample.start;
 		delta_index = 0u;
 		volume = { 1.0f, 1.0f };
@@ -1945,7 +2400,7 @@ public:
 				generators.get_or_default(SF2Generator::END_LOOP_ADDRESS_OFFSET);
 
 		// fix invalid sample range
-		const uint32_t buffer_size = (uint32_t)p_sample.buffer->size();
+		const uint32_t buffer_size = p_sample.buffer_size;
 		rt_sample.start = std::min(buffer_size - 1, rt_sample.start);
 		rt_sample.end = std::max(rt_sample.start + 1, std::min(buffer_size, rt_sample.end));
 		rt_sample.start_loop =
@@ -1956,18 +2411,10 @@ public:
 		delta_index_ratio = 1.0 / key_to_hertz(rt_sample.pitch) * p_sample.sample_rate / p_output_rate;
 
 		modulators.clear();
-		for (const ModList &mp : p_mod_params.get_parameters()) {
+		for (const ModList &mp : modulator_parameters.get_parameters()) {
 			modulators.push_back({ mp });
 		}
 
-		const int16_t gen_velocity = generators.get_or_default(SF2Generator::VELOCITY);
-		update_sf2_controller(GeneralController::NOTE_ON_VELOCITY, gen_velocity > 0 ? gen_velocity : p_velocity);
-
-		const int16_t gen_key = generators.get_or_default(SF2Generator::KEY_NUMBER);
-		const int16_t overridden_key = gen_key > 0 ? gen_key : p_key;
-		key_scaling = 60 - overridden_key;
-		update_sf2_controller(GeneralController::NOTE_ON_KEY_NUMBER, overridden_key);
-
 		float min_modulated_atten = ATTEN_FACTOR * generators.get_or_default(SF2Generator::INITIAL_ATTENUATION);
 		for (const Modulator &mod : modulators) {
 			if (mod.get_destination() == SF2Generator::INITIAL_ATTENUATION && mod.can_be_negative()) {
@@ -1977,24 +2424,106 @@ public:
 		}
 		min_atten = p_sample.min_atten + fmax(0.0f, min_modulated_atten);
 
+		key_scaling = 0;
 		for (size_t i = 0; i < NUM_GENERATORS; ++i) {
 			modulated[i] = generators.get_or_default((SF2Generator)i);
 		}
-		static const std::initializer_list<SF2Generator> INIT_GENERATORS = {
-			SF2Generator::PAN, SF2Generator::DELAY_MOD_LFO, SF2Generator::FREQ_MOD_LFO,
-			SF2Generator::DELAY_VIB_LFO, SF2Generator::FREQ_VIB_LFO, SF2Generator::DELAY_MOD_ENV,
-			SF2Generator::ATTACK_MOD_ENV, SF2Generator::HOLD_MOD_ENV, SF2Generator::DECAY_MOD_ENV,
-			SF2Generator::SUSTAIN_MOD_ENV, SF2Generator::RELEASE_MOD_ENV, SF2Generator::DELAY_VOL_ENV,
-			SF2Generator::ATTACK_VOL_ENV, SF2Generator::HOLD_VOL_ENV, SF2Generator::DECAY_VOL_ENV,
-			SF2Generator::SUSTAIN_VOL_ENV, SF2Generator::RELEASE_VOL_ENV, SF2Generator::COARSE_TUNE
-		};
 		for (const SF2Generator &generator : INIT_GENERATORS) {
 			update_modulated_params(generator);
 		}
 	}
 
+	void init(const Voice &p_template, size_t p_channel, const float *p_song_volume, size_t p_note_id, uint8_t p_key,
+			uint8_t p_velocity, bool p_percussion) {
+		unpin_samples();
+		channel = p_channel;
+		song_volume = p_song_volume;
+		note_id = p_note_id;
+		actual_key = p_key;
+		sample_buffer = p_template.sample_buffer;
+		compact_buffer = p_template.compact_buffer;
+		generators = p_template.generators;
+		rt_sample = p_template.rt_sample;
+		modulators = p_template.modulators;
+		min_atten = p_template.min_atten;
+		memcpy(modulated, p_template.modulated, sizeof(modulated));
+		percussion = p_percussion;
+		fine_tuning = 0.0;
+		coarse_tuning = 0.0;
+		delta_index_ratio = p_template.delta_index_ratio;
+		steps = 0;
+		status = State::PLAYING;
+		requeue(true);
+		voice_pitch = p_template.voice_pitch;
+		index = p_template.index;
+		delta_index = 0u;
+		volume = p_template.volume;
+		amp = 0.0;
+		delta_amp = 0.0;
+		vol_env = p_template.vol_env;
+		mod_env = p_template.mod_env;
+		vib_lfo = p_template.vib_lfo;
+		mod_lfo = p_template.mod_lfo;
+
+		const int16_t gen_velocity = generators.get_or_default(SF2Generator::VELOCITY);
+		const int16_t gen_key = generators.get_or_default(SF2Generator::KEY_NUMBER);
+		const int16_t overridden_key = gen_key > 0 ? gen_key : p_key;
+		key_scaling = 60 - overridden_key;
+
+		// The template was set up with every modulator at rest, so only the init generators whose
+		// modulators respond to key or velocity, and the ones scaled by the key, need updating
+		bool changed[NUM_GENERATORS] = {};
+		for (Modulator &mod : modulators) {
+			const bool by_velocity =
+					mod.update_sf2_controller(GeneralController::NOTE_ON_VELOCITY, gen_velocity > 0 ? gen_velocity : p_velocity);
+			const bool by_key = mod.update_sf2_controller(GeneralController::NOTE_ON_KEY_NUMBER, overridden_key);
+			if ((by_velocity || by_key) && (size_t)mod.get_destination() < NUM_GENERATORS) {
+				changed[(size_t)mod.get_destination()] = true;
+			}
+		}
+		changed[(size_t)SF2Generator::HOLD_MOD_ENV] = true;
+		changed[(size_t)SF2Generator::DECAY_MOD_ENV] = true;
+		changed[(size_t)SF2Generator::HOLD_VOL_ENV] = true;
+		changed[(size_t)SF2Generator::DECAY_VOL_ENV] = true;
+		changed[(size_t)SF2Generator::COARSE_TUNE] = true;
+		for (const SF2Generator &generator : INIT_GENERATORS) {
+			if (changed[(size_t)generator]) {
+				update_modulated_params(generator);
+			}
+		}
+	}
+
+	// A finished voice leaves its channel's lists right away, so they only hold sounding voices
 	inline void set_status(State p_status) {
 		status = p_status;
+		if (status == State::FINISHED) {
+			unpin_samples();
+			unlink();
+		}
+		requeue(false);
+	}
+
+	inline int16_t get_sample_id() const {
+		return generators.get_or_default(SF2Generator::SAMPLE_ID);
+	}
+
+	// The part of the sample buffer that playback can read, [p_first, p_end)
+	void get_sample_span(uint32_t &p_first, uint32_t &p_end) const {
+		p_first = std::min(index.get_integer_part(), rt_sample.start);
+		p_end = std::max(index.get_integer_part(), rt_sample.end) + 1;
+	}
+
+	// Plays from samples decoded on demand: p_buffer holds the sample buffer from p_first on, and
+	// p_pins is decremented once the voice is done with it
+	void use_samples(const int16_t *p_buffer, uint32_t p_first, uint32_t *p_pins, float p_sample_atten) {
+		sample_buffer = p_buffer;
+		sample_pins = p_pins;
+		rt_sample.start -= p_first;
+		rt_sample.end -= p_first;
+		rt_sample.start_loop -= p_first;
+		rt_sample.end_loop -= p_first;
+		index -= FixedPoint(p_first);
+		min_atten += p_sample_atten;
 	}
 
 	void update_sf2_controller(GeneralController p_controller, float p_value) {
@@ -2028,9 +2557,9 @@ public:
 			return;
 		}
 		if (p_sustained) {
-			status = State::SUSTAINED;
+			set_status(State::SUSTAINED);
 		} else {
-			status = State::RELEASED;
+			set_status(State::RELEASED);
 			vol_env.release();
 			mod_env.release();
 		}
@@ -2045,7 +2574,7 @@ public:
 			if (vol_env.get_phase() == Envelope::Phase::FINISHED ||
 					(vol_env.get_phase() > Envelope::Phase::ATTACK &&
 							min_atten + 960.0f * (1.0f - vol_env.get_value()) >= DYNAMIC_RANGE)) {
-				status = State::FINISHED;
+				set_status(State::FINISHED);
 				return;
 			}
 
@@ -2063,7 +2592,7 @@ public:
 			case SampleMode::LOOPED_UNTIL_RELEASE:
 				if (status == State::RELEASED) {
 					if (index.get_integer_part() >= rt_sample.end) {
-						status = State::FINISHED;
+						set_status(State::FINISHED);
 						return;
 					}
 				} else if (index.get_integer_part() >= rt_sample.end_loop) {
@@ -2074,7 +2603,7 @@ public:
 			case SampleMode::UNUSED:
 			default:
 				if (index.get_integer_part() >= rt_sample.end) {
-					status = State::FINISHED;
+					set_status(State::FINISHED);
 					return;
 				}
 				break;
@@ -2156,14 +2685,24 @@ private:
 		uint32_t start, end, start_loop, end_loop;
 	};
 
+	struct ListLink {
+		Voice *next;
+		Voice **prev_next;
+	};
+
 	size_t channel;
+	const float *song_volume;
 	size_t note_id;
 	uint8_t actual_key;
-	const std::vector<int16_t> *sample_buffer;
+	const int16_t *sample_buffer;
+	const uint8_t *compact_buffer;
+	uint32_t *sample_pins;
 	GeneratorSet generators;
 	RuntimeSample rt_sample;
 	int key_scaling;
 	std::vector<Modulator> modulators;
+	// only filled in for templates; the modulators of voices copied from one point into it
+	ModulatorParameterSet modulator_parameters;
 	float min_atten;
 	float modulated[NUM_GENERATORS];
 	bool percussion;
@@ -2177,6 +2716,60 @@ private:
 	float amp, delta_amp;
 	Envelope vol_env, mod_env;
 	LFO vib_lfo, mod_lfo;
+	ListLink links[(size_t)List::LAST];
+	Queue *queues, *queue;
+	Voice *queue_prev, *queue_next;
+
+	inline void unpin_samples() {
+		if (sample_pins) {
+			--*sample_pins;
+			sample_pins = nullptr;
+		}
+	}
+
+	StealClass get_steal_class() const {
+		switch (status) {
+			case State::PLAYING:
+				return StealClass::PLAYING;
+			case State::SUSTAINED:
+				return StealClass::SUSTAINED;
+			case State::RELEASED:
+				return channel == PERCUSSION_CHANNEL ? StealClass::RELEASED_PERCUSSION : StealClass::RELEASED;
+			default:
+				return StealClass::FREE;
+		}
+	}
+
+	void requeue(bool p_to_tail) {
+		if (!queues) {
+			return;
+		}
+		Queue *target = &queues[(size_t)get_steal_class()];
+		if (target == queue && !p_to_tail) {
+			return;
+		}
+		if (queue) {
+			if (queue_prev) {
+				queue_prev->queue_next = queue_next;
+			} else {
+				queue->head = queue_next;
+			}
+			if (queue_next) {
+				queue_next->queue_prev = queue_prev;
+			} else {
+				queue->tail = queue_prev;
+			}
+		}
+		queue = target;
+		queue_prev = queue->tail;
+		queue_next = nullptr;
+		if (queue->tail) {
+			queue->tail->queue_next = this;
+		} else {
+			queue->head = this;
+		}
+		queue->tail = this;
+	}
 
 	inline float get_modulated_generator(SF2Generator p_type) const {
 		return modulated[(size_t)p_type];
@@ -2274,20 +2867,151 @@ private:
 		}
 	}
 };
+
+Synthesizer::Preset::~Preset() {
+	for (const std::vector<Voice *> &templates : voice_templates) {
+		for (Voice *voice_template : templates) {
+			delete voice_template;
+		}
+	}
+}
+
+void Synthesizer::SoundFont::build_voice_templates(float p_output_rate, unsigned int p_threads) {
+	parallel_for(presets.size(), p_threads, [&](size_t p_index) {
+		Preset *preset = presets[p_index];
+		preset->voice_templates.resize(preset->zones.size());
+		for (size_t i = 0; i < preset->zones.size(); ++i) {
+			const Zone &preset_zone = preset->zones[i];
+			const int16_t inst_id = preset_zone.generators.get_or_default(SF2Generator::INSTRUMENT);
+			if (inst_id < 0 || (size_t)inst_id >= instruments.size()) {
+				continue;
+			}
+			const Instrument &inst = instruments[inst_id];
+			std::vector<Voice *> &templates = preset->voice_templates[i];
+			templates.resize(inst.zones.size(), nullptr);
+			for (size_t j = 0; j < inst.zones.size(); ++j) {
+				const Zone &inst_zone = inst.zones[j];
+				const int16_t sample_id = inst_zone.generators.get_or_default(SF2Generator::SAMPLE_ID);
+				if (sample_id < 0 || (size_t)sample_id >= samples.size()) {
+					continue;
+				}
+
+				GeneratorSet generators = inst_zone.generators;
+				generators.add(preset_zone.generators);
+
+				ModulatorParameterSet modparams = inst_zone.modulator_parameters;
+				modparams.merge_and_add(preset_zone.modulator_parameters);
+				modparams.merge(ModulatorParameterSet::get_default_parameters());
+
+				templates[j] = new Voice();
+				templates[j]->init_template(p_output_rate, samples[sample_id], generators, modparams);
+			}
+		}
+	});
+}
+
+bool Synthesizer::SoundFont::attach_samples(Voice &p_voice) {
+	if (!sample_cache) {
+		return true;
+	}
+	Sample &sample = samples[p_voice.get_sample_id()];
+	uint32_t first, end;
+	p_voice.get_sample_span(first, end);
+	// the sample's own range is included so that its peak can be found
+	first = std::min(first, sample.start);
+	end = std::min(sample_buffer_size, std::max(end, sample.end));
+	uint32_t *pins;
+	const int16_t *buffer = sample_cache->get(first, end, &pins);
+	if (!buffer) {
+		return false;
+	}
+	if (!sample.has_peak) {
+		const int sample_max = find_sample_peak(buffer + (sample.start - first), sample.end - sample.start);
+		sample.min_atten = amplitude_to_attenuation((float)sample_max / INT16_MAX);
+		sample.has_peak = true;
+	}
+	p_voice.use_samples(buffer, first, pins, sample.min_atten);
+	return true;
+}
+
+class Synthesizer::VoicePool {
+public:
+	explicit VoicePool(const std::vector<Voice *> &p_voices) :
+			queues(), released_weight(300.0f), sustained_weight(200.0f), age_weight(100.0f) {
+		for (Voice *voice : p_voices) {
+			voice->attach(queues);
+		}
+	}
+
+	void set_weights(float p_released, float p_sustained, float p_age) {
+		released_weight = p_released;
+		sustained_weight = p_sustained;
+		age_weight = p_age;
+	}
+
+	Voice *get_voice() {
+		Voice *free_voice = queues[(size_t)Voice::StealClass::FREE].head;
+		if (free_voice) {
+			return free_voice;
+		}
+
+		// Each queue is in the order its voices entered that state, so only the oldest voice of
+		// each state is a candidate. This model is similar to Fluidsynth's:
+		// - A released non-drum voice can likely be killed easily
+		// - A sustained voice can likely be killed without sounding too abrupt
+		// - Barring the above situations, an older voice (higher "steps" value)
+		//   should be prioritized
+		// Loudness is not considered, as the queues cannot stay ordered by it while voices play
+		unsigned int max_steps = 1;
+		for (size_t i = (size_t)Voice::StealClass::RELEASED; i < (size_t)Voice::StealClass::LAST; ++i) {
+			if (queues[i].head) {
+				max_steps = std::max(max_steps, queues[i].head->get_steps());
+			}
+		}
+		Voice *to_kill = nullptr;
+		float highest_score = 0.0f;
+		for (size_t i = (size_t)Voice::StealClass::RELEASED; i < (size_t)Voice::StealClass::LAST; ++i) {
+			Voice *v = queues[i].head;
+			if (!v) {
+				continue;
+			}
+			float score = age_weight * v->get_steps() / max_steps;
+			if (i == (size_t)Voice::StealClass::RELEASED) {
+				score += released_weight;
+			} else if (i == (size_t)Voice::StealClass::SUSTAINED) {
+				score += sustained_weight;
+			}
+			if (!to_kill || score > highest_score) {
+				highest_score = score;
+				to_kill = v;
+			}
+		}
+		to_kill->release(false);
+		return to_kill;
+	}
+
+private:
+	Voice::Queue queues[(size_t)Voice::StealClass::LAST];
+	float released_weight, sustained_weight, age_weight;
+};
+
 class Synthesizer::Channel {
 public:
 	struct Bank {
 		uint8_t msb, lsb;
 	};
 
-	explicit Channel(size_t p_index, float p_output_rate, std::vector<Voice *> *p_voices) :
-			channel_index(p_index), output_rate(p_output_rate), controllers(), rpns(), key_pressures(), current_channel_pressure(0), current_pitch_bend(1 << 13), data_entry_mode(DataEntryMode::RPN), pitch_bend_sensitivity(2.0f), fine_tuning(0.0f), coarse_tuning(0.0f), current_note_id(0) {
-		controllers[(size_t)ControlChange::VOLUME] = 100;
-		controllers[(size_t)ControlChange::PAN] = 64;
-		controllers[(size_t)ControlChange::EXPRESSION] = 127;
-		controllers[(size_t)ControlChange::RPN_LSB] = 127;
-		controllers[(size_t)ControlChange::RPN_MSB] = 127;
-		voices = p_voices;
+	Channel(size_t p_index, VoicePool *p_voice_pool, const float *p_song_volume) :
+			channel_index(p_index), song_volume(p_song_volume), preset(nullptr), controllers(), rpns(), key_pressures(), current_channel_pressure(0), current_pitch_bend(1 << 13), data_entry_mode(DataEntryMode::RPN), pitch_bend_sensitivity(2.0f), fine_tuning(0.0f), coarse_tuning(0.0f), current_note_id(0), channel_voices(nullptr), key_voices() {
+		voice_pool = p_voice_pool;
+		reset();
+	}
+
+	// Voices still linked to the channel would point back into it once it is gone
+	~Channel() {
+		while (channel_voices) {
+			channel_voices->set_status(Voice::State::FINISHED);
+		}
 	}
 
 	inline Bank get_bank() const {
@@ -2301,9 +3025,8 @@ public:
 	void note_off(uint8_t p_key) {
 		const bool sustained = controllers[(size_t)ControlChange::SUSTAIN] >= 64;
 
-		for (Voice *voice : *voices) {
-			if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index &&
-					voice->get_actual_key() == p_key) {
+		for (Voice *voice = key_voices[p_key & MAX_KEY]; voice; voice = voice->get_next(Voice::List::KEY)) {
+			if (voice->get_actual_key() == p_key) {
 				voice->release(sustained);
 			}
 		}
@@ -2314,27 +3037,37 @@ public:
 			note_off(p_key);
 			return;
 		}
+		if (!preset) {
+			return; // no program change yet, or the soundfont lacks a fallback for it
+		}
 
-		for (const Zone &preset_zone : preset->zones) {
+		for (size_t i = 0; i < preset->zones.size(); ++i) {
+			const Zone &preset_zone = preset->zones[i];
 			if (preset_zone.is_in_range(p_key, p_velocity)) {
+				const std::vector<Voice *> &templates = preset->voice_templates[i];
+				if (templates.empty()) {
+					continue;
+				}
 				const int16_t inst_id = preset_zone.generators.get_or_default(SF2Generator::INSTRUMENT);
 				const Instrument &inst = preset->soundfont->get_instruments()[inst_id];
-				for (const Zone &inst_zone : inst.zones) {
-					if (inst_zone.is_in_range(p_key, p_velocity)) {
-						const int16_t sample_id = inst_zone.generators.get_or_default(SF2Generator::SAMPLE_ID);
-						const Sample &sample = preset->soundfont->get_samples()[sample_id];
-
-						GeneratorSet generators = inst_zone.generators;
-						generators.add(preset_zone.generators);
-
-						ModulatorParameterSet modparams = inst_zone.modulator_parameters;
-						modparams.merge_and_add(preset_zone.modulator_parameters);
-						modparams.merge(ModulatorParameterSet::get_default_parameters());
-
-						Voice *voice = get_voice(generators.get_or_default(SF2Generator::EXCLUSIVE_CLASS));
-
-						voice->init(channel_index, current_note_id, output_rate, sample, generators, modparams, p_key,
-								p_velocity, preset->bank == PERCUSSION_BANK);
+				for (size_t j = 0; j < templates.size(); ++j) {
+					const Zone &inst_zone = inst.zones[j];
+					if (templates[j] && inst_zone.is_in_range(p_key, p_velocity)) {
+						const int16_t exclusive_class = templates[j]->get_exclusive_class();
+						Voice *voice = get_voice(exclusive_class);
+
+						voice->unlink();
+						voice->init(*templates[j], channel_index, song_volume, current_note_id, p_key, p_velocity,
+								preset->bank == PERCUSSION_BANK);
+						if (!preset->soundfont->attach_samples(*voice)) {
+							voice->set_status(Voice::State::FINISHED);
+							continue;
+						}
+						voice->link(Voice::List::CHANNEL, &channel_voices);
+						voice->link(Voice::List::KEY, &key_voices[p_key & MAX_KEY]);
+						if (exclusive_class != 0) {
+							voice->link(Voice::List::EXCLUSIVE_CLASS, &exclusive_class_voices[exclusive_class]);
+						}
 						voice->update_sf2_controller(GeneralController::POLYPHONIC_PRESSURE,
 								key_pressures[voice->get_actual_key()]);
 						voice->update_sf2_controller(GeneralController::CHANNEL_PRESSURE, current_channel_pressure);
@@ -2342,8 +3075,8 @@ public:
 						voice->update_sf2_controller(GeneralController::PITCH_WHEEL_SENSITIVITY, pitch_bend_sensitivity);
 						voice->update_fine_tuning(fine_tuning);
 						voice->update_coarse_tuning(coarse_tuning);
-						for (uint8_t i = 0; i < NUM_CONTROLLERS; ++i) {
-							voice->update_midi_controller(i, controllers[i]);
+						for (uint8_t c = 0; c < NUM_CONTROLLERS; ++c) {
+							voice->update_midi_controller(c, controllers[c]);
 						}
 					}
 				}
@@ -2355,9 +3088,8 @@ public:
 	void key_pressure(uint8_t p_key, uint8_t p_value) {
 		key_pressures[p_key] = p_value;
 
-		for (Voice *voice : *voices) {
-			if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index &&
-					voice->get_actual_key() == p_key) {
+		for (Voice *voice = key_voices[p_key & MAX_KEY]; voice; voice = voice->get_next(Voice::List::KEY)) {
+			if (voice->get_actual_key() == p_key) {
 				voice->update_sf2_controller(GeneralController::POLYPHONIC_PRESSURE, p_value);
 			}
 		}
@@ -2381,9 +3113,8 @@ public:
 				break;
 			case ControlChange::SUSTAIN:
 				if (p_value < 64) {
-					for (Voice *voice : *voices) {
-						if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index &&
-								voice->get_status() == Voice::State::SUSTAINED) {
+					for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+						if (voice->get_status() == Voice::State::SUSTAINED) {
 							voice->release(false);
 						}
 					}
@@ -2416,10 +3147,9 @@ public:
 				data_entry_mode = DataEntryMode::RPN;
 				break;
 			case ControlChange::ALL_SOUND_OFF:
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->set_status(Voice::State::FINISHED);
-					}
+				// every voice leaves the list as it finishes
+				while (channel_voices) {
+					channel_voices->set_status(Voice::State::FINISHED);
 				}
 				break;
 			case ControlChange::RESET_ALL_CONTROLLERS:
@@ -2428,11 +3158,9 @@ public:
 				memset(key_pressures, 0, MAX_KEY + 1);
 				current_channel_pressure = 0;
 				current_pitch_bend = 1 << 13;
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->update_sf2_controller(GeneralController::CHANNEL_PRESSURE, current_channel_pressure);
-						voice->update_sf2_controller(GeneralController::PITCH_WHEEL, current_pitch_bend);
-					}
+				for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+					voice->update_sf2_controller(GeneralController::CHANNEL_PRESSURE, current_channel_pressure);
+					voice->update_sf2_controller(GeneralController::PITCH_WHEEL, current_pitch_bend);
 				}
 				for (uint8_t i = 1; i < 122; ++i) {
 					if ((91 <= i && i <= 95) || (70 <= i && i <= 79)) {
@@ -2448,18 +3176,14 @@ public:
 						case ControlChange::RPN_LSB:
 						case ControlChange::RPN_MSB:
 							controllers[i] = 127;
-							for (Voice *voice : *voices) {
-								if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-									voice->update_midi_controller(i, 127);
-								}
+							for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+								voice->update_midi_controller(i, 127);
 							}
 							break;
 						default:
 							controllers[i] = 0;
-							for (Voice *voice : *voices) {
-								if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-									voice->update_midi_controller(i, 0);
-								}
+							for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+								voice->update_midi_controller(i, 0);
 							}
 							break;
 					}
@@ -2471,18 +3195,14 @@ public:
 
 				// All Notes Off is affected by CC 64 (Sustain)
 				const bool sustained = controllers[(size_t)ControlChange::SUSTAIN] >= 64;
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->release(sustained);
-					}
+				for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+					voice->release(sustained);
 				}
 				break;
 			}
 			default:
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->update_midi_controller(p_controller, p_value);
-					}
+				for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+					voice->update_midi_controller(p_controller, p_value);
 				}
 				break;
 		}
@@ -2490,19 +3210,15 @@ public:
 
 	void channel_pressure(uint8_t p_value) {
 		current_channel_pressure = p_value;
-		for (Voice *voice : *voices) {
-			if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-				voice->update_sf2_controller(GeneralController::CHANNEL_PRESSURE, p_value);
-			}
+		for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+			voice->update_sf2_controller(GeneralController::CHANNEL_PRESSURE, p_value);
 		}
 	}
 
 	void pitch_bend(uint16_t p_value) {
 		current_pitch_bend = p_value;
-		for (Voice *voice : *voices) {
-			if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-				voice->update_sf2_controller(GeneralController::PITCH_WHEEL, p_value);
-			}
+		for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+			voice->update_sf2_controller(GeneralController::PITCH_WHEEL, p_value);
 		}
 	}
 
@@ -2510,6 +3226,26 @@ public:
 		preset = p_preset;
 	}
 
+	// Puts the channel back in its power-on state, with no preset and every voice ended
+	void reset() {
+		control_change((uint8_t)ControlChange::ALL_SOUND_OFF, 0);
+		preset = nullptr;
+		memset(controllers, 0, sizeof(controllers));
+		controllers[(size_t)ControlChange::VOLUME] = 100;
+		controllers[(size_t)ControlChange::PAN] = 64;
+		controllers[(size_t)ControlChange::EXPRESSION] = 127;
+		controllers[(size_t)ControlChange::RPN_LSB] = 127;
+		controllers[(size_t)ControlChange::RPN_MSB] = 127;
+		memset(rpns, 0, sizeof(rpns));
+		memset(key_pressures, 0, sizeof(key_pressures));
+		current_channel_pressure = 0;
+		current_pitch_bend = 1 << 13;
+		data_entry_mode = DataEntryMode::RPN;
+		pitch_bend_sensitivity = 2.0f;
+		fine_tuning = 0.0f;
+		coarse_tuning = 0.0f;
+	}
+
 private:
 	enum class ControlChange {
 		BANK_SELECT_MSB = 0,
@@ -2545,7 +3281,7 @@ private:
 	};
 
 	const size_t channel_index;
-	const float output_rate;
+	const float *song_volume;
 	const Preset *preset;
 	uint8_t controllers[NUM_CONTROLLERS];
 	uint16_t rpns[(size_t)RPN::LAST];
@@ -2555,8 +3291,11 @@ private:
 	DataEntryMode data_entry_mode;
 	float pitch_bend_sensitivity;
 	float fine_tuning, coarse_tuning;
-	std::vector<Voice *> *voices;
+	VoicePool *voice_pool;
 	size_t current_note_id;
+	Voice *channel_voices;
+	Voice *key_voices[MAX_KEY + 1];
+	std::map<int16_t, Voice *> exclusive_class_voices;
 
 	inline uint16_t get_selected_rpn() const {
 		return ((uint16_t)controllers[(size_t)ControlChange::RPN_MSB] << 7) +
@@ -2565,51 +3304,16 @@ private:
 
 	Voice *get_voice(int16_t p_exclusive_class) {
 		if (p_exclusive_class != 0) {
-			for (Voice *v : *voices) {
-				if (v->get_channel() == channel_index && v->get_note_id() != current_note_id &&
-						v->get_exclusive_class() == p_exclusive_class) {
-					v->release(false);
+			std::map<int16_t, Voice *>::iterator it = exclusive_class_voices.find(p_exclusive_class);
+			if (it != exclusive_class_voices.end()) {
+				for (Voice *v = it->second; v; v = v->get_next(Voice::List::EXCLUSIVE_CLASS)) {
+					if (v->get_note_id() != current_note_id) {
+						v->release(false);
+					}
 				}
 			}
 		}
-		// Track these in case all voices are in use
-		Voice *to_kill = nullptr;
-		int lowest_score = 0;
-		for (Voice *v : *voices) {
-			Voice::State status = v->get_status();
-			size_t chan = v->get_channel();
-			if (status == Voice::State::UNUSED || status == Voice::State::FINISHED) {
-				return v;
-			}
-			// This model for identifying a voice to kill is similar to Fluidsynth's:
-			// - A released non-drum voice can likely be killed easily
-			// - A sustained voice can likely be killed without sounding too abrupt
-			// - Barring the above situations, an older voice (higher "steps" value)
-			//   should be prioritized
-			// - Lastly, skew somewhat more towards quieter voices (lower "amp" value)
-			int score = 0;
-			if (chan != PERCUSSION_CHANNEL && status == Voice::State::RELEASED) {
-				score -= 300;
-			}
-			if (status == Voice::State::SUSTAINED) {
-				score -= 200;
-			}
-			if (to_kill && v->get_steps() > to_kill->get_steps()) {
-				score -= 100;
-			}
-			if (to_kill && v->get_amp() < to_kill->get_amp()) {
-				score -= 50;
-			}
-			if (!to_kill) {
-				lowest_score = score;
-				to_kill = v;
-			} else if (score < lowest_score) {
-				lowest_score = score;
-				to_kill = v;
-			}
-		}
-		to_kill->release(false);
-		return to_kill;
+		return voice_pool->get_voice();
 	}
 
 	void update_rpn() {
@@ -2618,27 +3322,21 @@ private:
 		switch ((RPN)rpn) {
 			case RPN::PITCH_BEND_SENSITIVITY:
 				pitch_bend_sensitivity = data / 128.0f;
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->update_sf2_controller(GeneralController::PITCH_WHEEL_SENSITIVITY, pitch_bend_sensitivity);
-					}
+				for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+					voice->update_sf2_controller(GeneralController::PITCH_WHEEL_SENSITIVITY, pitch_bend_sensitivity);
 				}
 				break;
 			case RPN::FINE_TUNING: {
 				fine_tuning = (data - 8192) / 81.92f;
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->update_fine_tuning(fine_tuning);
-					}
+				for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+					voice->update_fine_tuning(fine_tuning);
 				}
 				break;
 			}
 			case RPN::COARSE_TUNING: {
 				coarse_tuning = (data - 8192) / 128.0f;
-				for (Voice *voice : *voices) {
-					if (voice->get_status() != Voice::State::UNUSED && voice->get_channel() == channel_index) {
-						voice->update_coarse_tuning(coarse_tuning);
-					}
+				for (Voice *voice = channel_voices; voice; voice = voice->get_next(Voice::List::CHANNEL)) {
+					voice->update_coarse_tuning(coarse_tuning);
 				}
 				break;
 			}
@@ -2649,14 +3347,6 @@ private:
 };
 
 #ifdef TINYPRIMESYNTH_FLAC_SUPPORT
-static const std::vector<int32_t> FIXED_PREDICTION_COEFFICIENTS[5] = {
-	{},
-	{ 1 },
-	{ 2, -1 },
-	{ 3, -3, 1 },
-	{ 4, -6, 4, -1 },
-};
-
 #if defined(__GNUC__) || defined(__clang__)
 inline uint32_t count_leading_zeroes(uint32_t p_x) {
 	return __builtin_clz(p_x);
@@ -2723,62 +3413,81 @@ static inline uint32_t count_leading_zeroes(uint32_t x) {
 	return (uint32_t)clz_lkup[x >> n] - n;
 }
 #endif
+static inline uint32_t count_leading_zeroes_64(uint64_t p_x) {
+	const uint32_t high = (uint32_t)(p_x >> 32);
+	return high ? count_leading_zeroes(high) : 32 + count_leading_zeroes((uint32_t)p_x);
+}
+
+// Reads FLAC data from memory through a 64-bit cache that is refilled eight bytes at a time;
+// bits past the end of the data read as zero
 class FLACBitStream {
 public:
-	FLACBitStream(FileAndMemReader *p_in) :
-			raw_stream(p_in), bit_buffer(0), bit_buffer_length(0), stream_error(false) {}
+	FLACBitStream(const uint8_t *p_data, size_t p_size) :
+			data(p_data), size(p_size), position(0), cache(0), cache_bits(0), stream_error(false) {}
 
 	inline void align_to_byte() {
-		bit_buffer_length -= bit_buffer_length % 8;
-	}
-
-	int32_t read_one() {
-		if (staging_pos >= staging_fill) {
-			if (raw_stream->eof()) {
-				return -1;
-			}
-			staging_fill = raw_stream->read(staging_buffer, 1, 4096);
-			staging_pos = 0;
-			if (staging_fill == 0) {
-				return -1;
-			}
-		}
-		return staging_buffer[staging_pos++];
+		const int32_t extra = cache_bits % 8;
+		cache <<= extra;
+		cache_bits -= extra;
 	}
 
 	int32_t read_byte() {
-		if (bit_buffer_length >= 8) {
-			return read_unsigned_int(8);
-		} else {
-			return read_one();
+		refill();
+		if (cache_bits < 8) {
+			return -1;
 		}
+		return read_unsigned_int(8);
 	}
 
-	int32_t read_unsigned_int(int32_t p_n) {
-		while (bit_buffer_length < p_n) {
-			int32_t temp = read_one();
-			bit_buffer = (bit_buffer << 8) | temp;
-			bit_buffer_length += 8;
+	// p_n may be at most 32
+	inline int32_t read_unsigned_int(int32_t p_n) {
+		if (p_n == 0) {
+			return 0;
 		}
-		bit_buffer_length -= p_n;
-		int32_t result = (int32_t)(bit_buffer >> bit_buffer_length);
-		if (p_n < 32) {
-			result &= (1 << p_n) - 1;
+		if (cache_bits < p_n) {
+			refill();
+			if (cache_bits < p_n) {
+				cache_bits = p_n;
+			}
 		}
-		return result;
+		const uint32_t result = (uint32_t)(cache >> (64 - p_n));
+		cache <<= p_n;
+		cache_bits -= p_n;
+		return (int32_t)result;
 	}
 
-	int32_t read_signed_int(int32_t p_n) {
-		return (read_unsigned_int(p_n) << (32 - p_n)) >> (32 - p_n);
+	inline int32_t read_signed_int(int32_t p_n) {
+		if (p_n == 0) {
+			return 0;
+		}
+		return (int32_t)((uint32_t)read_unsigned_int(p_n) << (32 - p_n)) >> (32 - p_n);
 	}
 
-	int64_t read_rice_signed_int(int32_t p_param) {
-		int64_t val = 0;
-		while (read_unsigned_int(1) == 0) {
-			val++;
+	inline int32_t read_rice_signed_int(int32_t p_param) {
+		// the unary quotient is a run of zeroes ended by a one
+		uint32_t quotient = 0;
+		for (;;) {
+			if (cache_bits == 0) {
+				refill();
+				if (cache_bits == 0) {
+					stream_error = true;
+					return 0;
+				}
+			}
+			const int32_t zeroes = cache ? (int32_t)count_leading_zeroes_64(cache) : 64;
+			if (zeroes < cache_bits) {
+				quotient += zeroes;
+				cache <<= zeroes;
+				cache <<= 1;
+				cache_bits -= zeroes + 1;
+				break;
+			}
+			quotient += cache_bits;
+			cache = 0;
+			cache_bits = 0;
 		}
-		val = (val << p_param) | read_unsigned_int(p_param);
-		return (val >> 1) ^ -(val & 1);
+		const uint32_t value = quotient << p_param | (uint32_t)read_unsigned_int(p_param);
+		return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
 	}
 
 	inline bool get_stream_error() const {
@@ -2790,36 +3499,47 @@ public:
 	}
 
 	inline bool stream_at_end() const {
-		return raw_stream->eof();
+		return get_position() >= size;
+	}
+
+	// Offset of the next unread byte, when the stream is byte aligned
+	inline size_t get_position() const {
+		return position - cache_bits / 8;
 	}
 
 private:
-	FileAndMemReader *raw_stream;
-	int64_t bit_buffer;
-	int32_t bit_buffer_length;
+	const uint8_t *data;
+	size_t size;
+	size_t position;
+	// unread bits, most significant first; the bits below cache_bits are either zero or the
+	// stream bits that follow, so refilling can OR whole bytes over them
+	uint64_t cache;
+	int32_t cache_bits;
 	bool stream_error;
-	uint8_t staging_buffer[4096];
-	size_t staging_pos = 0;
-	size_t staging_fill = 0;
-};
 
-static void write_little_int(int32_t p_num_bytes, int32_t p_val, std::vector<uint8_t> &p_out) {
-	for (int32_t i = 0; i < p_num_bytes; i++) {
-		p_out.push_back((uint8_t)(p_val >> (i * 8)));
-	}
-}
-
-static void restore_flac_linear_prediction(std::vector<int64_t> &p_result, const std::vector<int32_t> &p_coefs, int32_t p_shift) {
-	for (int32_t i = p_coefs.size(); i < p_result.size(); i++) {
-		int64_t sum = 0;
-		for (int32_t j = 0; j < p_coefs.size(); j++) {
-			sum += p_result[i - 1 - j] * p_coefs[j];
+	inline void refill() {
+		if (cache_bits > 56) {
+			return;
+		}
+		if (position + 8 <= size) {
+			uint64_t next = 0;
+			for (int32_t i = 0; i < 8; i++) {
+				next = next << 8 | data[position + i];
+			}
+			cache |= next >> cache_bits;
+			const int32_t num_bytes = (63 - cache_bits) >> 3;
+			position += num_bytes;
+			cache_bits += num_bytes * 8;
+		} else {
+			while (cache_bits <= 56 && position < size) {
+				cache |= (uint64_t)data[position++] << (56 - cache_bits);
+				cache_bits += 8;
+			}
 		}
-		p_result[i] += sum >> p_shift;
 	}
-}
+};
 
-static void decode_flac_residuals(FLACBitStream &p_in, int32_t p_warmup, std::vector<int64_t> &p_result) {
+static void decode_flac_residuals(FLACBitStream &p_in, int32_t p_warmup, int32_t *p_result, int32_t p_block_size) {
 	int32_t method = p_in.read_unsigned_int(2);
 	if (method >= 2) {
 		// Reserved residual coding method
@@ -2831,12 +3551,12 @@ static void decode_flac_residuals(FLACBitStream &p_in, int32_t p_warmup, std::ve
 
 	int32_t partition_order = p_in.read_unsigned_int(4);
 	int32_t num_partitions = 1 << partition_order;
-	if (p_result.size() % num_partitions != 0) {
-		// Block size not divisible by number of Rice partitions
+	if (p_block_size % num_partitions != 0 || p_block_size / num_partitions < p_warmup) {
+		// Block size not divisible by number of Rice partitions, or first partition shorter than the warmup
 		p_in.set_stream_error(true);
 		return;
 	}
-	int32_t partition_size = p_result.size() / num_partitions;
+	int32_t partition_size = p_block_size / num_partitions;
 
 	for (int32_t i = 0; i < num_partitions; i++) {
 		int32_t start = i * partition_size + (i == 0 ? p_warmup : 0);
@@ -2856,35 +3576,94 @@ static void decode_flac_residuals(FLACBitStream &p_in, int32_t p_warmup, std::ve
 	}
 }
 
-static void decode_flac_lpc_subframe(FLACBitStream &p_in, int32_t p_lpc_order, int32_t p_sample_depth, std::vector<int32_t> &p_coefs, std::vector<int64_t> &p_result) {
+// 32-bit sums are used whenever they cannot overflow, which covers 16-bit streams from common encoders
+static void restore_flac_linear_prediction(int32_t *p_result, int32_t p_block_size, const int32_t *p_coefs, int32_t p_order,
+		int32_t p_shift, bool p_wide) {
+	if (p_wide) {
+		for (int32_t i = p_order; i < p_block_size; i++) {
+			int64_t sum = 0;
+			for (int32_t j = 0; j < p_order; j++) {
+				sum += (int64_t)p_result[i - 1 - j] * p_coefs[j];
+			}
+			p_result[i] += (int32_t)(sum >> p_shift);
+		}
+	} else {
+		for (int32_t i = p_order; i < p_block_size; i++) {
+			int32_t sum = 0;
+			for (int32_t j = 0; j < p_order; j++) {
+				sum += p_result[i - 1 - j] * p_coefs[j];
+			}
+			p_result[i] += sum >> p_shift;
+		}
+	}
+}
+
+static void decode_flac_lpc_subframe(FLACBitStream &p_in, int32_t p_lpc_order, int32_t p_sample_depth, int32_t *p_result, int32_t p_block_size) {
 	for (int32_t i = 0; i < p_lpc_order; i++) {
 		p_result[i] = p_in.read_signed_int(p_sample_depth);
 	}
 	int32_t precision = p_in.read_unsigned_int(4) + 1;
 	int32_t shift = p_in.read_signed_int(5);
-	p_coefs.resize(p_lpc_order);
-	for (int32_t i = 0; i < p_coefs.size(); i++) {
-		p_coefs[i] = p_in.read_signed_int(precision);
+	if (precision == 16 || shift < 0) {
+		// invalid precision or negative shift
+		p_in.set_stream_error(true);
+		return;
 	}
-	decode_flac_residuals(p_in, p_lpc_order, p_result);
-	restore_flac_linear_prediction(p_result, p_coefs, shift);
+	int32_t coefs[32];
+	for (int32_t i = 0; i < p_lpc_order; i++) {
+		coefs[i] = p_in.read_signed_int(precision);
+	}
+	decode_flac_residuals(p_in, p_lpc_order, p_result, p_block_size);
+	int32_t order_bits = 0;
+	while ((1 << order_bits) < p_lpc_order) {
+		order_bits++;
+	}
+	restore_flac_linear_prediction(p_result, p_block_size, coefs, p_lpc_order, shift,
+			p_sample_depth + precision + order_bits > 32);
 }
 
-static void decode_flac_fp_subframe(FLACBitStream &p_in, int32_t p_pred_order, int32_t p_sample_depth, std::vector<int64_t> &p_result) {
+static void decode_flac_fp_subframe(FLACBitStream &p_in, int32_t p_pred_order, int32_t p_sample_depth, int32_t *p_result, int32_t p_block_size) {
 	for (int32_t i = 0; i < p_pred_order; i++) {
 		p_result[i] = p_in.read_signed_int(p_sample_depth);
 	}
-	decode_flac_residuals(p_in, p_pred_order, p_result);
-	restore_flac_linear_prediction(p_result, FIXED_PREDICTION_COEFFICIENTS[p_pred_order], 0);
+	decode_flac_residuals(p_in, p_pred_order, p_result, p_block_size);
+	switch (p_pred_order) {
+		case 1:
+			for (int32_t i = 1; i < p_block_size; i++) {
+				p_result[i] += p_result[i - 1];
+			}
+			break;
+		case 2:
+			for (int32_t i = 2; i < p_block_size; i++) {
+				p_result[i] += 2 * p_result[i - 1] - p_result[i - 2];
+			}
+			break;
+		case 3:
+			for (int32_t i = 3; i < p_block_size; i++) {
+				p_result[i] += 3 * p_result[i - 1] - 3 * p_result[i - 2] + p_result[i - 3];
+			}
+			break;
+		case 4:
+			for (int32_t i = 4; i < p_block_size; i++) {
+				p_result[i] += 4 * p_result[i - 1] - 6 * p_result[i - 2] + 4 * p_result[i - 3] - p_result[i - 4];
+			}
+			break;
+		default:
+			break;
+	}
 }
 
-static void decode_flac_subframe(FLACBitStream &p_in, int32_t p_sample_depth, std::vector<int64_t> &p_result, std::vector<int32_t> &p_coefs) {
+static void decode_flac_subframe(FLACBitStream &p_in, int32_t p_sample_depth, int32_t *p_result, int32_t p_block_size) {
 	p_in.read_unsigned_int(1);
 	int32_t type = p_in.read_unsigned_int(6);
 	int32_t shift = p_in.read_unsigned_int(1);
 	if (shift == 1) {
 		while (p_in.read_unsigned_int(1) == 0) {
 			shift++;
+			if (shift >= p_sample_depth) {
+				p_in.set_stream_error(true);
+				return;
+			}
 		}
 	}
 	p_sample_depth -= shift;
@@ -2892,51 +3671,54 @@ static void decode_flac_subframe(FLACBitStream &p_in, int32_t p_sample_depth, st
 	if (type == 0) // Constant coding
 	{
 		int32_t filler = p_in.read_signed_int(p_sample_depth);
-		for (size_t i = 0; i < p_result.size(); i++) {
+		for (int32_t i = 0; i < p_block_size; i++) {
 			p_result[i] = filler;
 		}
 	} else if (type == 1) { // Verbatim coding
-		for (int32_t i = 0; i < p_result.size(); i++) {
+		for (int32_t i = 0; i < p_block_size; i++) {
 			p_result[i] = p_in.read_signed_int(p_sample_depth);
 		}
 	} else if (8 <= type && type <= 12) {
-		decode_flac_fp_subframe(p_in, type - 8, p_sample_depth, p_result);
+		decode_flac_fp_subframe(p_in, type - 8, p_sample_depth, p_result, p_block_size);
 	} else if (32 <= type && type <= 63) {
-		decode_flac_lpc_subframe(p_in, type - 31, p_sample_depth, p_coefs, p_result);
+		decode_flac_lpc_subframe(p_in, type - 31, p_sample_depth, p_result, p_block_size);
 	} else {
 		// Reserved subframe type
 		p_in.set_stream_error(true);
 		return;
 	}
 
-	for (int32_t i = 0; i < p_result.size(); i++) {
-		p_result[i] <<= shift;
+	if (shift) {
+		for (int32_t i = 0; i < p_block_size; i++) {
+			p_result[i] <<= shift;
+		}
 	}
 }
 
-static void decode_flac_subframes(FLACBitStream &p_in, int32_t p_sample_depth, int32_t p_chan_asgn, std::vector<std::vector<int32_t>> &p_samples, std::vector<std::vector<int64_t>> &p_subframes, std::vector<int32_t> &p_coefs) {
-	int32_t block_size = p_samples[0].size();
+static void decode_flac_subframes(FLACBitStream &p_in, int32_t p_sample_depth, int32_t p_chan_asgn, std::vector<std::vector<int32_t>> &p_subframes, int32_t p_block_size) {
 	if (0 <= p_chan_asgn && p_chan_asgn <= 7) {
-		for (int32_t ch = 0; ch < p_samples.size(); ch++) {
-			decode_flac_subframe(p_in, p_sample_depth, p_subframes[ch], p_coefs);
-		}
-	} else if (8 <= p_chan_asgn && p_chan_asgn <= 10) {
-		decode_flac_subframe(p_in, p_sample_depth + (p_chan_asgn == 9 ? 1 : 0), p_subframes[0], p_coefs);
-		decode_flac_subframe(p_in, p_sample_depth + (p_chan_asgn == 9 ? 0 : 1), p_subframes[1], p_coefs);
+		for (size_t ch = 0; ch < p_subframes.size(); ch++) {
+			decode_flac_subframe(p_in, p_sample_depth, p_subframes[ch].data(), p_block_size);
+		}
+	} else if (8 <= p_chan_asgn && p_chan_asgn <= 10 && p_subframes.size() == 2) {
+		int32_t *first = p_subframes[0].data();
+		int32_t *second = p_subframes[1].data();
+		decode_flac_subframe(p_in, p_sample_depth + (p_chan_asgn == 9 ? 1 : 0), first, p_block_size);
+		decode_flac_subframe(p_in, p_sample_depth + (p_chan_asgn == 9 ? 0 : 1), second, p_block_size);
 		if (p_chan_asgn == 8) {
-			for (int32_t i = 0; i < block_size; i++) {
-				p_subframes[1][i] = p_subframes[0][i] - p_subframes[1][i];
+			for (int32_t i = 0; i < p_block_size; i++) {
+				second[i] = first[i] - second[i];
 			}
 		} else if (p_chan_asgn == 9) {
-			for (int32_t i = 0; i < block_size; i++) {
-				p_subframes[0][i] += p_subframes[1][i];
+			for (int32_t i = 0; i < p_block_size; i++) {
+				first[i] += second[i];
 			}
 		} else if (p_chan_asgn == 10) {
-			for (int32_t i = 0; i < block_size; i++) {
-				int64_t side = p_subframes[1][i];
-				int64_t right = p_subframes[0][i] - (side >> 1);
-				p_subframes[1][i] = right;
-				p_subframes[0][i] = right + side;
+			for (int32_t i = 0; i < p_block_size; i++) {
+				int32_t side = second[i];
+				int32_t right = first[i] - (side >> 1);
+				second[i] = right;
+				first[i] = right + side;
 			}
 		}
 	} else {
@@ -2944,14 +3726,9 @@ static void decode_flac_subframes(FLACBitStream &p_in, int32_t p_sample_depth, i
 		p_in.set_stream_error(true);
 		return;
 	}
-	for (int32_t ch = 0; ch < p_samples.size(); ch++) {
-		for (int32_t i = 0; i < block_size; i++) {
-			p_samples[ch][i] = (int32_t)p_subframes[ch][i];
-		}
-	}
 }
 
-static bool decode_flac_frame(FLACBitStream &p_in, int32_t p_num_channels, int32_t p_sample_depth, std::vector<std::vector<int32_t>> &p_samples, std::vector<std::vector<int64_t>> &p_subframes, std::vector<int32_t> &p_coefs, std::vector<uint8_t> &p_out) {
+static bool decode_flac_frame(FLACBitStream &p_in, int32_t p_num_channels, int32_t p_sample_depth, std::vector<std::vector<int32_t>> &p_subframes, int16_t *&p_out, const int16_t *p_out_end) {
 	// Read a ton of header fields, and ignore most of them
 	int32_t temp = p_in.read_byte();
 	if (temp == -1) {
@@ -3002,81 +3779,684 @@ static bool decode_flac_frame(FLACBitStream &p_in, int32_t p_num_channels, int32
 
 	p_in.read_unsigned_int(8);
 
+	if ((size_t)(p_out_end - p_out) < (size_t)block_size * p_num_channels) {
+		// more samples than the stream info announced
+		p_in.set_stream_error(true);
+		return false;
+	}
+
 	// Decode each channel's subframe, then skip footer
 	for (int32_t ch = 0; ch < p_num_channels; ++ch) {
-		p_samples[ch].resize(block_size);
-		p_subframes[ch].resize(block_size);
+		if (p_subframes[ch].size() < (size_t)block_size) {
+			p_subframes[ch].resize(block_size);
+		}
 	}
-	decode_flac_subframes(p_in, p_sample_depth, chan_asgn, p_samples, p_subframes, p_coefs);
+	decode_flac_subframes(p_in, p_sample_depth, chan_asgn, p_subframes, block_size);
 	p_in.align_to_byte();
 	p_in.read_unsigned_int(16);
 
 	// Write the decoded samples
-	for (int32_t i = 0; i < block_size; i++) {
-		for (int32_t j = 0; j < p_num_channels; j++) {
-			int32_t val = p_samples[j][i];
-			if (p_sample_depth == 8) {
-				val += 128;
+	if (p_num_channels == 1) {
+		const int32_t *samples = p_subframes[0].data();
+		for (int32_t i = 0; i < block_size; i++) {
+			p_out[i] = (int16_t)samples[i];
+		}
+		p_out += block_size;
+	} else {
+		for (int32_t i = 0; i < block_size; i++) {
+			for (int32_t j = 0; j < p_num_channels; j++) {
+				*p_out++ = (int16_t)p_subframes[j][i];
 			}
-			write_little_int(p_sample_depth / 8, val, p_out);
 		}
 	}
 	return true;
 }
 
-static std::vector<uint8_t> decode_sf2_flac(FLACBitStream &p_in) {
+struct FLACFrame {
+	size_t offset;
+	uint64_t first_sample;
+};
+
+struct FLACStreamInfo {
+	int32_t sample_rate;
+	int32_t num_channels;
+	int32_t sample_depth;
+	int32_t max_block_size;
+	int64_t num_samples;
+	// from the SEEKTABLE, with offsets relative to the first frame
+	std::vector<FLACFrame> seek_points;
+};
+
+static bool read_flac_metadata(FLACBitStream &p_in, FLACStreamInfo &p_info) {
 	// Handle FLAC header and metadata blocks
-	std::vector<uint8_t> out;
 	if (p_in.read_unsigned_int(32) != 0x664C6143) {
-		return out; // Not a FLAC
-	}
-	int32_t sample_rate = -1;
-	int32_t num_channels = -1;
-	int32_t sample_depth = -1;
-	int64_t num_samples = -1;
+		return false; // Not a FLAC
+	}
+	p_info.sample_rate = -1;
+	p_info.num_channels = -1;
+	p_info.sample_depth = -1;
+	p_info.max_block_size = 0;
+	p_info.num_samples = -1;
+	p_info.seek_points.clear();
 	for (bool last = false; !last;) {
 		last = p_in.read_unsigned_int(1) != 0;
 		int32_t type = p_in.read_unsigned_int(7);
 		int32_t length = p_in.read_unsigned_int(24);
 		if (type == 0) { // Stream info block
-			p_in.read_unsigned_int(80);
-			sample_rate = p_in.read_unsigned_int(20);
-			num_channels = p_in.read_unsigned_int(3) + 1;
-			sample_depth = p_in.read_unsigned_int(5) + 1;
-			num_samples = (int64_t)p_in.read_unsigned_int(18) << 18 | p_in.read_unsigned_int(18);
+			p_in.read_unsigned_int(16);
+			p_info.max_block_size = p_in.read_unsigned_int(16);
+			p_in.read_unsigned_int(24);
+			p_in.read_unsigned_int(24);
+			p_info.sample_rate = p_in.read_unsigned_int(20);
+			p_info.num_channels = p_in.read_unsigned_int(3) + 1;
+			p_info.sample_depth = p_in.read_unsigned_int(5) + 1;
+			p_info.num_samples = (int64_t)p_in.read_unsigned_int(18) << 18 | p_in.read_unsigned_int(18);
 			for (int32_t i = 0; i < 16; i++) {
 				p_in.read_unsigned_int(8);
 			}
+		} else if (type == 3) { // Seek table
+			for (int32_t i = 0; i + 18 <= length; i += 18) {
+				const uint64_t sample = (uint64_t)(uint32_t)p_in.read_unsigned_int(32) << 32 | (uint32_t)p_in.read_unsigned_int(32);
+				const uint64_t offset = (uint64_t)(uint32_t)p_in.read_unsigned_int(32) << 32 | (uint32_t)p_in.read_unsigned_int(32);
+				p_in.read_unsigned_int(16);
+				if (sample != UINT64_MAX) { // placeholder points are skipped
+					p_info.seek_points.push_back({ (size_t)offset, sample });
+				}
+			}
+			for (int32_t i = length - length % 18; i < length; i++) {
+				p_in.read_unsigned_int(8);
+			}
 		} else {
 			for (int32_t i = 0; i < length; i++) {
 				p_in.read_unsigned_int(8);
 			}
 		}
 	}
-	if (sample_rate == -1) {
-		return out;
+	// the stream is the SF2 file itself stored as 16-bit samples
+	return p_info.sample_rate != -1 && p_info.sample_depth == 16;
+}
+
+static uint8_t flac_crc8(const uint8_t *p_data, size_t p_length) {
+	uint8_t crc = 0;
+	for (size_t i = 0; i < p_length; ++i) {
+		crc ^= p_data[i];
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+// Parses the frame header at p_data, returning false unless it is well formed and its CRC-8
+// matches; fills in the first sample of the frame and its block size
+static bool parse_flac_frame_header(const uint8_t *p_data, size_t p_length, int32_t p_fixed_block_size,
+		uint64_t &p_first_sample, int32_t &p_block_size) {
+	if (p_length < 6 || p_data[0] != 0xFF || (p_data[1] & 0xFE) != 0xF8) {
+		return false;
+	}
+	const bool variable_block_size = p_data[1] & 1;
+	const int32_t block_size_code = p_data[2] >> 4;
+	const int32_t sample_rate_code = p_data[2] & 0xF;
+	if (block_size_code == 0 || sample_rate_code == 15 || (p_data[3] >> 4) > 10 || (p_data[3] & 1) ||
+			((p_data[3] >> 1) & 7) == 3) {
+		return false;
+	}
+
+	// UTF-8 style coded frame or sample number
+	size_t pos = 4;
+	uint64_t number = p_data[pos++];
+	int32_t extra_bytes = 0;
+	if (number >= 0x80) {
+		if (number == 0xFF || (number & 0xC0) == 0x80) {
+			return false;
+		}
+		while (number & (0x40 >> extra_bytes)) {
+			++extra_bytes;
+		}
+		number &= 0x3F >> extra_bytes;
+		if (pos + extra_bytes > p_length) {
+			return false;
+		}
+		for (int32_t i = 0; i < extra_bytes; ++i) {
+			if ((p_data[pos] & 0xC0) != 0x80) {
+				return false;
+			}
+			number = (number << 6) | (p_data[pos++] & 0x3F);
+		}
+	}
+
+	if (block_size_code == 1) {
+		p_block_size = 192;
+	} else if (block_size_code <= 5) {
+		p_block_size = 576 << (block_size_code - 2);
+	} else if (block_size_code == 6) {
+		if (pos + 1 > p_length) {
+			return false;
+		}
+		p_block_size = p_data[pos++] + 1;
+	} else if (block_size_code == 7) {
+		if (pos + 2 > p_length) {
+			return false;
+		}
+		p_block_size = (p_data[pos] << 8 | p_data[pos + 1]) + 1;
+		pos += 2;
+	} else {
+		p_block_size = 256 << (block_size_code - 8);
+	}
+
+	if (sample_rate_code == 12) {
+		pos += 1;
+	} else if (sample_rate_code == 13 || sample_rate_code == 14) {
+		pos += 2;
+	}
+	if (pos + 1 > p_length || flac_crc8(p_data, pos) != p_data[pos]) {
+		return false;
+	}
+
+	p_first_sample = variable_block_size ? number : number * p_fixed_block_size;
+	return true;
+}
+
+// Takes the frame positions from the seek table when it has a point for every frame, as sf2flac
+// writes it
+static bool index_flac_seek_points(const uint8_t *p_data, size_t p_size, size_t p_first_frame,
+		const FLACStreamInfo &p_info, std::vector<FLACFrame> &p_frames) {
+	uint64_t next_sample = 0;
+	for (const FLACFrame &point : p_info.seek_points) {
+		const size_t pos = p_first_frame + point.offset;
+		uint64_t first_sample;
+		int32_t block_size;
+		if (point.offset >= p_size - p_first_frame ||
+				!parse_flac_frame_header(p_data + pos, p_size - pos, p_info.max_block_size, first_sample, block_size) ||
+				first_sample != next_sample || point.first_sample != first_sample) {
+			return false;
+		}
+		p_frames.push_back({ pos, first_sample });
+		next_sample += block_size;
+	}
+	return !p_frames.empty() && p_frames[0].offset == p_first_frame &&
+			(p_info.num_samples <= 0 || next_sample == (uint64_t)p_info.num_samples);
+}
+
+// Finds where each frame starts by looking for headers that are valid and continue exactly
+// where the previous frame ended, so sync codes inside compressed data are not mistaken for frames
+static bool index_flac_frames(const uint8_t *p_data, size_t p_size, size_t p_first_frame,
+		const FLACStreamInfo &p_info, std::vector<FLACFrame> &p_frames) {
+	if (index_flac_seek_points(p_data, p_size, p_first_frame, p_info, p_frames)) {
+		return true;
+	}
+	p_frames.clear();
+	uint64_t next_sample = 0;
+	for (size_t pos = p_first_frame; pos + 1 < p_size; ++pos) {
+		if (p_data[pos] != 0xFF) {
+			continue;
+		}
+		uint64_t first_sample;
+		int32_t block_size;
+		if (parse_flac_frame_header(p_data + pos, p_size - pos, p_info.max_block_size, first_sample, block_size) &&
+				first_sample == next_sample) {
+			p_frames.push_back({ pos, first_sample });
+			next_sample += block_size;
+		}
+	}
+	return !p_frames.empty() && p_frames[0].offset == p_first_frame &&
+			(p_info.num_samples <= 0 || next_sample == (uint64_t)p_info.num_samples);
+}
+
+// Decodes every frame in p_data into p_out, which must be filled exactly
+static bool decode_flac_frames(const uint8_t *p_data, size_t p_size, const FLACStreamInfo &p_info, int16_t *p_out,
+		const int16_t *p_out_end) {
+	FLACBitStream stream(p_data, p_size);
+	std::vector<std::vector<int32_t>> subframes(p_info.num_channels);
+
+	while (stream.get_position() < p_size) {
+		if (!decode_flac_frame(stream, p_info.num_channels, p_info.sample_depth, subframes, p_out, p_out_end) ||
+				stream.get_stream_error()) {
+			return false;
+		}
+	}
+	return stream.get_position() == p_size && p_out == p_out_end;
+}
+
+// Decodes an SF2FLAC stream back into the SF2 file it was made from, as 16-bit words
+static std::vector<int16_t> decode_sf2_flac(FileAndMemReader *p_in, unsigned int p_threads) {
+	std::vector<int16_t> out;
+
+	// frames are decoded straight from memory, so files are read in first
+	std::vector<uint8_t> file_data;
+	const uint8_t *data = (const uint8_t *)p_in->get_data();
+	const size_t size = p_in->file_size();
+	if (!data) {
+		file_data.resize(size);
+		if (p_in->read(file_data.data(), 1, size) != size) {
+			return out;
+		}
+		data = file_data.data();
 	}
-	if (sample_depth % 8 != 0) {
+
+	FLACBitStream stream(data, size);
+	FLACStreamInfo info;
+	if (!read_flac_metadata(stream, info)) {
 		return out;
 	}
+	const size_t first_frame = stream.get_position();
+	const size_t values_per_sample = (size_t)info.num_channels;
 
-	std::vector<std::vector<int32_t>> samples(num_channels);
-	std::vector<std::vector<int64_t>> subframes(num_channels);
-	std::vector<int32_t> coefs;
+	// Several threads each take a run of frames, writing to where that run's first sample goes;
+	// the frame index also provides the length when the stream info leaves it out
+	std::vector<FLACFrame> frames;
+	if ((p_threads > 1 || info.num_samples <= 0) && info.max_block_size > 0) {
+		if (!index_flac_frames(data, size, first_frame, info, frames)) {
+			frames.clear();
+		} else if (info.num_samples <= 0) {
+			int32_t block_size = 0;
+			uint64_t first_sample = 0;
+			parse_flac_frame_header(data + frames.back().offset, size - frames.back().offset, info.max_block_size,
+					first_sample, block_size);
+			info.num_samples = first_sample + block_size;
+		}
+	}
+	if (info.num_samples <= 0) {
+		return out;
+	}
+	out.resize(info.num_samples * values_per_sample);
 
-	// Decode FLAC audio frames and write raw samples
-	while (decode_flac_frame(p_in, num_channels, sample_depth, samples, subframes, coefs, out)) {
-		if (p_in.get_stream_error()) {
-			break;
+	if (frames.size() < 2 || p_threads <= 1) {
+		if (!decode_flac_frames(data + first_frame, size - first_frame, info, out.data(), out.data() + out.size())) {
+			out.clear();
 		}
+		return out;
 	}
 
-	if (p_in.get_stream_error()) {
+	const size_t num_runs = std::min(frames.size(), (size_t)p_threads * 4);
+	std::atomic<bool> failed(false);
+	parallel_for(num_runs, p_threads, [&](size_t p_run) {
+		const size_t begin = frames.size() * p_run / num_runs;
+		const size_t end = frames.size() * (p_run + 1) / num_runs;
+		const size_t byte_end = end < frames.size() ? frames[end].offset : size;
+		const size_t sample_end = end < frames.size() ? frames[end].first_sample : info.num_samples;
+		if (!decode_flac_frames(data + frames[begin].offset, byte_end - frames[begin].offset, info,
+					out.data() + frames[begin].first_sample * values_per_sample, out.data() + sample_end * values_per_sample)) {
+			failed = true;
+		}
+	});
+	if (failed) {
 		out.clear();
 	}
-
 	return out;
 }
+
+// An SF2FLAC stream kept compressed in memory, with the position of every frame so that any part
+// of the SF2 file can be decoded on its own
+struct FLACImage {
+	std::vector<uint8_t> data;
+	FLACStreamInfo info;
+	std::vector<FLACFrame> frames;
+	uint64_t num_words;
+};
+
+static bool open_flac_image(FileAndMemReader *p_in, FLACImage &p_image) {
+	// the caller's memory may not outlive the soundfont, so it is always copied
+	p_image.data.resize(p_in->file_size());
+	if (p_in->read(p_image.data.data(), 1, p_image.data.size()) != p_image.data.size()) {
+		return false;
+	}
+	FLACBitStream stream(p_image.data.data(), p_image.data.size());
+	if (!read_flac_metadata(stream, p_image.info) || p_image.info.max_block_size <= 0 ||
+			!index_flac_frames(p_image.data.data(), p_image.data.size(), stream.get_position(), p_image.info, p_image.frames)) {
+		return false;
+	}
+	const FLACFrame &last = p_image.frames.back();
+	int32_t block_size = 0;
+	uint64_t first_sample = 0;
+	parse_flac_frame_header(p_image.data.data() + last.offset, p_image.data.size() - last.offset, p_image.info.max_block_size,
+			first_sample, block_size);
+	p_image.num_words = (last.first_sample + block_size) * p_image.info.num_channels;
+	return true;
+}
+
+// Decodes p_count 16-bit words of the image starting at word p_first
+static bool read_flac_image(const FLACImage &p_image, uint64_t p_first, size_t p_count, int16_t *p_out) {
+	const uint64_t channels = p_image.info.num_channels;
+	if (p_first + p_count > p_image.num_words) {
+		return false;
+	}
+	const uint64_t first_sample = p_first / channels;
+	size_t frame = std::upper_bound(p_image.frames.begin(), p_image.frames.end(), first_sample,
+						   [](uint64_t p_sample, const FLACFrame &p_frame) { return p_sample < p_frame.first_sample; }) -
+			p_image.frames.begin() - 1;
+	std::vector<std::vector<int32_t>> subframes(channels);
+	std::vector<int16_t> partial;
+	uint64_t word = p_first;
+	const uint64_t end_word = p_first + p_count;
+	for (; word < end_word; ++frame) {
+		const uint64_t frame_word = p_image.frames[frame].first_sample * channels;
+		const size_t byte_end = frame + 1 < p_image.frames.size() ? p_image.frames[frame + 1].offset : p_image.data.size();
+		const uint64_t frame_end_word = frame + 1 < p_image.frames.size() ? p_image.frames[frame + 1].first_sample * channels : p_image.num_words;
+		FLACBitStream stream(p_image.data.data() + p_image.frames[frame].offset, byte_end - p_image.frames[frame].offset);
+		// frames wholly inside the range are decoded in place
+		const bool whole = frame_word >= p_first && frame_end_word <= end_word;
+		if (!whole) {
+			partial.resize(frame_end_word - frame_word);
+		}
+		int16_t *out = whole ? p_out + (frame_word - p_first) : partial.data();
+		if (!decode_flac_frame(stream, channels, p_image.info.sample_depth, subframes, out, out + (frame_end_word - frame_word)) ||
+				stream.get_stream_error()) {
+			return false;
+		}
+		const uint64_t copy_end = std::min(frame_end_word, end_word);
+		if (!whole) {
+			memcpy(p_out + (word - p_first), partial.data() + (word - frame_word), (copy_end - word) * sizeof(int16_t));
+		}
+		word = copy_end;
+	}
+	return true;
+}
+
+static bool read_flac_image_bytes(const FLACImage &p_image, uint64_t p_offset, size_t p_length, std::vector<uint8_t> &p_out) {
+	if (p_offset + p_length > p_image.num_words * sizeof(int16_t)) {
+		return false;
+	}
+	const uint64_t first = p_offset / sizeof(int16_t);
+	std::vector<int16_t> words((p_offset + p_length + 1) / sizeof(int16_t) - first);
+	if (!read_flac_image(p_image, first, words.size(), words.data())) {
+		return false;
+	}
+	const uint8_t *bytes = (const uint8_t *)words.data() + (p_offset - first * sizeof(int16_t));
+	p_out.insert(p_out.end(), bytes, bytes + p_length);
+	return true;
+}
+
+typedef std::function<bool(uint64_t p_offset, size_t p_length, std::vector<uint8_t> &p_out)> SF2ByteReader;
+
+// Walks the RIFF structure of an SF2 file of p_file_size bytes, appending every chunk but the
+// contents of smpl to p_header and finding where those contents are
+static bool split_sf2_samples(const SF2ByteReader &p_read, uint64_t p_file_size, std::vector<uint8_t> &p_header,
+		uint64_t &p_samples_offset, uint32_t &p_samples_size) {
+	p_samples_offset = 0;
+	p_samples_size = 0;
+	if (!p_read(0, 12, p_header)) {
+		return false;
+	}
+	uint32_t riff_size;
+	memcpy(&riff_size, p_header.data() + 4, sizeof(riff_size));
+	const uint64_t riff_end = std::min(p_file_size, (uint64_t)riff_size + 8);
+	for (uint64_t pos = 12; pos + 8 <= riff_end;) {
+		const size_t chunk_start = p_header.size();
+		if (!p_read(pos, 8, p_header)) {
+			return false;
+		}
+		uint32_t chunk_id, chunk_size;
+		memcpy(&chunk_id, p_header.data() + chunk_start, sizeof(chunk_id));
+		memcpy(&chunk_size, p_header.data() + chunk_start + 4, sizeof(chunk_size));
+		const uint64_t chunk_end = pos + 8 + chunk_size;
+		if (chunk_end > p_file_size) {
+			return false;
+		}
+		if (chunk_id == FOUR_CC_LIST && chunk_size >= 4) {
+			if (!p_read(pos + 8, 4, p_header)) {
+				return false;
+			}
+			uint32_t list_type;
+			memcpy(&list_type, p_header.data() + chunk_start + 8, sizeof(list_type));
+			if (list_type == FOUR_CC_SDTA) {
+				for (uint64_t sub = pos + 12; sub + 8 <= chunk_end;) {
+					const size_t sub_start = p_header.size();
+					if (!p_read(sub, 8, p_header)) {
+						return false;
+					}
+					uint32_t sub_id, sub_size;
+					memcpy(&sub_id, p_header.data() + sub_start, sizeof(sub_id));
+					memcpy(&sub_size, p_header.data() + sub_start + 4, sizeof(sub_size));
+					if (sub + 8 + sub_size > chunk_end) {
+						return false;
+					}
+					if (sub_id == FOUR_CC_SMPL) {
+						p_samples_offset = sub + 8;
+						p_samples_size = sub_size;
+					} else if (!p_read(sub + 8, sub_size, p_header)) {
+						return false;
+					}
+					sub += 8 + sub_size;
+				}
+			} else if (!p_read(pos + 12, chunk_size - 4, p_header)) {
+				return false;
+			}
+		} else if (!p_read(pos + 8, chunk_size, p_header)) {
+			return false;
+		}
+		pos = chunk_end;
+	}
+	if (p_samples_offset == 0 || p_samples_offset % sizeof(int16_t) != 0) {
+		printf("sample data cannot be decoded on demand");
+		return false;
+	}
+	return true;
+}
+
+// Sets up on-demand decoding of an SF2FLAC stream. p_header receives the SF2 file without the
+// contents of its smpl chunk, and the returned cache decodes those as voices need them
+static SampleCache *open_sf2_flac_samples(FileAndMemReader *p_in, size_t p_cache_size, std::vector<uint8_t> &p_header) {
+	std::shared_ptr<FLACImage> image(new FLACImage);
+	if (!open_flac_image(p_in, *image)) {
+		return nullptr;
+	}
+
+	uint64_t samples_offset;
+	uint32_t samples_size;
+	const SF2ByteReader read = [&image](uint64_t p_offset, size_t p_length, std::vector<uint8_t> &p_out) {
+		return read_flac_image_bytes(*image, p_offset, p_length, p_out);
+	};
+	if (!split_sf2_samples(read, image->num_words * sizeof(int16_t), p_header, samples_offset, samples_size)) {
+		return nullptr;
+	}
+
+	const uint64_t first_word = samples_offset / sizeof(int16_t);
+	return new SampleCache(p_cache_size, image->data.size(), [image, first_word](uint32_t p_first, uint32_t p_count, int16_t *p_out) {
+		return read_flac_image(*image, first_word + p_first, p_count, p_out);
+	});
+}
+
+// Writes FLAC bitstreams, most significant bit first
+class FLACBitWriter {
+public:
+	explicit FLACBitWriter(std::vector<uint8_t> &p_out) :
+			out(p_out), cache(0), cache_bits(0) {}
+
+	// p_n may be at most 32
+	inline void write(uint32_t p_value, int32_t p_n) {
+		if (p_n == 0) {
+			return;
+		}
+		cache = cache << p_n | (p_value & (uint32_t)(UINT64_MAX >> (64 - p_n)));
+		cache_bits += p_n;
+		while (cache_bits >= 8) {
+			cache_bits -= 8;
+			out.push_back((uint8_t)(cache >> cache_bits));
+		}
+	}
+
+	inline void write_rice_signed_int(int32_t p_value, int32_t p_param) {
+		const uint32_t folded = (uint32_t)p_value << 1 ^ (uint32_t)(p_value >> 31);
+		for (uint32_t quotient = folded >> p_param; quotient > 0;) {
+			const uint32_t zeroes = std::min(quotient, 32u);
+			write(0, zeroes);
+			quotient -= zeroes;
+		}
+		write(1, 1);
+		write(folded, p_param);
+	}
+
+	void align_to_byte() {
+		if (cache_bits) {
+			write(0, 8 - cache_bits);
+		}
+	}
+
+private:
+	std::vector<uint8_t> &out;
+	uint64_t cache;
+	int32_t cache_bits;
+};
+
+static constexpr uint32_t COMPRESSED_BLOCK_SIZE = 4096;
+
+// Sample data compressed in memory: every block of COMPRESSED_BLOCK_SIZE samples is stored as a
+// 16-bit FLAC subframe, so decode_flac_subframe restores it
+struct CompressedSamples {
+	std::vector<uint8_t> data;
+	// where each block starts in data, followed by the size of data
+	std::vector<size_t> block_offsets;
+	uint32_t num_samples;
+};
+
+// Codes one block with whichever fixed predictor and Rice parameter give the fewest bits, or
+// verbatim if nothing compresses it
+static void compress_sample_block(const int16_t *p_samples, int32_t p_count, std::vector<uint8_t> &p_out) {
+	std::vector<int32_t> residuals[5];
+	int32_t best_order = -1, best_param = 0;
+	uint64_t best_bits = (uint64_t)p_count * 16;
+	for (int32_t order = 0; order <= 4 && order < p_count; ++order) {
+		std::vector<int32_t> &r = residuals[order];
+		r.resize(p_count);
+		for (int32_t i = order; i < p_count; ++i) {
+			switch (order) {
+				case 0:
+					r[i] = p_samples[i];
+					break;
+				case 1:
+					r[i] = p_samples[i] - p_samples[i - 1];
+					break;
+				case 2:
+					r[i] = p_samples[i] - 2 * p_samples[i - 1] + p_samples[i - 2];
+					break;
+				case 3:
+					r[i] = p_samples[i] - 3 * p_samples[i - 1] + 3 * p_samples[i - 2] - p_samples[i - 3];
+					break;
+				default:
+					r[i] = p_samples[i] - 4 * p_samples[i - 1] + 6 * p_samples[i - 2] - 4 * p_samples[i - 3] + p_samples[i - 4];
+					break;
+			}
+		}
+		uint64_t sum = 0;
+		for (int32_t i = order; i < p_count; ++i) {
+			sum += (uint32_t)r[i] << 1 ^ (uint32_t)(r[i] >> 31);
+		}
+		// the best parameter is close to log2 of the mean folded residual; try around it
+		const uint64_t mean = sum / std::max(1, p_count - order);
+		int32_t guess = 0;
+		while (guess < 14 && ((uint64_t)1 << (guess + 1)) <= mean) {
+			++guess;
+		}
+		for (int32_t param = std::max(0, guess - 1); param <= std::min(14, guess + 1); ++param) {
+			uint64_t bits = (uint64_t)order * 16 + 6 + (uint64_t)(p_count - order) * (param + 1);
+			for (int32_t i = order; i < p_count; ++i) {
+				bits += ((uint32_t)r[i] << 1 ^ (uint32_t)(r[i] >> 31)) >> param;
+			}
+			if (bits < best_bits) {
+				best_bits = bits;
+				best_order = order;
+				best_param = param;
+			}
+		}
+	}
+
+	FLACBitWriter writer(p_out);
+	writer.write(0, 1);
+	if (best_order < 0) {
+		writer.write(1, 6); // verbatim
+		writer.write(0, 1);
+		for (int32_t i = 0; i < p_count; ++i) {
+			writer.write((uint16_t)p_samples[i], 16);
+		}
+	} else {
+		writer.write(8 + best_order, 6); // fixed prediction
+		writer.write(0, 1);
+		for (int32_t i = 0; i < best_order; ++i) {
+			writer.write((uint16_t)p_samples[i], 16);
+		}
+		writer.write(0, 2); // Rice coding with 4-bit parameters
+		writer.write(0, 4); // a single partition
+		writer.write(best_param, 4);
+		for (int32_t i = best_order; i < p_count; ++i) {
+			writer.write_rice_signed_int(residuals[best_order][i], best_param);
+		}
+	}
+	writer.align_to_byte();
+}
+
+static bool read_compressed_samples(const CompressedSamples &p_samples, uint32_t p_first, uint32_t p_count, int16_t *p_out) {
+	if ((uint64_t)p_first + p_count > p_samples.num_samples) {
+		return false;
+	}
+	std::vector<int32_t> block(COMPRESSED_BLOCK_SIZE);
+	const uint32_t end = p_first + p_count;
+	for (uint32_t index = p_first / COMPRESSED_BLOCK_SIZE; index * COMPRESSED_BLOCK_SIZE < end; ++index) {
+		const uint32_t block_start = index * COMPRESSED_BLOCK_SIZE;
+		const int32_t block_size = std::min(COMPRESSED_BLOCK_SIZE, p_samples.num_samples - block_start);
+		const size_t offset = p_samples.block_offsets[index];
+		FLACBitStream stream(p_samples.data.data() + offset, p_samples.block_offsets[index + 1] - offset);
+		decode_flac_subframe(stream, 16, block.data(), block_size);
+		if (stream.get_stream_error()) {
+			return false;
+		}
+		const uint32_t from = std::max(p_first, block_start);
+		const uint32_t to = std::min(end, block_start + block_size);
+		for (uint32_t i = from; i < to; ++i) {
+			p_out[i - p_first] = (int16_t)block[i - block_start];
+		}
+	}
+	return true;
+}
+
+// Sets up an SF2 file to be played from losslessly compressed sample data: p_header receives the
+// file without the contents of its smpl chunk, which the returned cache decodes as voices need them
+static SampleCache *open_sf2_compressed_samples(FileAndMemReader *p_in, size_t p_cache_size, unsigned int p_threads,
+		std::vector<uint8_t> &p_header) {
+	uint64_t samples_offset;
+	uint32_t samples_size;
+	const SF2ByteReader read = [p_in](uint64_t p_offset, size_t p_length, std::vector<uint8_t> &p_out) {
+		const size_t size = p_out.size();
+		p_out.resize(size + p_length);
+		p_in->seek((long)p_offset, SEEK_SET);
+		return p_in->read(p_out.data() + size, 1, p_length) == p_length;
+	};
+	if (!split_sf2_samples(read, p_in->file_size(), p_header, samples_offset, samples_size)) {
+		return nullptr;
+	}
+
+	// The samples are read and compressed a batch of blocks at a time, so the uncompressed data
+	// is never held whole
+	static const uint32_t BATCH_BLOCKS = 64;
+	std::shared_ptr<CompressedSamples> compressed(new CompressedSamples);
+	compressed->num_samples = samples_size / sizeof(int16_t);
+	std::vector<int16_t> batch(BATCH_BLOCKS * COMPRESSED_BLOCK_SIZE);
+	std::vector<std::vector<uint8_t>> coded(BATCH_BLOCKS);
+	p_in->seek((long)samples_offset, SEEK_SET);
+	for (uint32_t start = 0; start < compressed->num_samples; start += BATCH_BLOCKS * COMPRESSED_BLOCK_SIZE) {
+		const uint32_t count = std::min(BATCH_BLOCKS * COMPRESSED_BLOCK_SIZE, compressed->num_samples - start);
+		if (p_in->read(batch.data(), sizeof(int16_t), count) != count) {
+			return nullptr;
+		}
+		const uint32_t num_blocks = (count + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+		parallel_for(num_blocks, p_threads, [&](size_t p_block) {
+			const uint32_t first = p_block * COMPRESSED_BLOCK_SIZE;
+			coded[p_block].clear();
+			compress_sample_block(batch.data() + first, std::min(COMPRESSED_BLOCK_SIZE, count - first), coded[p_block]);
+		});
+		for (uint32_t i = 0; i < num_blocks; ++i) {
+			compressed->block_offsets.push_back(compressed->data.size());
+			compressed->data.insert(compressed->data.end(), coded[i].begin(), coded[i].end());
+		}
+	}
+	compressed->block_offsets.push_back(compressed->data.size());
+	compressed->data.shrink_to_fit();
+
+	const size_t stored_size = compressed->data.size() + compressed->block_offsets.size() * sizeof(size_t);
+	return new SampleCache(p_cache_size, stored_size, [compressed](uint32_t p_first, uint32_t p_count, int16_t *p_out) {
+		return read_compressed_samples(*compressed, p_first, p_count, p_out);
+	});
+}
 #endif // TINYPRIMESYNTH_FLAC_SUPPORT
 
 class Synthesizer::Sequencer {
@@ -3234,379 +4614,553 @@ class Synthesizer::Sequencer {
 			SONG_BEGIN_HOOK = 0x101
 		};
 		//! Main type of event
-		uint_fast16_t type = MidiEvent::UNKNOWN;
-		//! Sub-type of the event
-		uint_fast16_t sub_type = MidiEvent::UNKNOWN;
+		uint8_t type = MidiEvent::UNKNOWN;
 		//! Targeted MIDI channel
-		uint_fast16_t channel = 0;
+		uint8_t channel = 0;
+		//! Sub-type of the event
+		uint16_t sub_type = MidiEvent::UNKNOWN;
 		//! Is valid event
-		uint_fast16_t is_valid = 1;
-		//! Reserved 5 bytes padding
-		uint_fast16_t padding[4] = { 0, 0, 0, 0 };
-		//! Absolute tick position (Used for the tempo calculation only)
-		uint64_t absolute_tick_position = 0;
-		//! Raw data of this event
-		std::vector<uint8_t> data;
+		uint8_t is_valid = 1;
+		//! Track the event was read from
+		uint16_t track = 0;
+		//! Length of the event's data
+		uint32_t data_size = 0;
+		//! Data of up to four bytes (every channel message) is kept here, see get_event_data
+		uint8_t data[4] = { 0, 0, 0, 0 };
+		//! Where longer data starts in midi_event_data
+		uint32_t data_offset = 0;
 	};
-	class MidiTrackRow {
-	public:
-		MidiTrackRow() :
-				time(0.0), delay(0), absolute_position(0), time_delay(0.0) {
-		}
-		//! Clear MIDI row data
-		void Clear() {
-			time = 0.0;
-			delay = 0;
-			absolute_position = 0;
-			time_delay = 0.0;
-			events.clear();
-		}
+	struct MidiTrackRow {
 		//! Absolute time position in seconds
-		double time;
+		double time = 0.0;
 		//! Delay to next event in ticks
-		uint64_t delay;
+		uint64_t delay = 0;
 		//! Absolute position in ticks
-		uint64_t absolute_position;
+		uint64_t absolute_position = 0;
 		//! Delay to next event in seconds
-		double time_delay;
-		//! List of MIDI events in the current row
-		std::vector<MidiEvent> events;
-
-		void SortEvents(bool *p_note_states) {
-			typedef std::vector<MidiEvent> EvtArr;
-			EvtArr sysex;
-			EvtArr metas;
-			EvtArr note_offs;
-			EvtArr controllers;
-			EvtArr any_other;
-
-			for (size_t i = 0; i < events.size(); i++) {
-				if (events[i].type == MidiEvent::NOTE_OFF) {
-					if (note_offs.capacity()) {
-						note_offs.reserve(events.size());
-					}
-					note_offs.push_back(events[i]);
-				} else if (events[i].type == MidiEvent::SYSEX || events[i].type == MidiEvent::SYSEX2) {
-					if (sysex.capacity() == 0) {
-						sysex.reserve(events.size());
-					}
-					sysex.push_back(events[i]);
-				} else if ((events[i].type == MidiEvent::CONTROL_CHANGE) ||
-						(events[i].type == MidiEvent::PATCH_CHANGE) || (events[i].type == MidiEvent::PITCH_WHEEL) ||
-						(events[i].type == MidiEvent::CHANNEL_TOUCH)) {
-					if (controllers.capacity() == 0) {
-						controllers.reserve(events.size());
-					}
-					controllers.push_back(events[i]);
-				} else if ((events[i].type == MidiEvent::SPECIAL) &&
-						((events[i].sub_type == MidiEvent::MARKER) ||
-								(events[i].sub_type == MidiEvent::DEVICE_SWITCH) ||
-								(events[i].sub_type == MidiEvent::SONG_BEGIN_HOOK) ||
-								(events[i].sub_type == MidiEvent::LOOP_START) ||
-								(events[i].sub_type == MidiEvent::LOOP_END) ||
-								(events[i].sub_type == MidiEvent::LOOP_STACK_BEGIN) ||
-								(events[i].sub_type == MidiEvent::LOOP_STACK_END) ||
-								(events[i].sub_type == MidiEvent::LOOP_STACK_BREAK))) {
-					if (metas.capacity() == 0) {
-						metas.reserve(events.size());
-					}
-					metas.push_back(events[i]);
-				} else {
-					if (any_other.capacity() == 0) {
-						any_other.reserve(events.size());
+		double time_delay = 0.0;
+		//! Delay to next event in output frames, the difference of both rows' absolute times
+		//! in frames, so that the delays of any run of rows add up without drifting
+		uint64_t frame_delay = 0;
+		//! The row's events are midi_events[first_event] on, or a track's parsed events while loading
+		size_t first_event = 0;
+		uint32_t num_events = 0;
+	};
+	// A track and the tick its next row is due at, ordered by tick and then by track
+	struct DueTrack {
+		uint64_t tick;
+		size_t track;
+		bool operator<(const DueTrack &p_other) const {
+			return tick < p_other.tick || (tick == p_other.tick && track < p_other.track);
+		}
+	};
+	enum class TrackVisit {
+		//! Due again on a later tick
+		DUE,
+		//! Due again on the same tick
+		DUE_AGAIN,
+		//! Ended by its End Of Track event
+		ENDED,
+		//! Visited with no rows left
+		RAN_OUT
+	};
+	struct ParsedTrack;
+	struct TrackData;
+	// Puts the events of each row of a track in playback order: SysEx, note-offs, meta events,
+	// controllers, then everything else. A note-off for a note that is started again on the same
+	// row goes after everything else instead, so that zero-length notes do not play forever.
+	// p_note_states carries the notes left on from row to row of a track, and the buffers are
+	// kept to avoid reallocating them
+	class RowSorter {
+	public:
+		void sort(std::vector<MidiEvent> &p_events, std::bitset<MIDI_NOTE_COUNT> &p_note_states) {
+			const size_t count = p_events.size();
+			if (count == 1) {
+				// nothing to reorder, only the note states to keep
+				const MidiEvent &e = p_events[0];
+				if (e.type == MidiEvent::NOTE_ON || e.type == MidiEvent::NOTE_OFF) {
+					p_note_states[note_index(e)] = e.type == MidiEvent::NOTE_ON;
+				}
+				return;
+			}
+
+			// Classify the events in one pass, chaining the note-offs of each note in row order.
+			// The chains are only valid where the note's stamp is this row's
+			if (++row_stamp == 0) {
+				memset(note_off_stamps, 0, sizeof(note_off_stamps));
+				row_stamp = 1;
+			}
+			groups.resize(count);
+			next_note_off.resize(count);
+			note_ons.clear();
+			size_t group_sizes[GROUP_COUNT] = {};
+			for (size_t i = 0; i < count; i++) {
+				const MidiEvent &e = p_events[i];
+				const uint8_t group = group_of(e);
+				groups[i] = group;
+				group_sizes[group]++;
+				if (group == NOTE_OFFS) {
+					const size_t note = note_index(e);
+					next_note_off[i] = NO_EVENT;
+					if (note_off_stamps[note] != row_stamp) {
+						note_off_stamps[note] = row_stamp;
+						first_note_off[note] = (uint32_t)i;
+					} else {
+						next_note_off[last_note_off[note]] = (uint32_t)i;
 					}
-					any_other.push_back(events[i]);
+					last_note_off[note] = (uint32_t)i;
+				} else if (e.type == MidiEvent::NOTE_ON) {
+					note_ons.push_back((uint32_t)i);
 				}
 			}
 
 			/*
 			 * If Note-Off and it's Note-On is on the same row - move this damned note
-			 * off down!
+			 * off down! Only the first Note-On of a note decides: when the note was
+			 * already on, its first Note-Off still ends it, and any others are moved
 			 */
-			if (p_note_states) {
-				std::set<size_t> mark_as_on;
-				for (size_t i = 0; i < any_other.size(); i++) {
-					const MidiEvent e = any_other[i];
-					if (e.type == MidiEvent::NOTE_ON) {
-						const size_t note_i = (size_t)(e.channel * 255) + (e.data[0] & 0x7F);
-						// Check, was previously note is on or off
-						bool wasOn = p_note_states[note_i];
-						mark_as_on.insert(note_i);
-						// Detect zero-length notes are following previously pressed
-						// note
-						int note_offs_on_same_note = 0;
-						for (EvtArr::iterator j = note_offs.begin(); j != note_offs.end();) {
-							// If note was off, and note-off on same row with note-on - move it down!
-							if (((*j).channel == e.channel) && ((*j).data[0] == e.data[0])) {
-								// If note is already off OR more than one note-off on same row and same note
-								if (!wasOn || (note_offs_on_same_note != 0)) {
-									any_other.push_back(*j);
-									j = note_offs.erase(j);
-									mark_as_on.erase(note_i);
-									continue;
-								} else {
-									// When same row has many note-offs on same row
-									// that means a zero-length note follows previous note
-									// it must be shuted down
-									note_offs_on_same_note++;
-								}
-							}
-							j++;
-						}
-					}
-				}
-
-				// Mark other notes as released
-				for (EvtArr::iterator j = note_offs.begin(); j != note_offs.end(); ++j) {
-					size_t note_i = (size_t)(j->channel * 255) + (j->data[0] & 0x7F);
-					p_note_states[note_i] = false;
+			moved_note_offs.clear();
+			for (uint32_t i : note_ons) {
+				const size_t note = note_index(p_events[i]);
+				if (seen_note_ons[note]) {
+					marked_as_on[note] = true;
+					continue;
 				}
-
-				for (std::set<size_t>::iterator j = mark_as_on.begin(); j != mark_as_on.end(); ++j) {
-					p_note_states[*j] = true;
+				seen_note_ons[note] = true;
+				touched_notes.push_back(note);
+
+				const size_t moved_before = moved_note_offs.size();
+				if (note_off_stamps[note] == row_stamp) {
+					uint32_t j = first_note_off[note];
+					if (p_note_states[note]) {
+						j = next_note_off[j];
+					}
+					for (; j != NO_EVENT; j = next_note_off[j]) {
+						groups[j] = MOVED_NOTE_OFFS;
+						group_sizes[NOTE_OFFS]--;
+						moved_note_offs.push_back(j);
+					}
 				}
+				marked_as_on[note] = moved_note_offs.size() == moved_before;
 			}
 
-			events.clear();
-			if (!sysex.empty()) {
-				for (MidiEvent ev : sysex) {
-					events.push_back(ev);
-				}
+			// Place every group in turn, keeping the row order within each, and mark released notes
+			size_t group_starts[GROUP_COUNT];
+			size_t start = 0;
+			for (size_t g = 0; g < GROUP_COUNT; g++) {
+				group_starts[g] = start;
+				start += group_sizes[g];
 			}
-			if (!note_offs.empty()) {
-				for (MidiEvent ev : note_offs) {
-					events.push_back(ev);
+			unsorted.assign(p_events.begin(), p_events.end());
+			for (size_t i = 0; i < count; i++) {
+				const uint8_t group = groups[i];
+				if (group == MOVED_NOTE_OFFS) {
+					continue;
 				}
-			}
-			if (!metas.empty()) {
-				for (MidiEvent ev : metas) {
-					events.push_back(ev);
+				if (group == NOTE_OFFS) {
+					p_note_states[note_index(unsorted[i])] = false;
 				}
+				p_events[group_starts[group]++] = unsorted[i];
 			}
-			if (!controllers.empty()) {
-				for (MidiEvent ev : controllers) {
-					events.push_back(ev);
-				}
+			for (uint32_t j : moved_note_offs) {
+				p_events[start++] = unsorted[j];
 			}
-			if (!any_other.empty()) {
-				for (MidiEvent ev : any_other) {
-					events.push_back(ev);
+
+			// Then mark the notes that are on
+			for (size_t note : touched_notes) {
+				if (marked_as_on[note]) {
+					p_note_states[note] = true;
 				}
+				seen_note_ons[note] = false;
+				marked_as_on[note] = false;
 			}
+			touched_notes.clear();
 		}
+
+	private:
+		enum : uint8_t {
+			SYSEX,
+			NOTE_OFFS,
+			METAS,
+			CONTROLLERS,
+			ANY_OTHER,
+			GROUP_COUNT,
+			MOVED_NOTE_OFFS = GROUP_COUNT
+		};
+		static constexpr uint32_t NO_EVENT = UINT32_MAX;
+
+		static size_t note_index(const MidiEvent &p_evt) {
+			return (size_t)p_evt.channel * (MAX_KEY + 1) + (p_evt.data[0] & MAX_KEY);
+		}
+
+		static uint8_t group_of(const MidiEvent &p_evt) {
+			switch (p_evt.type) {
+				case MidiEvent::NOTE_OFF:
+					return NOTE_OFFS;
+				case MidiEvent::SYSEX:
+				case MidiEvent::SYSEX2:
+					return SYSEX;
+				case MidiEvent::CONTROL_CHANGE:
+				case MidiEvent::PATCH_CHANGE:
+				case MidiEvent::PITCH_WHEEL:
+				case MidiEvent::CHANNEL_TOUCH:
+					return CONTROLLERS;
+				case MidiEvent::SPECIAL:
+					switch (p_evt.sub_type) {
+						case MidiEvent::MARKER:
+						case MidiEvent::DEVICE_SWITCH:
+						case MidiEvent::SONG_BEGIN_HOOK:
+						case MidiEvent::LOOP_START:
+						case MidiEvent::LOOP_END:
+						case MidiEvent::LOOP_STACK_BEGIN:
+						case MidiEvent::LOOP_STACK_END:
+						case MidiEvent::LOOP_STACK_BREAK:
+							return METAS;
+						default:
+							return ANY_OTHER;
+					}
+				default:
+					return ANY_OTHER;
+			}
+		}
+
+		//! Per note scratch state of the row being sorted, cleared through touched_notes
+		std::bitset<MIDI_NOTE_COUNT> seen_note_ons, marked_as_on;
+		std::vector<size_t> touched_notes;
+		//! First and last note-off of each note on the row, when its stamp is the row's
+		uint32_t note_off_stamps[MIDI_NOTE_COUNT] = {};
+		uint32_t first_note_off[MIDI_NOTE_COUNT];
+		uint32_t last_note_off[MIDI_NOTE_COUNT];
+		uint32_t row_stamp = 0;
+		//! Group of each event of the row, and the next note-off of the same note
+		std::vector<uint8_t> groups;
+		std::vector<uint32_t> next_note_off;
+		std::vector<uint32_t> note_ons, moved_note_offs;
+		std::vector<MidiEvent> unsorted;
 	};
-	struct TempoChangePoint {
-		uint64_t absolute_position;
-		FixedFraction tempo;
-	};
+
 	struct Position {
 		//! Was track began playing
 		bool began = false;
 		//! Reserved
 		char padding[7] = { 0, 0, 0, 0, 0, 0, 0 };
-		//! Waiting time before next event in seconds
-		double wait = 0.0;
-		//! Absolute time position on the track in seconds
-		double absolute_time_position = 0.0;
-		//! Track information
-		struct TrackInfo {
-			//! Delay to next event in a track
-			uint64_t delay = 0;
-			//! Last handled event type
-			int32_t last_handled_event = 0;
-			//! Reserved
-			char padding2[4];
-			//! MIDI Events queue position iterator
-			std::list<MidiTrackRow>::iterator pos;
-		};
-		std::vector<TrackInfo> track;
+		//! Waiting time before next event in output frames
+		int64_t wait = 0;
+		//! Absolute position on the track in output frames
+		uint64_t absolute_frame_position = 0;
+		//! Next row of midi_rows to play
+		size_t row = 0;
 	};
 
-	void build_smf_setup_reset(size_t p_track_count) {
+	void build_smf_setup_reset() {
 		midi_full_song_time_length = 0.0;
 		midi_loop_start_time = -1.0;
 		midi_loop_end_time = -1.0;
 		midi_loop_format = LoopFormat::DEFAULT;
 		memset(channel_disabled, 0, 16 * sizeof(bool));
-		midi_track_data.clear();
-		midi_track_data.resize(p_track_count);
+		midi_rows.clear();
+		midi_events.clear();
+		midi_event_data.clear();
 
 		midi_loop.reset();
 		midi_loop.invalid_loop = false;
 		midi_time.reset();
 
 		midi_current_position.began = false;
-		midi_current_position.absolute_time_position = 0.0;
-		midi_current_position.wait = 0.0;
-		midi_current_position.track.clear();
-		midi_current_position.track.resize(p_track_count);
+		midi_current_position.absolute_frame_position = 0;
+		midi_current_position.wait = 0;
+		midi_current_position.row = 0;
+	}
+
+	bool build_smf_track_data(std::vector<TrackData> &p_track_data) {
+		build_smf_setup_reset();
+		start_loading(p_track_data);
+
+		bool loaded;
+		// Loop points need the whole song to be checked, so a song with any is read at once here
+		// rather than from play_stream
+		if (midi_synth->incremental_loading && !has_loop_events(midi_loader.track_data)) {
+			// Read as much of the song as the first part needs; play_stream reads on from there
+			midi_loader.active = true;
+			const double tick_time = midi_tempo.value();
+			if (tick_time > 0.0) {
+				midi_loader.step = std::max((uint64_t)1, (uint64_t)(LOAD_STEP_SECONDS / tick_time));
+			}
+			loaded = load_song_part();
+		} else {
+			loaded = finish_loading(midi_synth->load_threads);
+		}
+		if (!loaded) {
+			midi_loader = SongLoader();
+		}
+		return loaded;
 	}
 
-	bool build_smf_track_data(const std::vector<std::vector<uint8_t>> &p_track_data) {
-		const size_t track_count = p_track_data.size();
-		build_smf_setup_reset(track_count);
-
-		bool got_global_loop_start = false, got_global_loop_end = false, got_stack_loop_start = false,
-			 got_loop_event_in_this_row = false;
-
-		//! tick position of loop start tag
-		uint64_t loop_start_ticks = 0;
-		//! tick position of loop end tag
-		uint64_t loop_end_ticks = 0;
-		//! Full length of song in ticks
-		uint64_t ticks_song_length = 0;
+	// Takes the track data of a song to load, and gets its first row ready to be merged and timed
+	void start_loading(std::vector<TrackData> &p_track_data) {
+		SongLoader &loader = midi_loader;
+		loader = SongLoader();
+		loader.track_data.swap(p_track_data);
+		loader.tracks.resize(loader.track_data.size());
+		for (ParsedTrack &track : loader.tracks) {
+			track.loop_format = midi_loop_format;
+		}
+		start_merge();
 
-		//! Caches note on/off states.
-		bool note_states[16 * 255];
-		/* This is required to carefully detect zero-length notes           *
-		 * and avoid a move of "note-off" event over "note-on" while sort.  *
-		 * Otherwise, after sort those notes will play infinite sound       */
+		midi_start_tempo = midi_tempo;
+		loader.tempo = midi_start_tempo;
+		// Set begin of the music
+		midi_track_begin_position = midi_current_position;
+		// Initial loop position will begin at begin of track until passing of the
+		// loop point
+		midi_loop_begin_position = midi_current_position;
+		// Set lowest level of the loop stack
+		midi_loop.stack_level = -1;
 
-		//! Tempo change events list
-		std::vector<MidiEvent> tempos_list;
+		// Set the count of loops
+		midi_loop.loops_count = midi_loop_count;
+		midi_loop.loops_left = midi_loop_count;
+	}
 
-		/*
-		 * TODO: Make this be safer for memory in case of broken input data
-		 * which may cause going away of available track data (and then give a
-		 * crash!)
-		 *
-		 * POST: Check this more carefully for possible vulnuabilities are can crash
-		 * this
-		 */
-		for (size_t tk = 0; tk < track_count; ++tk) {
-			uint64_t abs_position = 0;
+	// Tells whether any track has loop markers or loop controllers, walking its events without
+	// keeping them. A DMX MUS score has neither
+	bool has_loop_events(const std::vector<TrackData> &p_track_data) const {
+		if (midi_format == FileFormat::MUS) {
+			return false;
+		}
+		for (const TrackData &data : p_track_data) {
+			ParsedTrack track;
 			int status = 0;
-			MidiEvent event;
-			bool ok = false;
-			const uint8_t *end = p_track_data[tk].data() + p_track_data[tk].size();
-			const uint8_t *track_ptr = p_track_data[tk].data();
-			memset(note_states, 0, 4080 * sizeof(bool));
-
-			// Time delay that follows the first event in the track
-			{
-				MidiTrackRow evt_pos;
-				if (midi_format == FileFormat::RSXX) {
-					ok = true;
-				} else {
-					evt_pos.delay = read_variable_length_value(&track_ptr, end, ok);
+			bool ok = true;
+			const uint8_t *ptr = data.data;
+			const uint8_t *end = data.data + data.size;
+			if (midi_format != FileFormat::RSXX) {
+				read_variable_length_value(&ptr, end, ok);
+			}
+			while (ok) {
+				const MidiEvent event = parse_event(&ptr, end, status, track);
+				if (!event.is_valid || event.sub_type == MidiEvent::END_TRACK) {
+					break;
 				}
-				if (!ok) {
-					return false;
+				if (track.has_loop_controllers) {
+					return true;
 				}
-
-				// HACK: Begin every track with "Reset all controllers" event to
-				// avoid controllers state break came from end of song
-				if (tk == 0) {
-					MidiEvent reset_event;
-					reset_event.type = MidiEvent::SPECIAL;
-					reset_event.sub_type = MidiEvent::SONG_BEGIN_HOOK;
-					evt_pos.events.push_back(reset_event);
+				if (event.type == MidiEvent::SPECIAL) {
+					switch (event.sub_type) {
+						case MidiEvent::LOOP_START:
+						case MidiEvent::LOOP_END:
+						case MidiEvent::LOOP_STACK_BEGIN:
+						case MidiEvent::LOOP_STACK_END:
+						case MidiEvent::LOOP_STACK_BREAK:
+							return true;
+						default:
+							break;
+					}
 				}
+				track.event_data.clear();
+				read_variable_length_value(&ptr, end, ok);
+			}
+		}
+		return false;
+	}
 
-				evt_pos.absolute_position = abs_position;
-				abs_position += evt_pos.delay;
-				midi_track_data[tk].push_back(evt_pos);
+	// Reads the next part of a song loaded a part at a time, then merges and times its rows.
+	// Songs with loop points are never loaded this way, see has_loop_events. Once no track has
+	// anything left to read the song is finished. Fails if a track is broken in this part
+	bool load_song_part() {
+		SongLoader &loader = midi_loader;
+		// Every step reads at least one row, however long the tracks wait
+		uint64_t next_row = UINT64_MAX;
+		for (const ParsedTrack &track : loader.tracks) {
+			if (!track.ended) {
+				next_row = std::min(next_row, track.length);
 			}
+		}
+		loader.horizon = std::max(loader.horizon + loader.step, next_row);
 
-			MidiTrackRow evt_pos;
-			do {
-				event = parse_event(&track_ptr, end, status);
-				if (!event.is_valid) {
-					return false;
-				}
+		bool ok = true, tracks_left = false;
+		for (size_t tk = 0; tk < loader.tracks.size(); ++tk) {
+			ParsedTrack &track = loader.tracks[tk];
+			if (!track.ended && !parse_smf_track(loader.track_data[tk], tk, track, loader.sorter, loader.horizon)) {
+				// a broken track ends where it breaks
+				track.ended = true;
+				ok = false;
+			}
+			tracks_left = tracks_left || !track.ended;
+		}
+		if (!tracks_left) {
+			return finish_loading(1) && ok;
+		}
 
-				evt_pos.events.push_back(event);
-				if (event.type == MidiEvent::SPECIAL) {
-					if (event.sub_type == MidiEvent::TEMPO_CHANGE) {
-						event.absolute_tick_position = abs_position;
-						tempos_list.push_back(event);
-					} else if (!midi_loop.invalid_loop && (event.sub_type == MidiEvent::LOOP_START)) {
-						/*
-						 * loopStart is invalid when:
-						 * - starts together with loopEnd
-						 * - appears more than one time in same MIDI file
-						 */
-						if (got_global_loop_start || got_loop_event_in_this_row) {
-							midi_loop.invalid_loop = true;
-						} else {
-							got_global_loop_start = true;
-							loop_start_ticks = abs_position;
-						}
-						// In this row we got loop event, register this!
-						got_loop_event_in_this_row = true;
-					} else if (!midi_loop.invalid_loop && (event.sub_type == MidiEvent::LOOP_END)) {
-						/*
-						 * loopEnd is invalid when:
-						 * - starts before loopStart
-						 * - starts together with loopStart
-						 * - appars more than one time in same MIDI file
-						 */
-						if (got_global_loop_end || got_loop_event_in_this_row) {
-							midi_loop.invalid_loop = true;
-						} else {
-							got_global_loop_end = true;
-							loop_end_ticks = abs_position;
-						}
-						// In this row we got loop event, register this!
-						got_loop_event_in_this_row = true;
-					} else if (!midi_loop.invalid_loop && (event.sub_type == MidiEvent::LOOP_STACK_BEGIN)) {
-						if (!got_stack_loop_start) {
-							if (!got_global_loop_start) {
-								loop_start_ticks = abs_position;
-							}
-							got_stack_loop_start = true;
-						}
+		merge_rows(loader.horizon);
+		time_rows();
+		return ok;
+	}
 
-						midi_loop.stack_up();
-						if (midi_loop.stack_level >= (int)(midi_loop.stack.size())) {
-							LoopStackEntry e;
-							e.loops = event.data[0];
-							e.infinity = (event.data[0] == 0);
-							e.start = abs_position;
-							e.end = abs_position;
-							midi_loop.stack.push_back(e);
-						}
-					} else if (!midi_loop.invalid_loop && ((event.sub_type == MidiEvent::LOOP_STACK_END) || (event.sub_type == MidiEvent::LOOP_STACK_BREAK))) {
-						if (midi_loop.stack_level <= -1) {
-							midi_loop.invalid_loop = true; // Caught loop end without of loop start!
-						} else {
-							if (loop_end_ticks < abs_position) {
-								loop_end_ticks = abs_position;
-							}
-							midi_loop.get_current_stack().end = abs_position;
-							midi_loop.stack_down();
-						}
-					}
+	// Reads what is left of the song, on up to p_threads threads, and completes its rows and
+	// loop points. Fails if a track is broken; when the song is loaded a part at a time, part of
+	// it may have been played already, so that track ends where it breaks instead
+	bool finish_loading(unsigned int p_threads) {
+		SongLoader &loader = midi_loader;
+		std::vector<ParsedTrack> &tracks = loader.tracks;
+		const size_t track_count = tracks.size();
+		const LoopFormat first_loop_format = midi_loop_format;
+
+		// Tracks are independent until they are merged, so they are read in parallel when
+		// there are load threads for it
+		std::vector<uint8_t> track_ok(track_count, 1);
+		parallel_for(track_count, p_threads, [&](size_t p_track) {
+			if (!tracks[p_track].ended) {
+				RowSorter sorter;
+				track_ok[p_track] = parse_smf_track(loader.track_data[p_track], p_track, tracks[p_track], sorter, UINT64_MAX);
+			}
+		});
+		size_t loop_controller_tracks = 0;
+		for (size_t tk = 0; tk < track_count; ++tk) {
+			if (!track_ok[tk]) {
+				if (!loader.active) {
+					return false;
 				}
+				tracks[tk].ended = true;
+			}
+			if (tracks[tk].has_loop_controllers) {
+				loop_controller_tracks++;
+				midi_loop_format = tracks[tk].loop_format;
+			}
+		}
 
-				if (event.sub_type != MidiEvent::END_TRACK) // Don't try to read delta after
-															// EndOfTrack event!
-				{
-					evt_pos.delay = read_variable_length_value(&track_ptr, end, ok);
-					if (!ok) {
-						/* End of track has been reached! However, there is no EOT
-						 * event presented */
-						event.type = MidiEvent::SPECIAL;
-						event.sub_type = MidiEvent::END_TRACK;
+		// How loop controllers read depends on the ones in the tracks before, so when several
+		// tracks have them, the tracks are read again in order and the rows merged again
+		if (loop_controller_tracks > 1) {
+			midi_loop_format = first_loop_format;
+			for (size_t tk = 0; tk < track_count; ++tk) {
+				tracks[tk] = ParsedTrack();
+				tracks[tk].loop_format = midi_loop_format;
+				if (!parse_smf_track(loader.track_data[tk], tk, tracks[tk], loader.sorter, UINT64_MAX)) {
+					if (!loader.active) {
+						return false;
 					}
+					tracks[tk].ended = true;
 				}
+				midi_loop_format = tracks[tk].loop_format;
+			}
+			midi_rows.clear();
+			midi_events.clear();
+			midi_event_data.clear();
+			start_merge();
+			loader.tempo = midi_start_tempo;
+			loader.time = 0.0;
+			loader.timed_rows = 0;
+		}
 
-				if ((evt_pos.delay > 0) || (event.sub_type == MidiEvent::END_TRACK)) {
-					evt_pos.absolute_position = abs_position;
-					abs_position += evt_pos.delay;
-					evt_pos.SortEvents(note_states);
-					midi_track_data[tk].push_back(evt_pos);
-					evt_pos.Clear();
+		if (!loader.active) {
+			size_t event_count = 0, data_size = 0;
+			for (const ParsedTrack &track : tracks) {
+				event_count += track.events.size();
+				data_size += track.event_data.size();
+			}
+			midi_events.reserve(event_count);
+			midi_event_data.reserve(data_size);
+		}
+		merge_rows(UINT64_MAX);
+		// reallocating the whole song is left out when the last part is read during playback
+		if (!loader.active) {
+			midi_rows.shrink_to_fit();
+			midi_events.shrink_to_fit();
+			midi_event_data.shrink_to_fit();
+		}
+		time_rows();
+
+		uint64_t loop_start_ticks = 0, loop_end_ticks = 0;
+		find_loop_points(loop_start_ticks, loop_end_ticks);
+		finish_timeline(loop_start_ticks, loop_end_ticks);
+
+		loader = SongLoader();
+		return true;
+	}
+
+	// Finds the loop points of the song from the loop events of every track, in track order
+	void find_loop_points(uint64_t &p_loop_start_ticks, uint64_t &p_loop_end_ticks) {
+		bool got_global_loop_start = false, got_global_loop_end = false, got_stack_loop_start = false;
+
+		//! tick position of loop start tag
+		uint64_t loop_start_ticks = 0;
+		//! tick position of loop end tag
+		uint64_t loop_end_ticks = 0;
+		//! Full length of song in ticks
+		uint64_t ticks_song_length = 0;
+
+		for (const ParsedTrack &track : midi_loader.tracks) {
+			const std::vector<LoopMarker> &markers = track.loop_markers;
+			bool got_loop_event_in_this_row = false;
+			for (size_t i = 0; i < markers.size(); i++) {
+				const LoopMarker &marker = markers[i];
+				const uint64_t abs_position = marker.tick;
+				// Every row of a track has its own tick
+				if (i > 0 && abs_position != markers[i - 1].tick) {
 					got_loop_event_in_this_row = false;
 				}
-			} while ((track_ptr <= end) && (event.sub_type != MidiEvent::END_TRACK));
+				if (!midi_loop.invalid_loop && (marker.sub_type == MidiEvent::LOOP_START)) {
+					/*
+					 * loopStart is invalid when:
+					 * - starts together with loopEnd
+					 * - appears more than one time in same MIDI file
+					 */
+					if (got_global_loop_start || got_loop_event_in_this_row) {
+						midi_loop.invalid_loop = true;
+					} else {
+						got_global_loop_start = true;
+						loop_start_ticks = abs_position;
+					}
+					// In this row we got loop event, register this!
+					got_loop_event_in_this_row = true;
+				} else if (!midi_loop.invalid_loop && (marker.sub_type == MidiEvent::LOOP_END)) {
+					/*
+					 * loopEnd is invalid when:
+					 * - starts before loopStart
+					 * - starts together with loopStart
+					 * - appars more than one time in same MIDI file
+					 */
+					if (got_global_loop_end || got_loop_event_in_this_row) {
+						midi_loop.invalid_loop = true;
+					} else {
+						got_global_loop_end = true;
+						loop_end_ticks = abs_position;
+					}
+					// In this row we got loop event, register this!
+					got_loop_event_in_this_row = true;
+				} else if (!midi_loop.invalid_loop && (marker.sub_type == MidiEvent::LOOP_STACK_BEGIN)) {
+					if (!got_stack_loop_start) {
+						if (!got_global_loop_start) {
+							loop_start_ticks = abs_position;
+						}
+						got_stack_loop_start = true;
+					}
 
-			if (ticks_song_length < abs_position) {
-				ticks_song_length = abs_position;
+					midi_loop.stack_up();
+					if (midi_loop.stack_level >= (int)(midi_loop.stack.size())) {
+						LoopStackEntry e;
+						e.loops = marker.loops;
+						e.infinity = (marker.loops == 0);
+						e.start = abs_position;
+						e.end = abs_position;
+						midi_loop.stack.push_back(e);
+					}
+				} else if (!midi_loop.invalid_loop && ((marker.sub_type == MidiEvent::LOOP_STACK_END) || (marker.sub_type == MidiEvent::LOOP_STACK_BREAK))) {
+					if (midi_loop.stack_level <= -1) {
+						midi_loop.invalid_loop = true; // Caught loop end without of loop start!
+					} else {
+						if (loop_end_ticks < abs_position) {
+							loop_end_ticks = abs_position;
+						}
+						midi_loop.get_current_stack().end = abs_position;
+						midi_loop.stack_down();
+					}
+				}
 			}
-			// Set the chain of events begin
-			if (midi_track_data[tk].size() > 0) {
-				midi_current_position.track[tk].pos = midi_track_data[tk].begin();
+
+			if (ticks_song_length < track.length) {
+				ticks_song_length = track.length;
 			}
 		}
 
@@ -3620,189 +5174,373 @@ class Synthesizer::Sequencer {
 			midi_loop.invalid_loop = true;
 		}
 
-		build_timeline(tempos_list, loop_start_ticks, loop_end_ticks);
+		p_loop_start_ticks = loop_start_ticks;
+		p_loop_end_ticks = loop_end_ticks;
+	}
+
+	// Reads rows of one track into p_track_out until it is past p_until ticks or ended, sorting
+	// the events of each row. Nothing else is changed, so tracks can be read at the same time;
+	// a track starts with the loop format left by the tracks before
+	bool parse_smf_track(const TrackData &p_data, size_t p_track, ParsedTrack &p_track_out, RowSorter &p_sorter,
+			uint64_t p_until) const {
+		uint64_t abs_position = p_track_out.length;
+		int status = p_track_out.status;
+		MidiEvent event;
+		bool ok = false;
+		const uint8_t *end = p_data.data + p_data.size;
+		const uint8_t *track_ptr = p_data.data + p_track_out.read_pos;
+		//! Events of the row being read
+		std::vector<MidiEvent> row_events;
+
+		/*
+		 * TODO: Make this be safer for memory in case of broken input data
+		 * which may cause going away of available track data (and then give a
+		 * crash!)
+		 *
+		 * POST: Check this more carefully for possible vulnuabilities are can crash
+		 * this
+		 */
+
+		// Time delay that follows the first event in the track
+		if (p_track_out.rows.empty()) {
+			MidiTrackRow evt_pos;
+			if (midi_format == FileFormat::RSXX || midi_format == FileFormat::MUS) {
+				ok = true;
+			} else {
+				evt_pos.delay = read_variable_length_value(&track_ptr, end, ok);
+			}
+			if (!ok) {
+				return false;
+			}
+
+			// HACK: Begin every track with "Reset all controllers" event to
+			// avoid controllers state break came from end of song
+			if (p_track == 0) {
+				MidiEvent reset_event;
+				reset_event.type = MidiEvent::SPECIAL;
+				reset_event.sub_type = MidiEvent::SONG_BEGIN_HOOK;
+				evt_pos.first_event = p_track_out.events.size();
+				evt_pos.num_events = 1;
+				p_track_out.events.push_back(reset_event);
+			}
+
+			evt_pos.absolute_position = abs_position;
+			abs_position += evt_pos.delay;
+			p_track_out.rows.push_back(evt_pos);
+		}
+
+		// Rows are only left unfinished at the end of the track
+		MidiTrackRow evt_pos;
+		while (abs_position <= p_until) {
+			bool has_delay = true;
+			if (midi_format == FileFormat::MUS) {
+				event = parse_mus_event(&track_ptr, end, status, p_track_out, has_delay);
+			} else {
+				event = parse_event(&track_ptr, end, status, p_track_out);
+			}
+			if (!event.is_valid) {
+				return false;
+			}
+
+			event.track = (uint16_t)p_track;
+			row_events.push_back(event);
+			if (event.type == MidiEvent::SPECIAL) {
+				switch (event.sub_type) {
+					case MidiEvent::LOOP_START:
+					case MidiEvent::LOOP_END:
+					case MidiEvent::LOOP_STACK_BEGIN:
+					case MidiEvent::LOOP_STACK_END:
+					case MidiEvent::LOOP_STACK_BREAK: {
+						LoopMarker marker;
+						marker.tick = abs_position;
+						marker.sub_type = event.sub_type;
+						marker.loops = event.data[0];
+						p_track_out.loop_markers.push_back(marker);
+						break;
+					}
+					default:
+						break;
+				}
+			}
 
+			if (event.sub_type != MidiEvent::END_TRACK) // Don't try to read delta after
+														// EndOfTrack event!
+			{
+				ok = true;
+				evt_pos.delay = has_delay ? read_variable_length_value(&track_ptr, end, ok) : 0;
+				if (!ok) {
+					/* End of track has been reached! However, there is no EOT
+					 * event presented */
+					event.type = MidiEvent::SPECIAL;
+					event.sub_type = MidiEvent::END_TRACK;
+				}
+			}
+
+			if ((evt_pos.delay > 0) || (event.sub_type == MidiEvent::END_TRACK)) {
+				evt_pos.absolute_position = abs_position;
+				abs_position += evt_pos.delay;
+				p_sorter.sort(row_events, p_track_out.note_states);
+				evt_pos.first_event = p_track_out.events.size();
+				evt_pos.num_events = (uint32_t)row_events.size();
+				p_track_out.events.insert(p_track_out.events.end(), row_events.begin(), row_events.end());
+				p_track_out.rows.push_back(evt_pos);
+				evt_pos = MidiTrackRow();
+				row_events.clear();
+			}
+			if ((track_ptr > end) || (event.sub_type == MidiEvent::END_TRACK)) {
+				p_track_out.ended = true;
+				break;
+			}
+		}
+
+		p_track_out.read_pos = (size_t)(track_ptr - p_data.data);
+		p_track_out.status = status;
+		p_track_out.length = abs_position;
 		return true;
 	}
 
-	void build_timeline(const std::vector<MidiEvent> &p_tempos, uint64_t p_loop_start_ticks, uint64_t p_loop_end_ticks) {
-		const size_t track_count = midi_track_data.size();
-		/********************************************************************************/
-		// Calculate time basing on collected tempo events
-		/********************************************************************************/
+	// Sets every track due on the first tick, before any row is merged
+	void start_merge() {
+		SongLoader &loader = midi_loader;
+		const size_t track_count = loader.tracks.size();
+		loader.due.resize(track_count);
 		for (size_t tk = 0; tk < track_count; ++tk) {
-			FixedFraction current_tempo = midi_tempo;
-			double time = 0.0;
-			size_t tempo_change_index = 0;
-			std::list<MidiTrackRow> &track = midi_track_data[tk];
-			if (track.empty()) {
-				continue; // Empty track is useless!
-			}
-
-			MidiTrackRow *pos_prev = &(*(track.begin())); // First element
-			for (std::list<MidiTrackRow>::iterator it = track.begin(); it != track.end(); ++it) {
-				MidiTrackRow &pos = *it;
-				if ((pos_prev != &pos) && // Skip first event
-						(!p_tempos.empty()) && // Only when in-track tempo events are
-											   // available
-						(tempo_change_index < p_tempos.size())) {
-					// If tempo event is going between of current and previous event
-					if (p_tempos[tempo_change_index].absolute_tick_position <= pos.absolute_position) {
-						// Stop points: begin point and tempo change points are
-						// before end point
-						std::vector<TempoChangePoint> points;
-						FixedFraction t;
-						TempoChangePoint first_point = { pos_prev->absolute_position, current_tempo };
-						points.push_back(first_point);
-
-						// Collect tempo change points between previous and current
-						// events
-						do {
-							TempoChangePoint tempo_marker;
-							const MidiEvent &tempo_point = p_tempos[tempo_change_index];
-							tempo_marker.absolute_position = tempo_point.absolute_tick_position;
-							tempo_marker.tempo =
-									midi_individual_tick_delta *
-									FixedFraction(read_int_big_endian(tempo_point.data.data(), tempo_point.data.size()));
-							points.push_back(tempo_marker);
-							tempo_change_index++;
-						} while ((tempo_change_index < p_tempos.size()) &&
-								(p_tempos[tempo_change_index].absolute_tick_position <= pos.absolute_position));
-
-						// Re-calculate time delay of previous event
-						time -= pos_prev->time_delay;
-						pos_prev->time_delay = 0.0;
-
-						for (size_t i = 0, j = 1; j < points.size(); i++, j++) {
-							/* If one or more tempo events are appears between of
-							 * two events, calculate delays between each tempo
-							 * point, begin and end */
-							uint64_t mid_delay = 0;
-							// Delay between points
-							mid_delay = points[j].absolute_position - points[i].absolute_position;
-							// Time delay between points
-							t = current_tempo * mid_delay;
-							pos_prev->time_delay += t.value();
-
-							// Apply next tempo
-							current_tempo = points[j].tempo;
+			loader.due[tk].tick = 0;
+			loader.due[tk].track = tk;
+		}
+		loader.positions.assign(track_count, 0);
+		loader.visit_again.clear();
+		loader.visit_next.clear();
+		loader.row = MidiTrackRow();
+	}
+
+	// Merges the rows of every track due up to p_until ticks into midi_rows, one row per tick.
+	// The events keep their track and are laid out in the order the tracks used to be visited in
+	// when each of them was played from its own position, so playback only has to walk the rows.
+	// Every track must have been read past p_until, or to its end
+	void merge_rows(uint64_t p_until) {
+		SongLoader &loader = midi_loader;
+		std::vector<DueTrack> &due = loader.due;
+		std::vector<size_t> &positions = loader.positions;
+		std::vector<size_t> &visit_again = loader.visit_again;
+		std::vector<size_t> &visit_next = loader.visit_next;
+		MidiTrackRow &row = loader.row;
+
+		while (!due.empty() && due[0].tick <= p_until) {
+			const uint64_t tick = due[0].tick;
+			// Visit every track due on this tick, in order
+			while (!due.empty() && due[0].tick == tick) {
+				const size_t tk = due[0].track;
+				uint64_t next_tick = 0;
+				switch (visit_track(loader.tracks[tk], positions[tk], tick, next_tick)) {
+					case TrackVisit::DUE:
+						due[0].tick = next_tick;
+						sift_down(due, 0);
+						break;
+					case TrackVisit::DUE_AGAIN:
+						visit_again.push_back(tk);
+						pop_due(due);
+						break;
+					case TrackVisit::ENDED:
+						pop_due(due);
+						break;
+					case TrackVisit::RAN_OUT:
+						// the tracks after it are put off until the next visit
+						pop_due(due);
+						while (!due.empty() && due[0].tick == tick) {
+							visit_again.push_back(due[0].track);
+							pop_due(due);
 						}
-						// Then calculate time between last tempo change point and
-						// end point
-						TempoChangePoint tail_tempo = points.back();
-						uint64_t post_delay = pos.absolute_position - tail_tempo.absolute_position;
-						t = current_tempo * post_delay;
-						pos_prev->time_delay += t.value();
-
-						// Store Common time delay
-						pos_prev->time = time;
-						time += pos_prev->time_delay;
-					}
+						break;
 				}
-
-				FixedFraction t = current_tempo * pos.delay;
-				pos.time_delay = t.value();
-				pos.time = time;
-				time += pos.time_delay;
-
-				// Capture loop points time positions
-				if (!midi_loop.invalid_loop) {
-					// Set loop points times
-					if (p_loop_start_ticks == pos.absolute_position) {
-						midi_loop_start_time = pos.time;
-					} else if (p_loop_end_ticks == pos.absolute_position) {
-						midi_loop_end_time = pos.time;
+			}
+			// A track with more rows on this tick, usually a zero delay after its first row,
+			// waits for the next visit
+			while (!visit_again.empty()) {
+				visit_next.clear();
+				for (size_t v = 0; v < visit_again.size(); v++) {
+					const size_t tk = visit_again[v];
+					uint64_t next_tick = 0;
+					const TrackVisit visit = visit_track(loader.tracks[tk], positions[tk], tick, next_tick);
+					if (visit == TrackVisit::DUE) {
+						push_due(due, next_tick, tk);
+					} else if (visit == TrackVisit::DUE_AGAIN) {
+						visit_next.push_back(tk);
+					} else if (visit == TrackVisit::RAN_OUT) {
+						visit_next.insert(visit_next.end(), visit_again.begin() + v + 1, visit_again.end());
+						break;
 					}
 				}
-				pos_prev = &pos;
+				visit_again.swap(visit_next);
 			}
 
-			if (time > midi_full_song_time_length) {
-				midi_full_song_time_length = time;
-			}
+			row.num_events = (uint32_t)(midi_events.size() - row.first_event);
+			row.delay = due.empty() ? 0 : due[0].tick - tick;
+			midi_rows.push_back(row);
+			row.absolute_position += row.delay;
+			row.first_event = midi_events.size();
 		}
+	}
 
-		midi_full_song_time_length += midi_post_song_wait_delay;
-		// Set begin of the music
-		midi_track_begin_position = midi_current_position;
-		// Initial loop position will begin at begin of track until passing of the
-		// loop point
-		midi_loop_begin_position = midi_current_position;
-		// Set lowest level of the loop stack
-		midi_loop.stack_level = -1;
+	// Takes the next row of a track due on p_tick into midi_events, and tells when the track is
+	// due again. A track ends after an End Of Track event that no channel event follows, as
+	// handle_event sees it, or when it has no rows left
+	TrackVisit visit_track(const ParsedTrack &p_track, size_t &p_pos, uint64_t p_tick, uint64_t &p_next_tick) {
+		// Check is an end of track has been reached
+		if (p_pos == p_track.rows.size()) {
+			return TrackVisit::RAN_OUT;
+		}
 
-		// Set the count of loops
-		midi_loop.loops_count = midi_loop_count;
-		midi_loop.loops_left = midi_loop_count;
+		const MidiTrackRow &row = p_track.rows[p_pos++];
+		bool ended = false;
+		for (size_t i = row.first_event; i < row.first_event + row.num_events; i++) {
+			MidiEvent evt = p_track.events[i];
+			if (evt.data_size > sizeof(evt.data)) {
+				const uint8_t *data = p_track.event_data.data() + evt.data_offset;
+				evt.data_offset = (uint32_t)midi_event_data.size();
+				midi_event_data.insert(midi_event_data.end(), data, data + evt.data_size);
+			}
+			midi_events.push_back(evt);
+			if (evt.type == MidiEvent::SPECIAL) {
+				ended = ended || (evt.sub_type == MidiEvent::END_TRACK);
+			} else if (evt.type != MidiEvent::SYSEX && evt.type != MidiEvent::SYSEX2 &&
+					evt.type != MidiEvent::SYS_COM_SONG_SELECT && evt.type != MidiEvent::SYS_COM_SONG_POSITION_POINTER) {
+				ended = false;
+			}
+		}
+		if (ended) {
+			return TrackVisit::ENDED;
+		}
+		p_next_tick = p_tick + row.delay;
+		return row.delay > 0 ? TrackVisit::DUE : TrackVisit::DUE_AGAIN;
+	}
 
-		/********************************************************************************/
-		// Find and set proper loop points
-		/********************************************************************************/
-		if (!midi_loop.invalid_loop && !midi_current_position.track.empty()) {
-			unsigned caught_loop_starts = 0;
-			bool scan_done = false;
-			const size_t ctrack_count = midi_current_position.track.size();
-			Position row_position(midi_current_position);
-
-			while (!scan_done) {
-				const Position row_begin_position(row_position);
-
-				for (size_t tk = 0; tk < ctrack_count; ++tk) {
-					Position::TrackInfo &track = row_position.track[tk];
-					if ((track.last_handled_event >= 0) && (track.delay <= 0)) {
-						// Check is an end of track has been reached
-						if (track.pos == midi_track_data[tk].end()) {
-							track.last_handled_event = -1;
-							continue;
-						}
+	static void sift_down(std::vector<DueTrack> &p_heap, size_t p_index) {
+		const size_t size = p_heap.size();
+		const DueTrack moved = p_heap[p_index];
+		for (;;) {
+			size_t child = 2 * p_index + 1;
+			if (child >= size) {
+				break;
+			}
+			if (child + 1 < size && p_heap[child + 1] < p_heap[child]) {
+				child++;
+			}
+			if (!(p_heap[child] < moved)) {
+				break;
+			}
+			p_heap[p_index] = p_heap[child];
+			p_index = child;
+		}
+		p_heap[p_index] = moved;
+	}
 
-						for (size_t i = 0; i < track.pos->events.size(); i++) {
-							const MidiEvent &evt = track.pos->events[i];
-							if (evt.type == MidiEvent::SPECIAL && evt.sub_type == MidiEvent::LOOP_START) {
-								caught_loop_starts++;
-								scan_done = true;
-								break;
-							}
-						}
+	static void pop_due(std::vector<DueTrack> &p_heap) {
+		p_heap[0] = p_heap.back();
+		p_heap.pop_back();
+		if (!p_heap.empty()) {
+			sift_down(p_heap, 0);
+		}
+	}
 
-						if (track.last_handled_event >= 0) {
-							track.delay += track.pos->delay;
-							++track.pos;
-						}
-					}
-				}
+	static void push_due(std::vector<DueTrack> &p_heap, uint64_t p_tick, size_t p_track) {
+		DueTrack added;
+		added.tick = p_tick;
+		added.track = p_track;
+		size_t index = p_heap.size();
+		p_heap.push_back(added);
+		while (index > 0 && added < p_heap[(index - 1) / 2]) {
+			p_heap[index] = p_heap[(index - 1) / 2];
+			index = (index - 1) / 2;
+		}
+		p_heap[index] = added;
+	}
 
-				// Find a shortest delay from all track
-				uint64_t shortest_delay = 0;
-				bool shortest_delay_not_found = true;
+	// Output frames from the start of the song to p_seconds into it
+	inline uint64_t frames_at(double p_seconds) const {
+		return p_seconds > 0.0 ? (uint64_t)(p_seconds * midi_time.sample_rate + 0.5) : 0;
+	}
 
-				for (size_t tk = 0; tk < ctrack_count; ++tk) {
-					Position::TrackInfo &track = row_position.track[tk];
-					if ((track.last_handled_event >= 0) && (shortest_delay_not_found || track.delay < shortest_delay)) {
-						shortest_delay = track.delay;
-						shortest_delay_not_found = false;
-					}
+	// Times the rows merged since the last call, following the tempo changes met on the way
+	void time_rows() {
+		SongLoader &loader = midi_loader;
+		for (; loader.timed_rows < midi_rows.size(); loader.timed_rows++) {
+			MidiTrackRow &row = midi_rows[loader.timed_rows];
+			for (size_t i = row.first_event; i < row.first_event + row.num_events; i++) {
+				const MidiEvent &evt = midi_events[i];
+				if (evt.type == MidiEvent::SPECIAL && evt.sub_type == MidiEvent::TEMPO_CHANGE) {
+					loader.tempo = midi_individual_tick_delta * FixedFraction(read_int_big_endian(get_event_data(evt), evt.data_size));
 				}
+			}
 
-				// Schedule the next playevent to be processed after that delay
-				for (size_t tk = 0; tk < ctrack_count; ++tk) {
-					row_position.track[tk].delay -= shortest_delay;
-				}
+			FixedFraction t = loader.tempo * row.delay;
+			row.time_delay = t.value();
+			row.time = loader.time;
+			loader.time += row.time_delay;
+			row.frame_delay = frames_at(loader.time) - frames_at(row.time);
+		}
+	}
 
-				if (caught_loop_starts > 0) {
-					midi_loop_begin_position = row_begin_position;
-					midi_loop_begin_position.absolute_time_position = midi_loop_start_time;
-					scan_done = true;
-				}
+	// Sets the song length and the times of the loop points once every row is timed
+	void finish_timeline(uint64_t p_loop_start_ticks, uint64_t p_loop_end_ticks) {
+		midi_full_song_time_length = midi_loader.time + midi_post_song_wait_delay;
 
-				if (shortest_delay_not_found) {
+		/********************************************************************************/
+		// Find and set proper loop points
+		/********************************************************************************/
+		if (midi_loop.invalid_loop) {
+			return;
+		}
+		// Set loop points times
+		for (const MidiTrackRow &row : midi_rows) {
+			if (p_loop_start_ticks == row.absolute_position) {
+				midi_loop_start_time = row.time;
+			} else if (p_loop_end_ticks == row.absolute_position) {
+				midi_loop_end_time = row.time;
+			}
+		}
+		bool scan_done = false;
+		for (size_t r = 0; r < midi_rows.size() && !scan_done; r++) {
+			const MidiTrackRow &row = midi_rows[r];
+			for (size_t i = row.first_event; i < row.first_event + row.num_events; i++) {
+				const MidiEvent &evt = midi_events[i];
+				if (evt.type == MidiEvent::SPECIAL && evt.sub_type == MidiEvent::LOOP_START) {
+					midi_loop_begin_position.row = r;
+					midi_loop_begin_position.absolute_frame_position = frames_at(midi_loop_start_time);
+					scan_done = true;
 					break;
 				}
 			}
 		}
 	}
 
-	MidiEvent parse_event(const uint8_t **p_pptr, const uint8_t *p_end, int &p_status) {
+	// Reads the next DMX MUS event that has a MIDI equivalent as that MIDI event, and tells
+	// whether a delay follows it. The events are decoded straight from the score, one at a time
+	MidiEvent parse_mus_event(const uint8_t **p_pptr, const uint8_t *p_end, int &p_status, ParsedTrack &p_track, bool &p_has_delay) const {
+		uint8_t bytes[3];
+		size_t size;
+		do {
+			size = decode_mus_event(p_pptr, p_end, p_track.mus_volumes, bytes, p_has_delay);
+		} while (size == 0);
+		const uint8_t *ptr = bytes;
+		return parse_event(&ptr, bytes + size, p_status, p_track);
+	}
+
+	inline const uint8_t *get_event_data(const MidiEvent &p_evt) const {
+		return p_evt.data_size <= sizeof(p_evt.data) ? p_evt.data : midi_event_data.data() + p_evt.data_offset;
+	}
+
+	// Room for data_size bytes of the event's data, in the event itself when they fit
+	static uint8_t *reserve_event_data(MidiEvent &p_evt, std::vector<uint8_t> &p_event_data) {
+		if (p_evt.data_size <= sizeof(p_evt.data)) {
+			return p_evt.data;
+		}
+		p_evt.data_offset = (uint32_t)p_event_data.size();
+		p_event_data.resize(p_event_data.size() + p_evt.data_size);
+		return p_event_data.data() + p_evt.data_offset;
+	}
+
+	MidiEvent parse_event(const uint8_t **p_pptr, const uint8_t *p_end, int &p_status, ParsedTrack &p_track) const {
 		const uint8_t *&ptr = *p_pptr;
 		Sequencer::MidiEvent evt;
 
@@ -3825,11 +5563,10 @@ class Synthesizer::Sequencer {
 				return evt;
 			}
 			evt.type = MidiEvent::SYSEX;
-			evt.data.clear();
-			evt.data.push_back(byte);
-			for (uint64_t i = 0; i < length; ++i) {
-				evt.data.push_back(ptr[i]);
-			}
+			evt.data_size = (uint32_t)length + 1;
+			uint8_t *data = reserve_event_data(evt, p_track.event_data);
+			data[0] = byte;
+			memcpy(data + 1, ptr, (size_t)length);
 			ptr += (size_t)length;
 			return evt;
 		}
@@ -3842,21 +5579,14 @@ class Synthesizer::Sequencer {
 				evt.is_valid = 0;
 				return evt;
 			}
-			std::string data;
-			if (length) {
-				for (uint64_t i = 0; i < length; ++i) {
-					data += (char)ptr[i];
-				}
-			}
+			const uint8_t *payload = ptr;
 			ptr += (size_t)length;
 
 			evt.type = byte;
 			evt.sub_type = evtype;
-			for (int64_t i = 0; i < data.length(); ++i) {
-				evt.data.push_back((uint8_t)data[i]);
-			}
 
 			if (evt.sub_type == MidiEvent::MARKER) {
+				std::string data((const char *)payload, (size_t)length);
 				for (char &c : data) {
 					c = tolower(c);
 				}
@@ -3864,23 +5594,20 @@ class Synthesizer::Sequencer {
 				if (data == "loopstart") {
 					// Return a custom Loop Start event instead of Marker
 					evt.sub_type = MidiEvent::LOOP_START;
-					evt.data.clear(); // Data is not needed
-					return evt;
+					return evt; // Data is not needed
 				}
 
 				if (data == "loopend") {
 					// Return a custom Loop End event instead of Marker
 					evt.sub_type = MidiEvent::LOOP_END;
-					evt.data.clear(); // Data is not needed
-					return evt;
+					return evt; // Data is not needed
 				}
 
 				if (data.substr(0, 10) == "loopstart=") {
 					evt.type = MidiEvent::SPECIAL;
 					evt.sub_type = MidiEvent::LOOP_STACK_BEGIN;
-					uint8_t loops = (uint8_t)stoi(data.substr(10));
-					evt.data.clear();
-					evt.data.push_back(loops);
+					evt.data[0] = (uint8_t)stoi(data.substr(10));
+					evt.data_size = 1;
 
 					return evt;
 				}
@@ -3888,12 +5615,14 @@ class Synthesizer::Sequencer {
 				if (data.substr(0, 8) == "loopend=") {
 					evt.type = MidiEvent::SPECIAL;
 					evt.sub_type = MidiEvent::LOOP_STACK_END;
-					evt.data.clear();
 
 					return evt;
 				}
 			}
 
+			evt.data_size = (uint32_t)length;
+			memcpy(reserve_event_data(evt, p_track.event_data), payload, (size_t)length);
+
 			if (evtype == MidiEvent::END_TRACK) {
 				p_status = -1; // Finalize track
 			}
@@ -3914,7 +5643,8 @@ class Synthesizer::Sequencer {
 				return evt;
 			}
 			evt.type = byte;
-			evt.data.push_back(*(ptr++));
+			evt.data[0] = *(ptr++);
+			evt.data_size = 1;
 			return evt;
 		}
 
@@ -3925,8 +5655,9 @@ class Synthesizer::Sequencer {
 				return evt;
 			}
 			evt.type = byte;
-			evt.data.push_back(*(ptr++));
-			evt.data.push_back(*(ptr++));
+			evt.data[0] = *(ptr++);
+			evt.data[1] = *(ptr++);
+			evt.data_size = 2;
 			return evt;
 		}
 
@@ -3946,8 +5677,9 @@ class Synthesizer::Sequencer {
 					return evt;
 				}
 
-				evt.data.push_back(*(ptr++));
-				evt.data.push_back(*(ptr++));
+				evt.data[0] = *(ptr++);
+				evt.data[1] = *(ptr++);
+				evt.data_size = 2;
 
 				if ((ev_type == MidiEvent::NOTE_ON) && (evt.data[1] == 0)) {
 					evt.type = MidiEvent::NOTE_OFF; // Note ON with zero velocity
@@ -3955,40 +5687,44 @@ class Synthesizer::Sequencer {
 				} else if (ev_type == MidiEvent::CONTROL_CHANGE) {
 					// 111'th loopStart controller (RPG Maker and others)
 					if (midi_format == FileFormat::MIDI) {
+						LoopFormat &loop_format = p_track.loop_format;
 						switch (evt.data[0]) {
 							case 110:
-								if (midi_loop_format == LoopFormat::DEFAULT) {
+								p_track.has_loop_controllers = true;
+								if (loop_format == LoopFormat::DEFAULT) {
 									// Change event type to custom Loop Start event
 									// and clear data
 									evt.type = MidiEvent::SPECIAL;
 									evt.sub_type = MidiEvent::LOOP_START;
-									evt.data.clear();
-									midi_loop_format = LoopFormat::HMI;
-								} else if (midi_loop_format == LoopFormat::HMI) {
+									evt.data_size = 0;
+									loop_format = LoopFormat::HMI;
+								} else if (loop_format == LoopFormat::HMI) {
 									// Repeating of 110'th point is BAD practice,
 									// treat as EMIDI
-									midi_loop_format = LoopFormat::EMIDI;
+									loop_format = LoopFormat::EMIDI;
 								}
 								break;
 
 							case 111:
-								if (midi_loop_format == LoopFormat::HMI) {
+								p_track.has_loop_controllers = true;
+								if (loop_format == LoopFormat::HMI) {
 									// Change event type to custom Loop End event
 									// and clear data
 									evt.type = MidiEvent::SPECIAL;
 									evt.sub_type = MidiEvent::LOOP_END;
-									evt.data.clear();
-								} else if (midi_loop_format != LoopFormat::EMIDI) {
+									evt.data_size = 0;
+								} else if (loop_format != LoopFormat::EMIDI) {
 									// Change event type to custom Loop Start event
 									// and clear data
 									evt.type = MidiEvent::SPECIAL;
 									evt.sub_type = MidiEvent::LOOP_START;
-									evt.data.clear();
+									evt.data_size = 0;
 								}
 								break;
 
 							case 113:
-								if (midi_loop_format == LoopFormat::EMIDI) {
+								p_track.has_loop_controllers = true;
+								if (loop_format == LoopFormat::EMIDI) {
 									// EMIDI does using of CC113 with same purpose
 									// as CC7
 									evt.data[0] = 7;
@@ -4005,7 +5741,8 @@ class Synthesizer::Sequencer {
 					evt.is_valid = 0;
 					return evt;
 				}
-				evt.data.push_back(*(ptr++));
+				evt.data[0] = *(ptr++);
+				evt.data_size = 1;
 				return evt;
 			default:
 				break;
@@ -4015,7 +5752,11 @@ class Synthesizer::Sequencer {
 	}
 
 	bool process_events() {
-		if (midi_current_position.track.empty()) {
+		// Rows still to be loaded are read when playback gets to them
+		while (midi_loader.active && midi_current_position.row >= midi_rows.size()) {
+			load_song_part();
+		}
+		if (midi_rows.empty()) {
 			midi_at_end = true; // No MIDI track data to play
 		}
 		if (midi_at_end) {
@@ -4023,88 +5764,61 @@ class Synthesizer::Sequencer {
 		}
 
 		midi_loop.caught_end = false;
-		const size_t track_count = midi_current_position.track.size();
 		const Position row_begin_position(midi_current_position);
-		bool do_loop_jump = false;
 		unsigned caught_loop_starts = 0;
 		unsigned caught_loop_stack_starts = 0;
 		unsigned caught_loop_stack_ends = 0;
 		unsigned caught_loop_stack_breaks = 0;
 
-		for (size_t tk = 0; tk < track_count; ++tk) {
-			Position::TrackInfo &track = midi_current_position.track[tk];
-			if ((track.last_handled_event >= 0) && (track.delay <= 0)) {
-				// Check is an end of track has been reached
-				if (track.pos == midi_track_data[tk].end()) {
-					track.last_handled_event = -1;
-					break;
-				}
-
-				// Handle event
-				for (size_t i = 0; i < track.pos->events.size(); i++) {
-					const MidiEvent &evt = track.pos->events[i];
-
-					handle_event(tk, evt, track.last_handled_event);
-
-					if (midi_loop.caught_start) {
-						caught_loop_starts++;
-						midi_loop.caught_start = false;
-					}
-
-					if (midi_loop.caught_stack_start) {
-						caught_loop_stack_starts++;
-						midi_loop.caught_stack_start = false;
-					}
+		// Take the next row; a seek past the song end leaves none, which ends the song below
+		size_t first_event = 0, end_event = 0;
+		uint64_t frame_delay = 0;
+		if (midi_current_position.row < midi_rows.size()) {
+			const MidiTrackRow &row = midi_rows[midi_current_position.row++];
+			first_event = row.first_event;
+			end_event = row.first_event + row.num_events;
+			frame_delay = row.frame_delay;
+		}
 
-					if (midi_loop.caught_stack_break) {
-						caught_loop_stack_breaks++;
-						midi_loop.caught_stack_break = false;
-					}
+		// Handle events
+		int32_t status = 0;
+		for (size_t i = first_event; i < end_event; i++) {
+			const MidiEvent &evt = midi_events[i];
 
-					if (midi_loop.caught_end || midi_loop.is_stack_end()) {
-						if (midi_loop.caught_stack_end) {
-							midi_loop.caught_stack_end = false;
-							caught_loop_stack_ends++;
-						}
-						do_loop_jump = true;
-						break; // Stop event handling on catching loopEnd event!
-					}
-				}
+			handle_event(evt.track, evt, status);
 
-				// Read next event time (unless the track just ended)
-				if (track.last_handled_event >= 0) {
-					track.delay += track.pos->delay;
-					++track.pos;
-				}
+			if (midi_loop.caught_start) {
+				caught_loop_starts++;
+				midi_loop.caught_start = false;
+			}
 
-				if (do_loop_jump) {
-					break;
-				}
+			if (midi_loop.caught_stack_start) {
+				caught_loop_stack_starts++;
+				midi_loop.caught_stack_start = false;
 			}
-		}
 
-		// Find a shortest delay from all track
-		uint64_t shortest_delay = 0;
-		bool shortest_delay_not_found = true;
+			if (midi_loop.caught_stack_break) {
+				caught_loop_stack_breaks++;
+				midi_loop.caught_stack_break = false;
+			}
 
-		for (size_t tk = 0; tk < track_count; ++tk) {
-			Position::TrackInfo &track = midi_current_position.track[tk];
-			if ((track.last_handled_event >= 0) && (shortest_delay_not_found || track.delay < shortest_delay)) {
-				shortest_delay = track.delay;
-				shortest_delay_not_found = false;
+			if (midi_loop.caught_end || midi_loop.is_stack_end()) {
+				if (midi_loop.caught_stack_end) {
+					midi_loop.caught_stack_end = false;
+					caught_loop_stack_ends++;
+				}
+				break; // Stop event handling on catching loopEnd event!
 			}
 		}
 
-		// Schedule the next playevent to be processed after that delay
-		for (size_t tk = 0; tk < track_count; ++tk) {
-			midi_current_position.track[tk].delay -= shortest_delay;
+		// Schedule the next row to be processed after its delay
+		while (midi_loader.active && midi_current_position.row >= midi_rows.size()) {
+			load_song_part();
 		}
+		const bool song_ended = midi_current_position.row == midi_rows.size();
+		midi_current_position.wait += (int64_t)frame_delay;
 
-		FixedFraction t = midi_tempo * shortest_delay;
-
-		midi_current_position.wait += t.value();
-
-		if (caught_loop_starts > 0 && midi_loop_begin_position.absolute_time_position <= 0.0) {
+		if (caught_loop_starts > 0 && midi_loop_begin_position.absolute_frame_position == 0) {
 			midi_loop_begin_position = row_begin_position;
 		}
 
@@ -4136,7 +5850,7 @@ class Synthesizer::Sequencer {
 					midi_current_position = s.start_position;
 					midi_loop.skip_stack_start = true;
 
-					for (Synthesizer::Channel *channel : midi_synth->channels) {
+					for (Synthesizer::Channel *channel : midi_channels) {
 						channel->control_change(123, 0);
 					}
 
@@ -4147,7 +5861,7 @@ class Synthesizer::Sequencer {
 						midi_current_position = s.start_position;
 						midi_loop.skip_stack_start = true;
 
-						for (Channel *channel : midi_synth->channels) {
+						for (Channel *channel : midi_channels) {
 							channel->control_change(123, 0);
 						}
 
@@ -4166,19 +5880,18 @@ class Synthesizer::Sequencer {
 			return true;
 		}
 
-		if (shortest_delay_not_found || midi_loop.caught_end) {
-			for (Synthesizer::Channel *channel : midi_synth->channels) {
+		if (song_ended || midi_loop.caught_end) {
+			for (Synthesizer::Channel *channel : midi_channels) {
 				channel->control_change(123, 0);
 			}
 
 			// Loop if song end or loop end point has reached
 			midi_loop.caught_end = false;
-			shortest_delay = 0;
 
 			if (!midi_loop_enabled ||
-					(shortest_delay_not_found && midi_loop.loops_count >= 0 && midi_loop.loops_left < 1)) {
+					(song_ended && midi_loop.loops_count >= 0 && midi_loop.loops_left < 1)) {
 				midi_at_end = true; // Don't handle events anymore
-				midi_current_position.wait += midi_post_song_wait_delay; // One second delay until stop
+				midi_current_position.wait += (int64_t)frames_at(midi_post_song_wait_delay); // One second delay until stop
 																		 // playing
 				return true; // We have caugh end here!
 			}
@@ -4216,17 +5929,17 @@ class Synthesizer::Sequencer {
 	void handle_event(size_t p_track, const Sequencer::MidiEvent &p_evt, int32_t &p_status) {
 		if (p_evt.type == MidiEvent::SYSEX || p_evt.type == MidiEvent::SYSEX2) // Ignore SysEx
 		{
-			const char *data = (const char *)p_evt.data.data();
-			size_t length = (size_t)p_evt.data.size();
+			const char *data = (const char *)get_event_data(p_evt);
+			size_t length = (size_t)p_evt.data_size;
 			if (match_sysex(data, length, GM_SYSTEM_ON, 6)) {
-				midi_synth->standard = Synthesizer::Standard::GM;
+				midi_standard = Synthesizer::Standard::GM;
 			} else if (match_sysex(data, length, GM_SYSTEM_OFF, 6)) {
-				midi_synth->standard = Synthesizer::Standard::GM; // Our default is GM, so set it here too
+				midi_standard = Synthesizer::Standard::GM; // Our default is GM, so set it here too
 			} else if (match_sysex(data, length, GS_RESET, 11) || match_sysex(data, length, GS_SYSTEM_MODE_SET1, 11) ||
 					match_sysex(data, length, GS_SYSTEM_MODE_SET2, 11)) {
-				midi_synth->standard = Synthesizer::Standard::GS;
+				midi_standard = Synthesizer::Standard::GS;
 			} else if (match_sysex(data, length, XG_SYSTEM_ON, 9)) {
-				midi_synth->standard = Synthesizer::Standard::XG;
+				midi_standard = Synthesizer::Standard::XG;
 			}
 			return;
 		}
@@ -4234,8 +5947,8 @@ class Synthesizer::Sequencer {
 		if (p_evt.type == MidiEvent::SPECIAL) {
 			// Special event FF
 			uint_fast16_t evtype = p_evt.sub_type;
-			uint64_t length = (uint64_t)(p_evt.data.size());
-			const char *data(length ? (const char *)(p_evt.data.data()) : "\0\0\0\0\0\0\0\0");
+			uint64_t length = (uint64_t)p_evt.data_size;
+			const char *data(length ? (const char *)get_event_data(p_evt) : "\0\0\0\0\0\0\0\0");
 
 			if (evtype == MidiEvent::END_TRACK) // End Of Track
 			{
@@ -4246,7 +5959,7 @@ class Synthesizer::Sequencer {
 			if (evtype == MidiEvent::TEMPO_CHANGE) // Tempo change
 			{
 				midi_tempo =
-						midi_individual_tick_delta * FixedFraction(read_int_big_endian(p_evt.data.data(), p_evt.data.size()));
+						midi_individual_tick_delta * FixedFraction(read_int_big_endian(get_event_data(p_evt), p_evt.data_size));
 				return;
 			}
 
@@ -4326,7 +6039,7 @@ class Synthesizer::Sequencer {
 				if (channel_disabled[mid_ch]) {
 					break; // Disabled channel
 				}
-				midi_synth->channels[mid_ch]->note_off(p_evt.data[0]);
+				midi_channels[mid_ch]->note_off(p_evt.data[0]);
 				break;
 			}
 
@@ -4335,27 +6048,27 @@ class Synthesizer::Sequencer {
 				if (channel_disabled[mid_ch]) {
 					break; // Disabled channel
 				}
-				midi_synth->channels[mid_ch]->note_on(p_evt.data[0], p_evt.data[1]);
+				midi_channels[mid_ch]->note_on(p_evt.data[0], p_evt.data[1]);
 				break;
 			}
 
 			case MidiEvent::NOTE_TOUCH: // Note touch
 			{
-				midi_synth->channels[mid_ch]->key_pressure(p_evt.data[0], p_evt.data[1]);
+				midi_channels[mid_ch]->key_pressure(p_evt.data[0], p_evt.data[1]);
 				break;
 			}
 
 			case MidiEvent::CONTROL_CHANGE: // Controller change
 			{
-				midi_synth->channels[mid_ch]->control_change(p_evt.data[0], p_evt.data[1]);
+				midi_channels[mid_ch]->control_change(p_evt.data[0], p_evt.data[1]);
 				break;
 			}
 
 			case MidiEvent::PATCH_CHANGE: // Patch change
 			{
-				const Channel::Bank midiBank = midi_synth->channels[mid_ch]->get_bank();
+				const Channel::Bank midiBank = midi_channels[mid_ch]->get_bank();
 				uint16_t sfBank = 0;
-				switch (midi_synth->standard) {
+				switch (midi_standard) {
 					case Synthesizer::Standard::GS:
 						sfBank = midiBank.msb;
 						break;
@@ -4368,20 +6081,20 @@ class Synthesizer::Sequencer {
 					default:
 						break;
 				}
-				midi_synth->channels[mid_ch]->set_preset(
+				midi_channels[mid_ch]->set_preset(
 						midi_synth->find_preset(mid_ch == PERCUSSION_CHANNEL ? PERCUSSION_BANK : sfBank, p_evt.data[0]));
 				break;
 			}
 
 			case MidiEvent::CHANNEL_TOUCH: // Channel after-touch
 			{
-				midi_synth->channels[mid_ch]->channel_pressure(p_evt.data[0]);
+				midi_channels[mid_ch]->channel_pressure(p_evt.data[0]);
 				break;
 			}
 
 			case MidiEvent::PITCH_WHEEL: // Wheel/pitch bend
 			{
-				midi_synth->channels[mid_ch]->pitch_bend(((uint16_t)p_evt.data[1] << 7) + (uint16_t)p_evt.data[0]);
+				midi_channels[mid_ch]->pitch_bend(((uint16_t)p_evt.data[1] << 7) + (uint16_t)p_evt.data[0]);
 				break;
 			}
 
@@ -4395,7 +6108,9 @@ public:
 		//! MIDI format
 		MIDI,
 		//! EA-MUS format
-		RSXX
+		RSXX,
+		//! DMX MUS format
+		MUS
 	};
 
 	enum class LoopFormat {
@@ -4406,6 +6121,66 @@ public:
 	};
 
 private:
+	//! A loop event of a track, kept to find the loop points once every track is read
+	struct LoopMarker {
+		uint64_t tick;
+		uint16_t sub_type;
+		uint8_t loops;
+	};
+	// One track as read from the file. Tracks are read on their own, possibly at the same time,
+	// so each keeps its own events until they are merged
+	struct ParsedTrack {
+		std::vector<MidiTrackRow> rows;
+		std::vector<MidiEvent> events;
+		//! Data of the track's events that does not fit in a MidiEvent
+		std::vector<uint8_t> event_data;
+		std::vector<LoopMarker> loop_markers;
+		//! Tick after the last row read
+		uint64_t length = 0;
+		//! Where reading goes on from, with the running status there
+		size_t read_pos = 0;
+		int status = 0;
+		bool ended = false;
+		//! Notes left on by the rows read
+		std::bitset<MIDI_NOTE_COUNT> note_states;
+		//! Last note volume of each channel of a DMX MUS score
+		uint8_t mus_volumes[NUM_CHANNELS] = {};
+		//! Loop format after the track, which only loop controllers (CC 110, 111 and 113) change
+		LoopFormat loop_format = LoopFormat::DEFAULT;
+		bool has_loop_controllers = false;
+	};
+	// The bytes of one track: the song's own memory when it is loaded from memory, or a copy
+	// when it is read from a file or needs an end of track added
+	struct TrackData {
+		const uint8_t *data = nullptr;
+		size_t size = 0;
+		std::vector<uint8_t> copy;
+	};
+	// A song being read, merged and timed a part at a time, or all at once
+	struct SongLoader {
+		//! Loading goes on as the song plays
+		bool active = false;
+		std::vector<TrackData> track_data;
+		std::vector<ParsedTrack> tracks;
+		RowSorter sorter;
+		//! Tracks by the tick their next row is due at, then by index, as a min-heap
+		std::vector<DueTrack> due;
+		std::vector<size_t> positions;
+		//! Tracks to visit again on the same tick, in order, and the ones after those
+		std::vector<size_t> visit_again, visit_next;
+		//! Next row to merge
+		MidiTrackRow row;
+		//! Tick the tracks are read up to, and how far each part reads on
+		uint64_t horizon = 0;
+		uint64_t step = 1;
+		//! Tempo and time after the rows timed so far
+		FixedFraction tempo;
+		double time = 0.0;
+		size_t timed_rows = 0;
+	};
+	//! Seconds of song read on by each part when loading a part at a time
+	static constexpr double LOAD_STEP_SECONDS = 0.5;
+
 	//! Music file format type. MIDI is default.
 	FileFormat midi_format;
 	//! SMF format identifier.
@@ -4433,16 +6208,22 @@ private:
 	//! Global loop end time
 	double midi_loop_end_time;
 
-	//! Pre-processed track data storage
-	std::vector<std::list<MidiTrackRow>> midi_track_data;
+	//! Pre-processed song data: the rows of all tracks merged in playback order
+	std::vector<MidiTrackRow> midi_rows;
+	//! Events of every row, in row order
+	std::vector<MidiEvent> midi_events;
+	//! Event data that does not fit in a MidiEvent
+	std::vector<uint8_t> midi_event_data;
+	//! The song while it is loaded
+	SongLoader midi_loader;
 
 	//! Time of one tick
 	FixedFraction midi_individual_tick_delta;
 	//! Current tempo
 	FixedFraction midi_tempo;
+	//! Tempo at the start of the song
+	FixedFraction midi_start_tempo;
 
-	//! Tempo multiplier factor
-	double midi_tempo_multiplier;
 	//! Is song at end
 	bool midi_at_end;
 
@@ -4450,6 +6231,12 @@ private:
 	int midi_loop_count;
 
 	Synthesizer *midi_synth;
+	//! Channels the song plays on, which draw their voices from the Synthesizer's shared pool
+	std::vector<Channel *> midi_channels;
+	//! MIDI standard the song selected with its SysEx messages
+	Standard midi_standard;
+	//! Volume of the song, which its voices are scaled by as they are mixed
+	float midi_volume;
 	struct LoopStackEntry {
 		//! is infinite loop
 		bool infinity = false;
@@ -4558,97 +6345,79 @@ private:
 	bool channel_disabled[16];
 	class SequencerTime {
 	public:
-		//! Time buffer
-		double time_rest;
+		//! Frames left to render before the next events are due
+		uint64_t frames_rest;
 		//! Sample rate
 		uint32_t sample_rate;
-		//! Size of one frame in bytes
-		uint32_t frame_size;
-		//! Minimum possible delay, granuality
-		double minimum_delay;
-		//! Last delay
-		double delay;
-
-		void init(uint32_t p_rate, uint32_t p_frame_size) {
+		//! Last delay in frames
+		uint64_t delay;
+
+		void init(uint32_t p_rate) {
 			sample_rate = p_rate;
-			frame_size = p_frame_size;
 			reset();
 		}
 
 		void reset() {
-			time_rest = 0.0;
-			minimum_delay = 1.0 / (double)(sample_rate);
-			delay = 0.0;
+			frames_rest = 0;
+			delay = 0;
 		}
 	};
 
 	SequencerTime midi_time;
 
 public:
-	Sequencer(uint32_t p_rate, uint32_t p_frame_size, Synthesizer *p_synth) :
-			midi_format(FileFormat::MIDI), midi_smf_format(0), midi_loop_format(LoopFormat::DEFAULT), midi_loop_enabled(false), midi_full_song_time_length(0.0), midi_post_song_wait_delay(1.0), midi_loop_start_time(-1.0), midi_loop_end_time(-1.0), midi_tempo_multiplier(1.0), midi_at_end(false), midi_loop_count(-1), midi_synth(p_synth) {
+	Sequencer(uint32_t p_rate, Synthesizer *p_synth) :
+			midi_format(FileFormat::MIDI), midi_smf_format(0), midi_loop_format(LoopFormat::DEFAULT), midi_loop_enabled(false), midi_full_song_time_length(0.0), midi_post_song_wait_delay(1.0), midi_loop_start_time(-1.0), midi_loop_end_time(-1.0), midi_at_end(false), midi_loop_count(-1), midi_synth(p_synth), midi_standard(Standard::GM), midi_volume(1.0f) {
 		midi_loop.reset();
 		midi_loop.invalid_loop = false;
-		midi_time.init(p_rate, p_frame_size);
+		midi_time.init(p_rate);
+
+		midi_channels.reserve(NUM_CHANNELS);
+		for (size_t i = 0; i < NUM_CHANNELS; ++i) {
+			midi_channels.push_back(new Channel(i, p_synth->voice_pool, &midi_volume));
+		}
 	}
 
 	~Sequencer() {
+		for (Channel *channel : midi_channels) {
+			delete channel;
+		}
 	}
 
-	int play_stream(uint8_t *p_stream, size_t p_length) {
-		int count = 0;
-		size_t samples = (size_t)(p_length / (size_t)(midi_time.frame_size));
-		size_t left = samples;
-		size_t period_size = 0;
-		uint8_t *stream_pos = p_stream;
-
-		while (left > 0) {
-			const double left_delay = left / double(midi_time.sample_rate);
-			const double max_delay = midi_time.time_rest < left_delay ? midi_time.time_rest : left_delay;
-			if ((position_at_end()) && (midi_time.delay <= 0.0)) {
-				break; // Stop to fetch samples at reaching the song end with
-					   // disabled loop
-			}
-
-			midi_time.time_rest -= max_delay;
-			period_size = (size_t)((double)(midi_time.sample_rate) * max_delay);
-
-			if (p_stream) {
-				size_t generate_size = period_size > left ? (size_t)(left) : (size_t)(period_size);
-				float *buffer = (float *)stream_pos;
-				for (size_t samp = 0; samp < generate_size * midi_time.frame_size / sizeof(float); samp += 2) {
-					StereoValue sum{ 0.0f, 0.0f };
-					for (Voice *voice : midi_synth->voices) {
-						Synthesizer::Voice::State status = voice->get_status();
-						if (status == Synthesizer::Voice::State::FINISHED ||
-								status == Synthesizer::Voice::State::UNUSED) {
-							continue;
-						}
-						voice->update();
-						if (voice->get_status() == Synthesizer::Voice::State::FINISHED) {
-							continue;
-						}
-						sum += voice->render();
-					}
-					sum = sum * midi_synth->volume;
-					buffer[samp] = sum.left;
-					buffer[samp + 1] = sum.right;
-				}
-				stream_pos += generate_size * midi_time.frame_size;
-				count += generate_size;
-				left -= generate_size;
-				if (left > samples) { // shouldn't happen, but catch just in case
-					left = samples;
-				}
-			}
+	// A song loaded a part at a time reads on by one part every play_stream call, to keep ahead
+	// of playback
+	void read_ahead() {
+		if (midi_loader.active) {
+			load_song_part();
+		}
+	}
 
-			if (midi_time.time_rest <= 0.0) {
-				midi_time.delay = tick(midi_time.delay, midi_time.minimum_delay);
-				midi_time.time_rest += midi_time.delay;
-			}
+	// False once the song has stopped at its end with the wait after it played out
+	inline bool is_playing() const {
+		return !midi_at_end || midi_time.delay != 0;
+	}
+
+	// Frames that can be rendered before the next row is due. Every row is due on a whole frame,
+	// so the frames up to it are rendered exactly
+	inline uint64_t frames_until_due() const {
+		return midi_time.frames_rest;
+	}
+
+	// Moves on by p_frames rendered, at most frames_until_due, playing the next rows when due
+	void advance(uint64_t p_frames) {
+		midi_time.frames_rest -= p_frames;
+		if (midi_time.frames_rest == 0) {
+			midi_time.delay = tick(midi_time.delay);
+			midi_time.frames_rest = midi_time.delay;
 		}
+	}
+
+	inline std::vector<Channel *> &get_channels() {
+		return midi_channels;
+	}
 
-		return count * (int)(midi_time.frame_size);
+	inline void set_volume(float p_volume) {
+		midi_volume = p_volume;
 	}
 
 	inline bool position_at_end() {
@@ -4657,6 +6426,7 @@ public:
 
 	bool load_midi(FileAndMemReader *p_mfr) {
 		midi_at_end = false;
+		midi_loader = SongLoader();
 		midi_loop.full_reset();
 		midi_loop.caught_start = true;
 
@@ -4689,38 +6459,12 @@ public:
 			return parse_rsxx(p_mfr);
 		}
 		if (memcmp(header_buf, "MUS\x1A", 4) == 0) {
-			// need to convert prior to parsing
 			p_mfr->seek(0, SEEK_SET);
-			FileAndMemReader *temp = nullptr;
-			FileAndMemReader *converted = nullptr;
-			if (!p_mfr->get_data()) // need to load to memory first
-			{
-				size_t raw_size = p_mfr->file_size();
-				uint8_t *raw = (uint8_t *)malloc(raw_size);
-				p_mfr->read(raw, 1, p_mfr->file_size());
-				temp = new FileAndMemReader;
-				temp->open_data(raw, raw_size);
-			}
-			if (temp) {
-				converted = mus_to_midi(temp);
-			} else {
-				converted = mus_to_midi(p_mfr);
-			}
-			if (!converted) {
-				if (temp) {
-					temp->close(true);
-					delete temp;
-				}
-				return false;
-			}
-			bool result = parse_smf(converted);
-			if (temp) {
-				temp->close(true);
-				delete temp;
-			}
-			converted->close(true);
-			delete converted;
-			return result;
+			return parse_mus(p_mfr);
+		}
+		if (memcmp(header_buf, COMPILED_SONG_MAGIC, 4) == 0) {
+			p_mfr->seek(0, SEEK_SET);
+			return parse_compiled(p_mfr);
 		}
 
 		return false;
@@ -4735,35 +6479,104 @@ public:
 		midi_smf_format = 0;
 	}
 
-	double tick(double p_s, double p_granularity) {
-		p_s *= midi_tempo_multiplier;
-		midi_current_position.wait -= p_s;
-		midi_current_position.absolute_time_position += p_s;
+	// Moves playback on by p_frames, plays the rows that are due by then, and returns the
+	// frames until the next row is due
+	uint64_t tick(uint64_t p_frames) {
+		midi_current_position.wait -= (int64_t)p_frames;
+		midi_current_position.absolute_frame_position += p_frames;
 
 		int anti_freeze_counter = 10000; // Limit 10000 loops to avoid freezing
-		while ((midi_current_position.wait <= p_granularity * 0.5) && (anti_freeze_counter > 0)) {
+		while ((midi_current_position.wait <= 0) && (anti_freeze_counter > 0)) {
 			if (!process_events()) {
 				break;
 			}
-			if (midi_current_position.wait <= 0.0) {
+			if (midi_current_position.wait <= 0) {
 				anti_freeze_counter--;
 			}
 		}
 
 		if (anti_freeze_counter <= 0) {
-			midi_current_position.wait += 1.0; /* Add extra 1 second when over 10000 events
-												with zero delay are been detected */
+			midi_current_position.wait += midi_time.sample_rate; /* Add extra 1 second when over 10000 events
+																	with zero delay are been detected */
 		}
 
-		if (midi_current_position.wait < 0.0) { // Avoid negative delay value!
-			return 0.0;
+		if (midi_current_position.wait < 0) { // Avoid negative delay value!
+			return 0;
+		}
+
+		return (uint64_t)midi_current_position.wait;
+	}
+
+	// Length of the song in seconds, with the wait after it, or -1 while it is still loading
+	double get_song_length() const {
+		return midi_loader.active ? -1.0 : midi_full_song_time_length;
+	}
+
+	// Writes the song as it was loaded, merged and timed with its loop points found, for
+	// parse_compiled to load it back without reading its tracks. A song still loading is
+	// finished first. Fails when no song is loaded
+	bool save_compiled(std::vector<uint8_t> &p_out) {
+		if (midi_loader.active) {
+			finish_loading(midi_synth->load_threads);
+		}
+		if (midi_rows.empty()) {
+			return false;
 		}
 
-		return midi_current_position.wait;
+		CompiledSongHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.id, COMPILED_SONG_MAGIC, 4);
+		header.byte_order = COMPILED_SONG_BYTE_ORDER;
+		header.version = COMPILED_SONG_VERSION;
+		header.format = (uint8_t)midi_format;
+		header.smf_format = (uint8_t)midi_smf_format;
+		header.loop_format = (uint8_t)midi_loop_format;
+		header.invalid_loop = midi_loop.invalid_loop ? 1 : 0;
+		header.tick_delta_num = midi_individual_tick_delta.nom();
+		header.tick_delta_den = midi_individual_tick_delta.denom();
+		header.tempo_num = midi_start_tempo.nom();
+		header.tempo_den = midi_start_tempo.denom();
+		header.length = midi_full_song_time_length;
+		header.loop_start_time = midi_loop_start_time;
+		header.loop_end_time = midi_loop_end_time;
+		header.loop_begin_row = midi_loop_begin_position.row;
+		header.loop_begin_time = midi_loop_begin_position.absolute_frame_position / (double)midi_time.sample_rate;
+		header.row_count = midi_rows.size();
+		header.event_count = midi_events.size();
+		header.event_data_size = midi_event_data.size();
+		header.loop_stack_size = midi_loop.stack.size();
+
+		p_out.resize(sizeof(header) + midi_rows.size() * sizeof(CompiledSongRow) + midi_events.size() * sizeof(CompiledSongEvent) +
+				midi_event_data.size() + midi_loop.stack.size() * sizeof(CompiledSongLoop));
+		uint8_t *ptr = p_out.data();
+		memcpy(ptr, &header, sizeof(header));
+		ptr += sizeof(header);
+		for (const MidiTrackRow &row : midi_rows) {
+			const CompiledSongRow record = { row.time, row.delay, row.absolute_position, row.time_delay, row.num_events };
+			memcpy(ptr, &record, sizeof(record));
+			ptr += sizeof(record);
+		}
+		for (const MidiEvent &evt : midi_events) {
+			const CompiledSongEvent record = { evt.type, evt.channel, evt.sub_type, evt.is_valid, evt.track, evt.data_size,
+				{ evt.data[0], evt.data[1], evt.data[2], evt.data[3] }, evt.data_offset };
+			memcpy(ptr, &record, sizeof(record));
+			ptr += sizeof(record);
+		}
+		if (!midi_event_data.empty()) {
+			memcpy(ptr, midi_event_data.data(), midi_event_data.size());
+			ptr += midi_event_data.size();
+		}
+		for (const LoopStackEntry &entry : midi_loop.stack) {
+			const CompiledSongLoop record = { (uint8_t)(entry.infinity ? 1 : 0), entry.loops, entry.start, entry.end };
+			memcpy(ptr, &record, sizeof(record));
+			ptr += sizeof(record);
+		}
+		return true;
 	}
 
 	void rewind() {
 		midi_current_position = midi_track_begin_position;
+		midi_tempo = midi_start_tempo;
 		midi_at_end = false;
 
 		midi_loop.loops_count = midi_loop_count;
@@ -4773,7 +6586,167 @@ public:
 		midi_time.reset();
 	}
 
+	// Moves playback to p_tick or p_seconds, whichever comes first, without rendering anything:
+	// the song is replayed from the start with every event that changes channel or sequencer
+	// state, while notes are only kept track of. Those still held at the target are started
+	// again when p_restart_notes is set. Loops are not followed, the song is read straight through
+	void seek(uint64_t p_tick, double p_seconds, bool p_restart_notes) {
+		if (midi_loader.active) {
+			finish_loading(midi_synth->load_threads);
+		}
+		rewind();
+		midi_standard = Synthesizer::Standard::GM;
+		// the song is replayed as it would be heard from the start, so nothing set before
+		// the seek (programs, banks, RPNs, tuning) carries over
+		for (Channel *channel : midi_channels) {
+			channel->reset();
+		}
+
+		// velocity of each held note, and which of them are only held by the sustain pedal
+		uint8_t held[NUM_CHANNELS][MAX_KEY + 1] = {};
+		bool pedal_held[NUM_CHANNELS][MAX_KEY + 1] = {};
+		bool pedal[NUM_CHANNELS] = {};
+
+		uint64_t ticks = 0;
+		double time = 0.0;
+		bool reached = false;
+		int32_t status = 0;
+		while (midi_current_position.row < midi_rows.size()) {
+			// the rows due at the target are left for playback
+			if (ticks >= p_tick || time >= p_seconds) {
+				reached = true;
+				break;
+			}
+
+			const Position row_begin_position(midi_current_position);
+			const MidiTrackRow &row = midi_rows[midi_current_position.row++];
+			for (size_t i = row.first_event; i < row.first_event + row.num_events; i++) {
+				const MidiEvent &evt = midi_events[i];
+				const size_t ch = evt.channel;
+				if ((evt.type == MidiEvent::NOTE_ON || evt.type == MidiEvent::NOTE_OFF) && ch < NUM_CHANNELS) {
+					const uint8_t key = evt.data[0] & MAX_KEY;
+					if (evt.type == MidiEvent::NOTE_ON) {
+						held[ch][key] = channel_disabled[ch] ? 0 : evt.data[1];
+						pedal_held[ch][key] = false;
+					} else if (pedal[ch]) {
+						pedal_held[ch][key] = held[ch][key] != 0;
+					} else {
+						held[ch][key] = 0;
+					}
+					continue;
+				}
+
+				handle_event(evt.track, evt, status);
+
+				if (evt.type == MidiEvent::CONTROL_CHANGE && ch < NUM_CHANNELS) {
+					switch (evt.data[0]) {
+						case 64: // Sustain
+						case 121: // ResetAllControllers
+							pedal[ch] = evt.data[0] == 64 && evt.data[1] >= 64;
+							for (uint8_t key = 0; key <= MAX_KEY && !pedal[ch]; ++key) {
+								if (pedal_held[ch][key]) {
+									held[ch][key] = 0;
+									pedal_held[ch][key] = false;
+								}
+							}
+							break;
+						case 120: // AllSoundOff
+							memset(held[ch], 0, sizeof(held[ch]));
+							memset(pedal_held[ch], 0, sizeof(pedal_held[ch]));
+							break;
+						case 123: // AllNotesOff
+							for (uint8_t key = 0; key <= MAX_KEY; ++key) {
+								if (pedal[ch]) {
+									pedal_held[ch][key] = held[ch][key] != 0;
+								} else {
+									held[ch][key] = 0;
+								}
+							}
+							break;
+						default:
+							break;
+					}
+				}
+
+				// nested loop starts are still recorded, so that playing on from the target
+				// loops back to the right place
+				if (midi_loop.caught_stack_start) {
+					midi_loop.stack_up();
+					midi_loop.get_current_stack().start_position = row_begin_position;
+				}
+				if ((midi_loop.caught_stack_end || midi_loop.caught_stack_break) && midi_loop.stack_level >= 0) {
+					midi_loop.stack_down();
+				}
+				midi_loop.caught_start = false;
+				midi_loop.caught_end = false;
+				midi_loop.caught_stack_start = false;
+				midi_loop.caught_stack_end = false;
+				midi_loop.caught_stack_break = false;
+			}
+
+			if (midi_current_position.row == midi_rows.size()) {
+				break; // the song ends before the target
+			}
+			ticks += row.delay;
+			time = midi_rows[midi_current_position.row].time;
+		}
+		midi_loop.caught_start = false;
+
+		// time left until the rows due next, as process_events would leave it
+		double wait = 0.0;
+		if (reached) {
+			wait = ticks >= p_tick ? (midi_tempo * (ticks - p_tick)).value() : time - p_seconds;
+		}
+		// in whole frames from the song start, as the rows' own delays are
+		midi_current_position.absolute_frame_position = frames_at(time - wait);
+		midi_current_position.wait = (int64_t)(frames_at(time) - midi_current_position.absolute_frame_position);
+
+		if (p_restart_notes) {
+			for (size_t ch = 0; ch < NUM_CHANNELS; ++ch) {
+				Channel *channel = midi_channels[ch];
+				for (uint8_t key = 0; key <= MAX_KEY && channel->has_preset(); ++key) {
+					if (held[ch][key]) {
+						channel->note_on(key, held[ch][key]);
+						// the channel's sustain pedal is down again, so this leaves the note sustained
+						if (pedal_held[ch][key]) {
+							channel->note_off(key);
+						}
+					}
+				}
+			}
+		}
+	}
+
 private:
+	// Takes the next p_length bytes of the song as the data of a track. A song in memory is
+	// used in place, so it has to stay there until the song is loaded; a file is copied
+	bool read_track_data(FileAndMemReader *p_mfr, size_t p_length, TrackData &p_track) {
+		if (p_mfr->get_data()) {
+			p_track.size = p_mfr->read_in_place(&p_track.data, p_length);
+		} else {
+			p_track.copy.resize(p_length);
+			p_track.size = p_mfr->read(p_track.copy.data(), 1, p_length);
+			p_track.data = p_track.copy.data();
+		}
+		return p_track.size == p_length;
+	}
+
+	// Adds p_tail to the end of a track that does not end with an End Of Track event already,
+	// copying the track when it is the song's own memory
+	static void end_track_data(TrackData &p_track, const uint8_t *p_tail, size_t p_tail_size) {
+		static const uint8_t END_OF_TRACK[3] = { 0xFF, 0x2F, 0x00 };
+		if (p_track.size >= sizeof(END_OF_TRACK) &&
+				memcmp(p_track.data + p_track.size - sizeof(END_OF_TRACK), END_OF_TRACK, sizeof(END_OF_TRACK)) == 0) {
+			return;
+		}
+		if (p_track.data != p_track.copy.data()) {
+			p_track.copy.assign(p_track.data, p_track.data + p_track.size);
+		}
+		p_track.copy.insert(p_track.copy.end(), p_tail, p_tail + p_tail_size);
+		p_track.data = p_track.copy.data();
+		p_track.size = p_track.copy.size();
+	}
+
 	bool detect_rsxx(const char *p_head, FileAndMemReader *p_mfr) {
 		char header_buf[7] = "";
 		bool ret = false;
@@ -4795,7 +6768,7 @@ private:
 		char header_buf[MIDI_PARSE_HEADER_SIZE] = "";
 		size_t fsize = 0;
 		size_t delta_ticks = 192, track_count = 1;
-		std::vector<std::vector<uint8_t>> raw_track_data;
+		std::vector<TrackData> raw_track_data;
 
 		fsize = p_mfr->read(header_buf, 1, MIDI_PARSE_HEADER_SIZE);
 		if (fsize < MIDI_PARSE_HEADER_SIZE) {
@@ -4836,19 +6809,18 @@ private:
 			p_mfr->seek((long)(pos), SEEK_SET);
 
 			// Read track data
-			raw_track_data[tk].resize(track_length);
-			fsize = p_mfr->read(&raw_track_data[tk][0], 1, track_length);
-			if (fsize < track_length) {
+			if (!read_track_data(p_mfr, track_length, raw_track_data[tk])) {
 				return false;
 			}
-			total_gotten += fsize;
+			total_gotten += raw_track_data[tk].size;
 
 			// Finalize raw track data with a zero
-			raw_track_data[tk].push_back(0);
+			static const uint8_t ZeroTag[1] = { 0x00 };
+			end_track_data(raw_track_data[tk], ZeroTag, sizeof(ZeroTag));
 		}
 
 		for (size_t tk = 0; tk < track_count; ++tk) {
-			total_gotten += raw_track_data[tk].size();
+			total_gotten += raw_track_data[tk].size;
 		}
 
 		if (total_gotten == 0) {
@@ -4870,7 +6842,7 @@ private:
 		char header_buf[MIDI_PARSE_HEADER_SIZE] = "";
 		size_t fsize = 0;
 		size_t delta_ticks = 192, track_count = 1;
-		std::vector<std::vector<uint8_t>> raw_track_data;
+		std::vector<TrackData> raw_track_data;
 
 		fsize = p_mfr->read(header_buf, 1, MIDI_PARSE_HEADER_SIZE);
 		if (fsize < MIDI_PARSE_HEADER_SIZE) {
@@ -4887,7 +6859,7 @@ private:
 		raw_track_data.resize(track_count);
 		midi_individual_tick_delta = FixedFraction(1, 1000000l * (uint64_t)(delta_ticks));
 		midi_tempo = FixedFraction(1, (uint64_t)(delta_ticks) * 2);
-		static const unsigned char EndTag[4] = { 0xFF, 0x2F, 0x00, 0x00 };
+		static const uint8_t EndTag[4] = { 0xFF, 0x2F, 0x00, 0x00 };
 		size_t total_gotten = 0;
 
 		for (size_t tk = 0; tk < track_count; ++tk) {
@@ -4899,21 +6871,16 @@ private:
 			p_mfr->seek((long)(pos), SEEK_SET);
 
 			// Read track data
-			raw_track_data[tk].resize(track_length);
-			fsize = p_mfr->read(&raw_track_data[tk][0], 1, track_length);
-			if (fsize < track_length) {
+			if (!read_track_data(p_mfr, track_length, raw_track_data[tk])) {
 				return false;
 			}
-			total_gotten += fsize;
+			total_gotten += raw_track_data[tk].size;
 			// Note: GMF does include the track end tag.
-			raw_track_data[tk].push_back(EndTag[0]);
-			raw_track_data[tk].push_back(EndTag[1]);
-			raw_track_data[tk].push_back(EndTag[2]);
-			raw_track_data[tk].push_back(EndTag[3]);
+			end_track_data(raw_track_data[tk], EndTag, sizeof(EndTag));
 		}
 
 		for (size_t tk = 0; tk < track_count; ++tk) {
-			total_gotten += raw_track_data[tk].size();
+			total_gotten += raw_track_data[tk].size;
 		}
 
 		if (total_gotten == 0) {
@@ -4933,7 +6900,7 @@ private:
 		size_t fsize = 0;
 		size_t delta_ticks = 192, track_count = 1;
 		unsigned smf_format = 0;
-		std::vector<std::vector<uint8_t>> raw_track_data;
+		std::vector<TrackData> raw_track_data;
 
 		fsize = p_mfr->read(header_buf, 1, MIDI_PARSE_HEADER_SIZE);
 		if (fsize < MIDI_PARSE_HEADER_SIZE) {
@@ -4970,17 +6937,15 @@ private:
 			track_length = (size_t)read_int_big_endian(header_buf + 4, 4);
 
 			// Read track data
-			raw_track_data[tk].resize(track_length);
-			fsize = p_mfr->read(&raw_track_data[tk][0], 1, track_length);
-			if (fsize < track_length) {
+			if (!read_track_data(p_mfr, track_length, raw_track_data[tk])) {
 				return false;
 			}
 
-			total_gotten += fsize;
+			total_gotten += raw_track_data[tk].size;
 		}
 
 		for (size_t tk = 0; tk < track_count; ++tk) {
-			total_gotten += raw_track_data[tk].size();
+			total_gotten += raw_track_data[tk].size;
 		}
 
 		if (total_gotten == 0) {
@@ -4998,6 +6963,144 @@ private:
 		return true;
 	}
 
+	bool parse_mus(FileAndMemReader *p_mfr) {
+		MUSHeader header;
+		if (p_mfr->read(&header, 1, sizeof(header)) < sizeof(header) || memcmp(header.id, MUS_MAGIC, 4) != 0) {
+			return false;
+		}
+		if (p_mfr->file_size() != (size_t)header.score_start + header.score_length) {
+			return false;
+		}
+
+		midi_format = FileFormat::MUS;
+		// MUS plays at 140 ticks per second, which is 70 ticks per quarter note at 120 BPM
+		const uint64_t delta_ticks = 70;
+		midi_individual_tick_delta = FixedFraction(1, 1000000l * delta_ticks);
+		midi_tempo = FixedFraction(1, delta_ticks * 2);
+
+		// The score is a single track, read as it is
+		std::vector<TrackData> raw_track_data(1);
+		p_mfr->seek(header.score_start, SEEK_SET);
+		if (!read_track_data(p_mfr, header.score_length, raw_track_data[0])) {
+			return false;
+		}
+
+		// Build new MIDI events table
+		if (!build_smf_track_data(raw_track_data)) {
+			return false;
+		}
+
+		midi_smf_format = 0;
+		midi_loop.stack_level = -1;
+
+		return true;
+	}
+
+	// Loads a song written by save_compiled as it was saved, without reading or timing a track
+	bool parse_compiled(FileAndMemReader *p_mfr) {
+		CompiledSongHeader header;
+		if (p_mfr->read(&header, 1, sizeof(header)) < sizeof(header) || memcmp(header.id, COMPILED_SONG_MAGIC, 4) != 0) {
+			return false;
+		}
+		if (header.byte_order != COMPILED_SONG_BYTE_ORDER || header.version != COMPILED_SONG_VERSION ||
+				header.format > (uint8_t)FileFormat::MUS || header.loop_format > (uint8_t)LoopFormat::HMI ||
+				header.tick_delta_den == 0 || header.tempo_den == 0) {
+			return false;
+		}
+
+		// Every count is checked against what is left of the file before the sizes are added up
+		size_t left = p_mfr->file_size() - sizeof(header);
+		const uint64_t counts[4] = { header.row_count, header.event_count, header.event_data_size, header.loop_stack_size };
+		const size_t record_sizes[4] = { sizeof(CompiledSongRow), sizeof(CompiledSongEvent), 1, sizeof(CompiledSongLoop) };
+		for (size_t i = 0; i < 4; i++) {
+			if (counts[i] > left / record_sizes[i]) {
+				return false;
+			}
+			left -= (size_t)counts[i] * record_sizes[i];
+		}
+		if (header.loop_begin_row > header.row_count) {
+			return false;
+		}
+		TrackData body;
+		if (!read_track_data(p_mfr, p_mfr->file_size() - sizeof(header) - left, body)) {
+			return false;
+		}
+
+		build_smf_setup_reset();
+		const uint8_t *ptr = body.data;
+		midi_rows.resize((size_t)header.row_count);
+		size_t first_event = 0;
+		for (MidiTrackRow &row : midi_rows) {
+			CompiledSongRow record;
+			memcpy(&record, ptr, sizeof(record));
+			ptr += sizeof(record);
+			row.time = record.time;
+			row.delay = record.delay;
+			row.absolute_position = record.absolute_position;
+			row.time_delay = record.time_delay;
+			row.frame_delay = frames_at(record.time + record.time_delay) - frames_at(record.time);
+			row.first_event = first_event;
+			row.num_events = record.num_events;
+			first_event += record.num_events;
+			if (first_event > header.event_count) {
+				build_smf_setup_reset();
+				return false;
+			}
+		}
+		midi_events.resize((size_t)header.event_count);
+		for (MidiEvent &evt : midi_events) {
+			CompiledSongEvent record;
+			memcpy(&record, ptr, sizeof(record));
+			ptr += sizeof(record);
+			evt.type = record.type;
+			evt.channel = record.channel;
+			evt.sub_type = record.sub_type;
+			evt.is_valid = record.is_valid;
+			evt.track = record.track;
+			evt.data_size = record.data_size;
+			memcpy(evt.data, record.data, sizeof(evt.data));
+			evt.data_offset = record.data_offset;
+			if (evt.channel >= NUM_CHANNELS || (evt.data_size > sizeof(evt.data) &&
+					(evt.data_offset > header.event_data_size || evt.data_size > header.event_data_size - evt.data_offset))) {
+				build_smf_setup_reset();
+				return false;
+			}
+		}
+		midi_event_data.assign(ptr, ptr + header.event_data_size);
+		ptr += header.event_data_size;
+		midi_loop.stack.resize((size_t)header.loop_stack_size);
+		for (LoopStackEntry &entry : midi_loop.stack) {
+			CompiledSongLoop record;
+			memcpy(&record, ptr, sizeof(record));
+			ptr += sizeof(record);
+			entry.infinity = record.infinity != 0;
+			entry.loops = record.loops;
+			entry.start = record.start;
+			entry.end = record.end;
+		}
+
+		midi_format = (FileFormat)header.format;
+		midi_smf_format = header.smf_format;
+		midi_loop_format = (LoopFormat)header.loop_format;
+		midi_loop.invalid_loop = header.invalid_loop != 0;
+		midi_individual_tick_delta = FixedFraction(header.tick_delta_num, header.tick_delta_den);
+		midi_tempo = FixedFraction(header.tempo_num, header.tempo_den);
+		midi_start_tempo = midi_tempo;
+		midi_full_song_time_length = header.length;
+		midi_loop_start_time = header.loop_start_time;
+		midi_loop_end_time = header.loop_end_time;
+
+		midi_track_begin_position = midi_current_position;
+		midi_loop_begin_position = midi_current_position;
+		midi_loop_begin_position.row = (size_t)header.loop_begin_row;
+		midi_loop_begin_position.absolute_frame_position = frames_at(header.loop_begin_time);
+		midi_loop.stack_level = -1;
+		midi_loop.loops_count = midi_loop_count;
+		midi_loop.loops_left = midi_loop_count;
+
+		return true;
+	}
+
 	bool parse_rmi(FileAndMemReader *p_mfr) {
 		char header_buf[MIDI_PARSE_HEADER_SIZE] = "";
 
@@ -5018,86 +7121,61 @@ private:
 };
 
 Synthesizer::Synthesizer(float p_rate, size_t p_voices) :
-		standard(Standard::GM), volume(1.0f) {
+		output_rate(p_rate), volume(1.0f), load_error(false), load_threads(1), sample_cache_size(0), compact_samples(false), incremental_loading(false) {
 	initialize_conversion_tables();
 
 	voices.reserve(p_voices);
 	for (size_t i = 0; i < p_voices; ++i) {
 		voices.push_back(new Voice());
 	}
-
-	channels.reserve(NUM_CHANNELS);
-	for (size_t i = 0; i < NUM_CHANNELS; ++i) {
-		channels.push_back(new Channel(i, p_rate, &voices));
-	}
+	voice_pool = new VoicePool(voices);
 
 	soundfont = nullptr;
-	sequencer = new Sequencer(p_rate, 2 * sizeof(float), this);
+	sequencer = new Sequencer(p_rate, this);
+	sequencers.push_back(sequencer);
 	no_drums = false;
 	no_piano = false;
 }
 
 Synthesizer::~Synthesizer() {
-	sequencer->full_reset();
+	// the sequencers' channels unlink their voices, so they go first
+	for (Sequencer *layer : sequencers) {
+		layer->full_reset();
+		delete layer;
+	}
 	delete soundfont;
-	delete sequencer;
+	delete voice_pool;
 	for (Voice *voice : voices) {
 		delete voice;
 	}
-	for (Channel *channel : channels) {
-		delete channel;
-	}
 }
 
 bool Synthesizer::load_soundfont(const char *p_filename) {
-	if (soundfont) {
-		delete soundfont;
-	}
 	FileAndMemReader *p_font = new FileAndMemReader;
 	p_font->open_file(p_filename);
-	if (!p_font->is_valid()) {
-		delete p_font;
-		return false;
-	}
-	load_error = false;
-#ifdef TINYPRIMESYNTH_FLAC_SUPPORT
-	char flac_check[4];
-	p_font->read(&flac_check, 1, 4);
-	p_font->seek(0, SEEK_SET);
-	if (!memcmp(flac_check, FLAC_MAGIC, 4)) {
-		FLACBitStream decoder(p_font);
-		std::vector<uint8_t> decoded = decode_sf2_flac(decoder);
-		delete p_font;
-		if (decoded.empty()) {
-			return false;
-		} else {
-			FileAndMemReader *font = new FileAndMemReader;
-			font->open_data(decoded.data(), decoded.size());
-			soundfont = new SoundFont(font, this);
-			decoded.clear();
-			delete font;
-			return !load_error;
-		}
-	} else {
-		soundfont = new SoundFont(p_font, this);
-		delete p_font;
-		return !load_error;
-	}
-#else
-	soundfont = new SoundFont(p_font, this);
+	bool result = load_soundfont_from(p_font);
 	delete p_font;
-	return !load_error;
-#endif
+	return result;
 }
 
 bool Synthesizer::load_soundfont(const uint8_t *p_data, size_t p_length) {
+	FileAndMemReader *p_font = new FileAndMemReader;
+	p_font->open_data(p_data, p_length);
+	bool result = load_soundfont_from(p_font);
+	delete p_font;
+	return result;
+}
+
+bool Synthesizer::load_soundfont_from(FileAndMemReader *p_font) {
 	if (soundfont) {
+		// voices may still be reading the old soundfont's samples
+		for (Voice *voice : voices) {
+			voice->set_status(Voice::State::FINISHED);
+		}
 		delete soundfont;
+		soundfont = nullptr;
 	}
-	FileAndMemReader *p_font = new FileAndMemReader;
-	p_font->open_data(p_data, p_length);
 	if (!p_font->is_valid()) {
-		delete p_font;
 		return false;
 	}
 	load_error = false;
@@ -5105,30 +7183,34 @@ bool Synthesizer::load_soundfont(const uint8_t *p_data, size_t p_length) {
 	char flac_check[4];
 	p_font->read(&flac_check, 1, 4);
 	p_font->seek(0, SEEK_SET);
-	if (!memcmp(flac_check, FLAC_MAGIC, 4)) {
-		FLACBitStream decoder(p_font);
-		std::vector<uint8_t> decoded = decode_sf2_flac(decoder);
-		delete p_font;
+	if (!memcmp(flac_check, FLAC_MAGIC, 4) && sample_cache_size) {
+		std::vector<uint8_t> header;
+		SampleCache *cache = open_sf2_flac_samples(p_font, sample_cache_size, header);
+		if (!cache) {
+			return false;
+		}
+		soundfont = new SoundFont(header, cache, this);
+		return !load_error;
+	} else if (!memcmp(flac_check, FLAC_MAGIC, 4)) {
+		std::vector<int16_t> decoded = decode_sf2_flac(p_font, load_threads);
 		if (decoded.empty()) {
 			return false;
 		} else {
-			FileAndMemReader *font = new FileAndMemReader;
-			font->open_data(decoded.data(), decoded.size());
-			soundfont = new SoundFont(font, this);
-			decoded.clear();
-			delete font;
+			soundfont = new SoundFont(decoded, this);
 			return !load_error;
 		}
-	} else {
-		soundfont = new SoundFont(p_font, this);
-		delete p_font;
+	} else if (sample_cache_size) {
+		std::vector<uint8_t> header;
+		SampleCache *cache = open_sf2_compressed_samples(p_font, sample_cache_size, load_threads, header);
+		if (!cache) {
+			return false;
+		}
+		soundfont = new SoundFont(header, cache, this);
 		return !load_error;
 	}
-#else
+#endif
 	soundfont = new SoundFont(p_font, this);
-	delete p_font;
 	return !load_error;
-#endif
 }
 
 bool Synthesizer::load_song(const char *p_filename) {
@@ -5155,6 +7237,23 @@ bool Synthesizer::load_song(const uint8_t *p_data, size_t p_length) {
 	return result;
 }
 
+bool Synthesizer::save_compiled_song(const char *p_filename) {
+	std::vector<uint8_t> data;
+	if (!save_compiled_song(data)) {
+		return false;
+	}
+	FILE *file = fopen(p_filename, "wb");
+	if (!file) {
+		return false;
+	}
+	const bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+	return fclose(file) == 0 && written;
+}
+
+bool Synthesizer::save_compiled_song(std::vector<uint8_t> &p_data) {
+	return sequencer->save_compiled(p_data);
+}
+
 bool Synthesizer::get_load_error(void) const {
 	return load_error;
 }
@@ -5167,8 +7266,121 @@ void Synthesizer::set_volume(float p_volume) {
 	volume = fmax(0.0f, p_volume);
 }
 
+void Synthesizer::set_voice_stealing_weights(float p_released, float p_sustained, float p_age) {
+	voice_pool->set_weights(p_released, p_sustained, p_age);
+}
+
+void Synthesizer::set_load_threads(unsigned int p_threads) {
+#ifdef TINYPRIMESYNTH_NO_THREADS
+	(void)p_threads;
+	load_threads = 1;
+#else
+	load_threads = p_threads ? p_threads : std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+void Synthesizer::set_sample_cache_size(size_t p_bytes) {
+	sample_cache_size = p_bytes;
+}
+
+void Synthesizer::set_compact_samples(bool p_compact) {
+	compact_samples = p_compact;
+}
+
+void Synthesizer::set_incremental_loading(bool p_incremental) {
+	incremental_loading = p_incremental;
+}
+
+void Synthesizer::set_song_layers(size_t p_count) {
+	p_count = std::max((size_t)1, p_count);
+	while (sequencers.size() > p_count) {
+		if (sequencer == sequencers.back()) {
+			sequencer = sequencers[0];
+		}
+		delete sequencers.back();
+		sequencers.pop_back();
+	}
+	while (sequencers.size() < p_count) {
+		sequencers.push_back(new Sequencer((uint32_t)output_rate, this));
+	}
+}
+
+void Synthesizer::select_song_layer(size_t p_layer) {
+	if (p_layer < sequencers.size()) {
+		sequencer = sequencers[p_layer];
+	}
+}
+
+void Synthesizer::set_song_layer_volume(size_t p_layer, float p_volume) {
+	if (p_layer < sequencers.size()) {
+		sequencers[p_layer]->set_volume(fmax(0.0f, p_volume));
+	}
+}
+
+Synthesizer::SampleCacheStats Synthesizer::get_sample_cache_stats() const {
+	SampleCacheStats stats = {};
+	if (soundfont && soundfont->get_sample_cache()) {
+		soundfont->get_sample_cache()->get_stats(stats);
+	}
+	return stats;
+}
+
+// Renders until the stream is full or every song layer has ended. Each pass renders up to the
+// next frame that a row of any layer is due on, mixing the voices of every layer at once
 int Synthesizer::play_stream(uint8_t *p_stream, size_t p_length) {
-	return sequencer->play_stream(p_stream, p_length);
+	static constexpr size_t FRAME_SIZE = 2 * sizeof(float);
+	size_t left = p_length / FRAME_SIZE;
+	float *buffer = (float *)p_stream;
+	size_t count = 0;
+
+	for (Sequencer *layer : sequencers) {
+		layer->read_ahead();
+	}
+
+	while (left > 0) {
+		uint64_t period_size = left;
+		bool playing = false;
+		for (const Sequencer *layer : sequencers) {
+			if (layer->is_playing()) {
+				playing = true;
+				period_size = std::min(period_size, layer->frames_until_due());
+			}
+		}
+		if (!playing) {
+			break; // Stop to fetch samples once every song has reached its end
+		}
+
+		if (p_stream) {
+			for (size_t samp = 0; samp < period_size * 2; samp += 2) {
+				StereoValue sum{ 0.0f, 0.0f };
+				for (Voice *voice : voices) {
+					Voice::State status = voice->get_status();
+					if (status == Voice::State::FINISHED || status == Voice::State::UNUSED) {
+						continue;
+					}
+					voice->update();
+					if (voice->get_status() == Voice::State::FINISHED) {
+						continue;
+					}
+					sum += voice->render() * voice->get_song_volume();
+				}
+				sum = sum * volume;
+				buffer[samp] = sum.left;
+				buffer[samp + 1] = sum.right;
+			}
+			buffer += period_size * 2;
+			count += (size_t)period_size;
+			left -= (size_t)period_size;
+		}
+
+		for (Sequencer *layer : sequencers) {
+			if (layer->is_playing()) {
+				layer->advance(period_size);
+			}
+		}
+	}
+
+	return (int)(count * FRAME_SIZE);
 }
 
 const Synthesizer::Preset *Synthesizer::find_preset(uint16_t p_bank, uint16_t p_id) {
@@ -5201,18 +7413,21 @@ const Synthesizer::Preset *Synthesizer::find_preset(uint16_t p_bank, uint16_t p_
 }
 
 void Synthesizer::pause() {
+	std::vector<Channel *> &channels = sequencer->get_channels();
 	for (size_t chan = 0; chan < NUM_CHANNELS; chan++) {
 		channels[chan]->control_change(123, 0); // AllNotesOff
 	}
 }
 
 void Synthesizer::stop() {
+	std::vector<Channel *> &channels = sequencer->get_channels();
 	for (size_t chan = 0; chan < NUM_CHANNELS; chan++) {
 		channels[chan]->control_change(120, 0); // AllSoundOff
 	}
 }
 
 void Synthesizer::reset() {
+	std::vector<Channel *> &channels = sequencer->get_channels();
 	for (size_t chan = 0; chan < NUM_CHANNELS; chan++) {
 		channels[chan]->control_change(120, 0); // AllSoundOff
 		channels[chan]->control_change(64, 0); // Sustain (release)
@@ -5229,6 +7444,18 @@ void Synthesizer::rewind() {
 	sequencer->rewind();
 }
 
+void Synthesizer::seek(double p_seconds, bool p_restart_notes) {
+	sequencer->seek(UINT64_MAX, std::max(0.0, p_seconds), p_restart_notes);
+}
+
+void Synthesizer::seek_tick(uint64_t p_tick, bool p_restart_notes) {
+	sequencer->seek(p_tick, HUGE_VAL, p_restart_notes);
+}
+
+double Synthesizer::get_song_length() const {
+	return sequencer->get_song_length();
+}
+
 } // namespace tinyprimesynth
 
 #endif // TINYPRIMESYNTH_IMPLEMENTATION